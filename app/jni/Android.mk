@@ -12,8 +12,8 @@ LOCAL_CFLAGS += -O3 -Wall -finline-functions -fPIC -I$(LOCAL_PATH)/include
 LOCAL_CFLAGS += -DHAVE_CONFIG_H -DCLASS_NAME=\"net/avs234/alsaplayer/AlsaPlayerSrv\"
 LOCAL_CFLAGS += -DBUILD_STANDALONE -DCPU_ARM
 #LOCAL_ARM_MODE := arm
-LOCAL_SRC_FILES := main.c alsa.c alsa_offload.c buffer.c alac_main.c wav_main.c compr.c compr0101.c compr0102.c
-LOCAL_LDLIBS := -llog -ldl
+LOCAL_SRC_FILES := main.c alsa.c alsa_offload.c buffer.c alac_main.c wav_main.c compr.c compr0101.c compr0102.c sched.c prefetch.c pipeline.c convert.c decimate.c
+LOCAL_LDLIBS := -llog -ldl -lm
 include $(BUILD_SHARED_LIBRARY)
 
 #include $(CLEAR_VARS)
@@ -12,6 +12,7 @@
 #include <pthread.h>
 #include <limits.h>
 #include <poll.h>
+#include <sched.h>
 #ifdef ANDROID
 #include <android/log.h>
 #endif
@@ -78,7 +79,8 @@ static char cards_file[] = "/sdcard/.alsaplayer/cards.xml";
 static char cards_file[PATH_MAX];
 char *ext_cards_file = 0;
 int forced_chunks = 0, forced_chunk_size = 0;
-int force_mmap = 0, force_ring_buffer = 0;
+int force_mmap = 0, force_ring_buffer = 0, force_downmix = 0;
+struct bufset forced_bufset = { 0, 0, 0 };
 #endif
 
 /* free per track params */
@@ -277,6 +279,12 @@ int alsa_select_device(playback_ctx *ctx, int card, int device)
 	priv = (alsa_priv *) ctx->alsa_priv;	
 	priv->card = card;	
 	priv->device = device;
+	priv->bufset.min_ms = BUFSET_MIN_MS;
+	priv->bufset.max_ms = BUFSET_MAX_MS;
+	priv->bufset.max_kb = BUFSET_MAX_KB;
+	priv->schedset.policy = SCHED_FIFO;
+	priv->schedset.prio = 10;
+	priv->schedset.writer_cpu = priv->schedset.decoder_cpu = -1;
 
 	if(!ctx->ctls && init_mixer_controls(ctx, card) != 0) {
 	    log_err("cannot open mixer for card %d", card);
@@ -388,12 +396,22 @@ int alsa_select_device(playback_ctx *ctx, int card, int device)
 			p->type, p->val, p->periods, p->period_size);
 		}
 	    } else log_info("No buffer settings found.");
+	    if(xml_dev_find_bufset(xml_dev, &priv->bufset)) 
+		log_info("bufset min_ms=%d max_ms=%d max_kb=%d", 
+		    priv->bufset.min_ms, priv->bufset.max_ms, priv->bufset.max_kb);
+	    if(xml_dev_find_schedset(xml_dev, &priv->schedset)) 
+		log_info("sched policy=%d prio=%d/%d cpu=%d/%d mlock=%d", priv->schedset.policy, 
+		    priv->schedset.prio, priv->schedset.decoder_prio, priv->schedset.writer_cpu, 
+		    priv->schedset.decoder_cpu, priv->schedset.mlock);
 	}
 #ifndef ANDROID
 	if(force_mmap) {
 	    log_info("forcing mmapped playback");
 	    priv->is_mmapped = 1;
 	}
+	if(forced_bufset.min_ms) priv->bufset.min_ms = forced_bufset.min_ms;
+	if(forced_bufset.max_ms) priv->bufset.max_ms = forced_bufset.max_ms;
+	if(forced_bufset.max_kb) priv->bufset.max_kb = forced_bufset.max_kb;
 #endif
 	/* fire up */
 	if(nvstart) {
@@ -526,6 +544,9 @@ int alsa_start(playback_ctx *ctx)
     alsa_priv *priv = (alsa_priv *) ctx->alsa_priv;
     int conf_periods = 0, conf_period_size = 0;
     struct perset *pers;
+    int downmix = ctx->downmix;
+
+	ctx->downmix = 0;	/* to be set again by the next decoder */
 
 	for(pers = priv->perset; pers; pers = pers->next) {
 	    if(pers->type == PERSET_DEFAULT) {
@@ -558,6 +579,7 @@ int alsa_start(playback_ctx *ctx)
 	}
 	priv->format = &supp_formats[i];
 	ctx->rate_dec = 0;
+	ctx->block_write = 0;
 
 	for(k = 0, ret = 1; k <= 2 && ret; k++) {
 	    for(i = 0; i < n_supp_rates; i++) {
@@ -612,6 +634,18 @@ int alsa_start(playback_ctx *ctx)
 	}
 	log_info("pcm opened");
 
+	if(downmix && ctx->channels > 2 && downmix_matrix(ctx->channels, ctx->dmx)) {
+	    setup_hwparams(params, priv->format->fmt, ctx->samplerate, ctx->channels, 0, 0, priv->is_mmapped);
+	    downmix = ioctl(priv->fd, SNDRV_PCM_IOCTL_HW_REFINE, params) != 0;
+#ifndef ANDROID
+	    if(force_downmix) downmix = 1;
+#endif
+	    if(downmix) {
+		log_info("WARNING: %d channels not taken by hardware or not wanted, will be downmixed to stereo", ctx->channels);
+		ctx->channels = 2;
+	    }
+	}
+
 	if(conf_periods && conf_period_size) {
 	    setup_hwparams(params, priv->format->fmt, ctx->samplerate, ctx->channels, 
 			conf_periods, conf_period_size, priv->is_mmapped);
@@ -649,7 +683,7 @@ int alsa_start(playback_ctx *ctx)
 	log_info("Period size: min=%d\tmax=%d", persz_min, persz_max);
 	log_info("    Periods: min=%d\tmax=%d", periods_min, periods_max);
 
-	if(!priv->is_mmapped && ctx->block_min == ctx->block_max 
+	if(!priv->is_mmapped && !ctx->gapless && ctx->block_min == ctx->block_max 
 		&& (ctx->block_min >> ctx->rate_dec) <= persz_max 
 		&& (ctx->block_min >> ctx->rate_dec) >= persz_min
 #ifndef ANDROID
@@ -923,13 +957,16 @@ ssize_t alsa_write(playback_ctx *ctx, void *buf, size_t count)
     int i, written = 0;
     struct snd_xferi xf;
     struct snd_pcm_status pcm_stat;
+    struct timeval tstart;
+    enum playback_state state = get_state(ctx);
 
-	if(ctx->state != STATE_PLAYING && ctx->state != STATE_STOPPING && ctx->state != STATE_INTR) {
+	if(state != STATE_PLAYING && state != STATE_STOPPING && state != STATE_INTR) {
 	    log_err("stream must be closed or paused");	
 	    return 0;
 	}
 
 	priv = (alsa_priv *) ctx->alsa_priv;	
+	gettimeofday(&tstart, 0);
 
 	xf.buf = buf ? buf : priv->buf;
 	xf.frames = priv->chunk_size;
@@ -939,7 +976,7 @@ ssize_t alsa_write(playback_ctx *ctx, void *buf, size_t count)
 	    log_err("frames count %d larger than period size %d", (int) count, priv->chunk_size);
 	    count = priv->chunk_size;
 	} else if(count < priv->chunk_size) {
-	    log_info("short buffer %d < %d, must be EOF", (int) count, priv->chunk_size);	
+	    if(count) log_info("short buffer %d < %d, must be EOF", (int) count, priv->chunk_size);	
 	    if(buf) {
 		memcpy(priv->buf, buf, count * ctx->channels * priv->format->phys_bits/8);
 	    	xf.buf = priv->buf;	
@@ -977,6 +1014,7 @@ ssize_t alsa_write(playback_ctx *ctx, void *buf, size_t count)
 			break;
 		   case EPIPE:
 			log_info("underrun!");
+			stats_underrun(ctx);
 			ioctl(priv->fd, SNDRV_PCM_IOCTL_STATUS, &pcm_stat);
 			log_info("hw=%ld appl=%ld avail=%ld max=%ld", pcm_stat.hw_ptr, pcm_stat.appl_ptr, pcm_stat.avail, pcm_stat.avail_max);
 			if(ioctl(priv->fd, SNDRV_PCM_IOCTL_PREPARE) < 0) {
@@ -993,7 +1031,8 @@ ssize_t alsa_write(playback_ctx *ctx, void *buf, size_t count)
 	    }
 	    written += xf.result;
 	}	
-	ctx->written += count;
+	__atomic_fetch_add(&ctx->written, (int) count, __ATOMIC_RELAXED);	/* gapless switch may adjust it */
+	stats_write_done(ctx, &tstart);
     return written;
 }
 
@@ -1030,10 +1069,12 @@ ssize_t alsa_write_mmapped(playback_ctx *ctx, void *buf, size_t count)
     unsigned int pcm_offset;
     size_t written = 0, to_write;
     int f2b = ctx->channels * priv->format->phys_bits/8;	    
+    struct timeval tstart;
 
 #ifdef EXTRA_VERBOSE
     log_info("writing %d from %p to %p", (int) count, buf, priv->buf);
 #endif
+    gettimeofday(&tstart, 0);
     while(written != count) {	
 
 	to_write = count - written;
@@ -1055,6 +1096,7 @@ ssize_t alsa_write_mmapped(playback_ctx *ctx, void *buf, size_t count)
 	    ret = poll(&fds, 1, -1);
 	    if(ret < 0 || (fds.revents & (POLLERR | POLLNVAL))) {
 		if(errno == EINTR) continue;
+		if(fds.revents & POLLERR) stats_underrun(ctx);	/* xrun state */
                 if(errno) log_err("poll returned error: %s", strerror(errno));
                 return 0;
             } else if(ret == 0)	{
@@ -1076,7 +1118,7 @@ ssize_t alsa_write_mmapped(playback_ctx *ctx, void *buf, size_t count)
 	log_info("continuous avail %d", avail);
 #endif
 	memcpy(priv->buf + pcm_offset * f2b, buf + written * f2b, to_write * f2b);
-	if(ctx->state == STATE_STOPPING) {  /* dunno why it's needed with alsa */
+	if(get_state(ctx) == STATE_STOPPING) {  /* dunno why it's needed with alsa */
 	     memset(priv->buf + (priv->buffer_size - to_write + pcm_offset)*f2b, 0, 
 		priv->buffer_size - to_write); 
 	}
@@ -1094,6 +1136,7 @@ ssize_t alsa_write_mmapped(playback_ctx *ctx, void *buf, size_t count)
 	written += to_write;
     }
     ctx->written += count;	
+    stats_write_done(ctx, &tstart);
     return count;	
 }
 
@@ -1136,6 +1179,18 @@ int alsa_is_mmapped(playback_ctx *ctx)
     return ((alsa_priv *) ctx->alsa_priv)->is_mmapped;
 }
 
+const struct bufset *alsa_get_bufset(playback_ctx *ctx) 
+{
+    if(!ctx || !ctx->alsa_priv) return 0;
+    return &((alsa_priv *) ctx->alsa_priv)->bufset;
+}
+
+const struct schedset *alsa_get_schedset(playback_ctx *ctx) 
+{
+    if(!ctx || !ctx->alsa_priv) return 0;
+    return &((alsa_priv *) ctx->alsa_priv)->schedset;
+}
+
 bool alsa_pause(playback_ctx *ctx) 
 {
     alsa_stop(ctx);	
@@ -117,7 +117,7 @@ int alsa_play_offload(playback_ctx *ctx, int fd, off_t start_offset)
 	    goto err_exit;
 	}
 
-	if(ctx->state != STATE_STOPPED) {
+	if(get_state(ctx) != STATE_STOPPED) {
 	    log_info("context live, stopping");
 	    pthread_mutex_unlock(&ctx->mutex);  
 	    audio_stop(ctx); 
@@ -244,7 +244,7 @@ int alsa_play_offload(playback_ctx *ctx, int fd, off_t start_offset)
 	    goto err_exit;
 	}
 	log_info("playback started");
-	ctx->state = STATE_PLAYING;
+	set_state(ctx, STATE_PLAYING);
         ctx->alsa_error = 0;
 	ctx->audio_thread = 0;
 	pthread_mutex_unlock(&ctx->mutex);
@@ -35,6 +35,8 @@ typedef struct _alsa_priv {
     int  vol_analog[MAX_FMTS];			/* current analog/digital volumes; these are set */	
     int  vol_digital[MAX_FMTS];			/* to defaults when the device is switched */
     struct perset *perset;
+    struct bufset bufset;			/* buffer depth bounds */
+    struct schedset schedset;			/* thread policy */
 } alsa_priv;
 
 extern int alsa_get_rate(int rate);		/* SNDRV_PCM_RATE corresponding to numeric value */
@@ -3,7 +3,7 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := ape
 
-LOCAL_SRC_FILES +=  predictor.c decoder.c entropy.c parser.c filter-pre.c main.c
+LOCAL_SRC_FILES +=  predictor.c decoder.c entropy.c parser.c filter-pre.c main.c parallel.c
 #	filter_1280_15.c filter_16_11.c filter_256_13.c filter_32_10.c filter_64_11.c main.c
 
 LOCAL_CFLAGS += -O3 -Wall -DBUILD_STANDALONE -fPIC -UDEBUG -DNDEBUG -fomit-frame-pointer -I$(LOCAL_PATH)/../include -I$(LOCAL_PATH)/..
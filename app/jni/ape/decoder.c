@@ -23,6 +23,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110, USA
 */
 
 #include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "demac.h"
@@ -31,40 +32,64 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110, USA
 #include "filter.h"
 #include "demac_config.h"
 
-/* Statically allocate the filter buffers */
-
-#ifdef FILTER256_IRAM
-static filter_int filterbuf32[(32*3 + FILTER_HISTORY_SIZE) * 2]   
-                  IBSS_ATTR_DEMAC MEM_ALIGN_ATTR; 
-                  /* 2432 or 4864 bytes */
-static filter_int filterbuf256[(256*3 + FILTER_HISTORY_SIZE) * 2]
-                  IBSS_ATTR_DEMAC MEM_ALIGN_ATTR; 
-                  /* 5120 or 10240 bytes */
-#define FILTERBUF64 filterbuf256
-#define FILTERBUF32 filterbuf32
-#define FILTERBUF16 filterbuf32
-#else
-static filter_int filterbuf64[(64*3 + FILTER_HISTORY_SIZE) * 2]   
-                  IBSS_ATTR_DEMAC MEM_ALIGN_ATTR; 
-                  /* 2432 or 4864 bytes */
-static filter_int filterbuf256[(256*3 + FILTER_HISTORY_SIZE) * 2]
-                  MEM_ALIGN_ATTR; /* 5120 or 10240 bytes */
-#define FILTERBUF64 filterbuf64
-#define FILTERBUF32 filterbuf64
-#define FILTERBUF16 filterbuf64
-#endif
+/* Filter orders of each filter stage for compression levels 2000-5000 */
+static const int filter_orders[4][APE_FILTER_STAGES] = {
+    {   16,   0,    0 },
+    {   64,   0,    0 },
+    {   32, 256,    0 },
+    {   16, 256, 1280 }
+};
+
+int ape_simd = APE_SIMD_NONE;
+
+#define FILTERBUF_SIZE(order) (((order)*3 + FILTER_HISTORY_SIZE) * 2)
+
+/* Allocate the decoder state and the filter histories in one block.
+   Each history is a multiple of 64 bytes, so all of them stay aligned. */
+int ape_decoder_alloc(struct ape_ctx_t* ape_ctx)
+{
+    const int* orders = NULL;
+    size_t hdr = (sizeof(struct ape_decoder_t) + 63) & ~63;
+    size_t size = hdr;
+    filter_int* buf;
+    void* mem;
+    int i;
+
+    if ((ape_ctx->compressiontype % 1000) == 0 &&
+        ape_ctx->compressiontype >= 2000 && ape_ctx->compressiontype <= 5000)
+        orders = filter_orders[ape_ctx->compressiontype / 1000 - 2];
+
+    for (i = 0; orders && i < APE_FILTER_STAGES; i++)
+        if (orders[i])
+            size += FILTERBUF_SIZE(orders[i]) * sizeof(filter_int);
+
+    if (posix_memalign(&mem, 64, size) != 0)
+        return -1;
+    memset(mem, 0, hdr);
+    ape_ctx->dec = mem;
+
+    buf = (filter_int*) ((char*) mem + hdr);
+    for (i = 0; orders && i < APE_FILTER_STAGES; i++)
+        if (orders[i]) {
+            ape_ctx->dec->filterbuf[i] = buf;
+            buf += FILTERBUF_SIZE(orders[i]);
+        }
+
+    return 0;
+}
 
-/* This is only needed for "insane" files, and no current Rockbox targets
-   can hope to decode them in realtime, except the Gigabeat S (at 528MHz). */
-static filter_int filterbuf1280[(1280*3 + FILTER_HISTORY_SIZE) * 2] 
-                  IBSS_ATTR_DEMAC_INSANEBUF MEM_ALIGN_ATTR;
-                  /* 17408 or 34816 bytes */
+void ape_decoder_free(struct ape_ctx_t* ape_ctx)
+{
+    free(ape_ctx->dec);
+    ape_ctx->dec = NULL;
+}
 
 void init_frame_decoder(struct ape_ctx_t* ape_ctx,
-                        unsigned char* inbuffer, int* firstbyte,
-                        int* bytesconsumed)
+                        unsigned char* inbuffer, unsigned char* inbufferend,
+                        int* firstbyte, int* bytesconsumed)
 {
-    init_entropy_decoder(ape_ctx, inbuffer, firstbyte, bytesconsumed);
+    init_entropy_decoder(ape_ctx, inbuffer, inbufferend, firstbyte,
+                         bytesconsumed);
     //printf("CRC=0x%08x\n",ape_ctx->CRC);
     //printf("Flags=0x%08x\n",ape_ctx->frameflags);
 
@@ -73,28 +98,29 @@ void init_frame_decoder(struct ape_ctx_t* ape_ctx,
     switch (ape_ctx->compressiontype)
     {
         case 2000:
-            init_filter_16_11(FILTERBUF16);
+            init_filter_16_11(ape_ctx);
             break;
 
         case 3000:
-            init_filter_64_11(FILTERBUF64);
+            init_filter_64_11(ape_ctx);
             break;
 
         case 4000:
-            init_filter_256_13(filterbuf256);
-            init_filter_32_10(FILTERBUF32);
+            init_filter_256_13(ape_ctx);
+            init_filter_32_10(ape_ctx);
             break;
 
         case 5000:
-            init_filter_1280_15(filterbuf1280);
-            init_filter_256_13(filterbuf256);
-            init_filter_16_11(FILTERBUF32);
+            init_filter_1280_15(ape_ctx);
+            init_filter_256_13(ape_ctx);
+            init_filter_16_11(ape_ctx);
     }
 }
 
 int ICODE_ATTR_DEMAC decode_chunk(struct ape_ctx_t* ape_ctx,
-                                  unsigned char* inbuffer, int* firstbyte,
-                                  int* bytesconsumed,
+                                  unsigned char* inbuffer,
+                                  unsigned char* inbufferend,
+                                  int* firstbyte, int* bytesconsumed,
                                   int32_t* decoded0, int32_t* decoded1,
                                   int count)
 {
@@ -110,7 +136,7 @@ int ICODE_ATTR_DEMAC decode_chunk(struct ape_ctx_t* ape_ctx,
         & (APE_FRAMECODE_PSEUDO_STEREO|APE_FRAMECODE_STEREO_SILENCE))
         == APE_FRAMECODE_PSEUDO_STEREO)) {
 
-        entropy_decode(ape_ctx, inbuffer, firstbyte, bytesconsumed,
+        entropy_decode(ape_ctx, inbuffer, inbufferend, firstbyte, bytesconsumed,
                        decoded0, NULL, count);
 
         if (ape_ctx->frameflags & APE_FRAMECODE_MONO_SILENCE) {
@@ -121,22 +147,22 @@ int ICODE_ATTR_DEMAC decode_chunk(struct ape_ctx_t* ape_ctx,
         switch (ape_ctx->compressiontype)
         {
             case 2000:
-                apply_filter_16_11(ape_ctx->fileversion,0,decoded0,count);
+                apply_filter_16_11(ape_ctx,0,decoded0,count);
                 break;
     
             case 3000:
-                apply_filter_64_11(ape_ctx->fileversion,0,decoded0,count);
+                apply_filter_64_11(ape_ctx,0,decoded0,count);
                 break;
     
             case 4000:
-                apply_filter_32_10(ape_ctx->fileversion,0,decoded0,count);
-                apply_filter_256_13(ape_ctx->fileversion,0,decoded0,count);
+                apply_filter_32_10(ape_ctx,0,decoded0,count);
+                apply_filter_256_13(ape_ctx,0,decoded0,count);
                 break;
     
             case 5000:
-                apply_filter_16_11(ape_ctx->fileversion,0,decoded0,count);
-                apply_filter_256_13(ape_ctx->fileversion,0,decoded0,count);
-                apply_filter_1280_15(ape_ctx->fileversion,0,decoded0,count);
+                apply_filter_16_11(ape_ctx,0,decoded0,count);
+                apply_filter_256_13(ape_ctx,0,decoded0,count);
+                apply_filter_1280_15(ape_ctx,0,decoded0,count);
         }
 
         /* Now apply the predictor decoding */
@@ -161,7 +187,7 @@ int ICODE_ATTR_DEMAC decode_chunk(struct ape_ctx_t* ape_ctx,
         }
 #endif
     } else { /* Stereo */
-        entropy_decode(ape_ctx, inbuffer, firstbyte, bytesconsumed,
+        entropy_decode(ape_ctx, inbuffer, inbufferend, firstbyte, bytesconsumed,
                        decoded0, decoded1, count);
 
         if ((ape_ctx->frameflags & APE_FRAMECODE_STEREO_SILENCE)
@@ -174,29 +200,29 @@ int ICODE_ATTR_DEMAC decode_chunk(struct ape_ctx_t* ape_ctx,
         switch (ape_ctx->compressiontype)
         {
             case 2000:
-                apply_filter_16_11(ape_ctx->fileversion,0,decoded0,count);
-                apply_filter_16_11(ape_ctx->fileversion,1,decoded1,count);
+                apply_filter_16_11(ape_ctx,0,decoded0,count);
+                apply_filter_16_11(ape_ctx,1,decoded1,count);
                 break;
     
             case 3000:
-                apply_filter_64_11(ape_ctx->fileversion,0,decoded0,count);
-                apply_filter_64_11(ape_ctx->fileversion,1,decoded1,count);
+                apply_filter_64_11(ape_ctx,0,decoded0,count);
+                apply_filter_64_11(ape_ctx,1,decoded1,count);
                 break;
     
             case 4000:
-                apply_filter_32_10(ape_ctx->fileversion,0,decoded0,count);
-                apply_filter_32_10(ape_ctx->fileversion,1,decoded1,count);
-                apply_filter_256_13(ape_ctx->fileversion,0,decoded0,count);
-                apply_filter_256_13(ape_ctx->fileversion,1,decoded1,count);
+                apply_filter_32_10(ape_ctx,0,decoded0,count);
+                apply_filter_32_10(ape_ctx,1,decoded1,count);
+                apply_filter_256_13(ape_ctx,0,decoded0,count);
+                apply_filter_256_13(ape_ctx,1,decoded1,count);
                 break;
     
             case 5000:
-                apply_filter_16_11(ape_ctx->fileversion,0,decoded0,count);
-                apply_filter_16_11(ape_ctx->fileversion,1,decoded1,count);
-                apply_filter_256_13(ape_ctx->fileversion,0,decoded0,count);
-                apply_filter_256_13(ape_ctx->fileversion,1,decoded1,count);
-                apply_filter_1280_15(ape_ctx->fileversion,0,decoded0,count);
-                apply_filter_1280_15(ape_ctx->fileversion,1,decoded1,count);
+                apply_filter_16_11(ape_ctx,0,decoded0,count);
+                apply_filter_16_11(ape_ctx,1,decoded1,count);
+                apply_filter_256_13(ape_ctx,0,decoded0,count);
+                apply_filter_256_13(ape_ctx,1,decoded1,count);
+                apply_filter_1280_15(ape_ctx,0,decoded0,count);
+                apply_filter_1280_15(ape_ctx,1,decoded1,count);
         }
 
         /* Now apply the predictor decoding */
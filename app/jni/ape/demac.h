@@ -28,13 +28,27 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110, USA
 #include <inttypes.h>
 #include "parser.h"
 
+/* Vector kernels for the NN filters, set once before decoders are
+   allocated; filters initialised afterwards use them. */
+#define APE_SIMD_NONE   0
+#define APE_SIMD_NEON   1
+#define APE_SIMD_SSE2   2
+#define APE_SIMD_AVX2   3
+
+extern int ape_simd;
+
+int ape_decoder_alloc(struct ape_ctx_t* ape_ctx);
+void ape_decoder_free(struct ape_ctx_t* ape_ctx);
+
+/* The input runs from inbuffer to inbufferend, which must stay readable
+   for the whole call. Bytes past inbufferend are read as zero. */
 void init_frame_decoder(struct ape_ctx_t* ape_ctx,
-                        unsigned char* inbuffer, int* firstbyte,
-                        int* bytesconsumed);
+                        unsigned char* inbuffer, unsigned char* inbufferend,
+                        int* firstbyte, int* bytesconsumed);
 
 int decode_chunk(struct ape_ctx_t* ape_ctx,
-                 unsigned char* inbuffer, int* firstbyte,
-                 int* bytesconsumed,
+                 unsigned char* inbuffer, unsigned char* inbufferend,
+                 int* firstbyte, int* bytesconsumed,
                  int32_t* decoded0, int32_t* decoded1, 
                  int count);
 
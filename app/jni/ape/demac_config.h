@@ -80,6 +80,13 @@ typedef int16_t filter_int;
 #endif
 #endif
 
+/* Vector kernels that can be picked at run time, see ape_simd */
+#if defined(__x86_64__) || defined(__i386__)
+#define APE_X86
+#elif defined(__aarch64__)
+#define APE_NEON
+#endif
+
 #ifndef ST
 #define _ST(A,B,C) A ## B ## C
 #define __ST(A,B,C) _ST(A,B,C)
@@ -121,21 +121,22 @@ each function (and the RNGC macro)).
    for aligned reads.
 */
 
-static unsigned char* bytebuffer IBSS_ATTR_DEMAC;
-static int bytebufferoffset IBSS_ATTR_DEMAC;
-
-static inline void skip_byte(void)
+static inline void skip_byte(struct ape_decoder_t* d)
 {
-    bytebufferoffset--;
-    bytebuffer += bytebufferoffset & 4;
-    bytebufferoffset &= 3;
+    d->bytebufferoffset--;
+    d->bytebuffer += d->bytebufferoffset & 4;
+    d->bytebufferoffset &= 3;
 }
 
-static inline int read_byte(void)
+static inline int read_byte(struct ape_decoder_t* d)
 {
-    int ch = bytebuffer[bytebufferoffset];
+    int ch = 0;
+
+    /* A truncated or corrupt frame must not run off the input */
+    if (LIKELY(d->bytebuffer + d->bytebufferoffset < d->bytebufferend))
+        ch = d->bytebuffer[d->bytebufferoffset];
 
-    skip_byte();
+    skip_byte(d);
 
     return ch;
 }
@@ -150,31 +151,21 @@ static inline int read_byte(void)
 #define EXTRA_BITS ((CODE_BITS-2) % 8 + 1)
 #define BOTTOM_VALUE (TOP_VALUE >> 8)
 
-struct rangecoder_t
-{
-    uint32_t low;        /* low end of interval */
-    uint32_t range;      /* length of interval */
-    uint32_t help;       /* bytes_to_follow resp. intermediate value */
-    unsigned int buffer; /* buffer for input/output */
-};
-
-static struct rangecoder_t rc IBSS_ATTR_DEMAC;
-
 /* Start the decoder */
-static inline void range_start_decoding(void)
+static inline void range_start_decoding(struct ape_decoder_t* d)
 {
-    rc.buffer = read_byte();
-    rc.low = rc.buffer >> (8 - EXTRA_BITS);
-    rc.range = (uint32_t) 1 << EXTRA_BITS;
+    d->rc.buffer = read_byte(d);
+    d->rc.low = d->rc.buffer >> (8 - EXTRA_BITS);
+    d->rc.range = (uint32_t) 1 << EXTRA_BITS;
 }
 
-static inline void range_dec_normalize(void)
+static inline void range_dec_normalize(struct ape_decoder_t* d)
 {
-    while (rc.range <= BOTTOM_VALUE)
+    while (d->rc.range <= BOTTOM_VALUE)
     {   
-        rc.buffer = (rc.buffer << 8) | read_byte();
-        rc.low = (rc.low << 8) | ((rc.buffer >> 1) & 0xff);
-        rc.range <<= 8;
+        d->rc.buffer = (d->rc.buffer << 8) | read_byte(d);
+        d->rc.low = (d->rc.low << 8) | ((d->rc.buffer >> 1) & 0xff);
+        d->rc.range <<= 8;
     }
 }
 
@@ -182,55 +173,55 @@ static inline void range_dec_normalize(void)
 /* tot_f is the total frequency                              */
 /* or: totf is (code_value)1<<shift                                      */
 /* returns the culmulative frequency                         */
-static inline int range_decode_culfreq(int tot_f)
+static inline int range_decode_culfreq(struct ape_decoder_t* d, int tot_f)
 {
-    range_dec_normalize();
-    rc.help = UDIV32(rc.range, tot_f);
-    return UDIV32(rc.low, rc.help);
+    range_dec_normalize(d);
+    d->rc.help = UDIV32(d->rc.range, tot_f);
+    return UDIV32(d->rc.low, d->rc.help);
 }
 
-static inline int range_decode_culshift(int shift)
+static inline int range_decode_culshift(struct ape_decoder_t* d, int shift)
 {
-    range_dec_normalize();
-    rc.help = rc.range >> shift;
-    return UDIV32(rc.low, rc.help);
+    range_dec_normalize(d);
+    d->rc.help = d->rc.range >> shift;
+    return UDIV32(d->rc.low, d->rc.help);
 }
 
 
 /* Update decoding state                                     */
 /* sy_f is the interval length (frequency of the symbol)     */
 /* lt_f is the lower end (frequency sum of < symbols)        */
-static inline void range_decode_update(int sy_f, int lt_f)
+static inline void range_decode_update(struct ape_decoder_t* d, int sy_f, int lt_f)
 {
-    rc.low -= rc.help * lt_f;
-    rc.range = rc.help * sy_f;
+    d->rc.low -= d->rc.help * lt_f;
+    d->rc.range = d->rc.help * sy_f;
 }
 
 
 /* Decode a byte/short without modelling                     */
-static inline unsigned char decode_byte(void)
-{   int tmp = range_decode_culshift(8);
-    range_decode_update( 1,tmp);
+static inline unsigned char decode_byte(struct ape_decoder_t* d)
+{   int tmp = range_decode_culshift(d, 8);
+    range_decode_update(d, 1, tmp);
     return tmp;
 }
 
-static inline unsigned short range_decode_short(void)
-{   int tmp = range_decode_culshift(16);
-    range_decode_update( 1,tmp);
+static inline unsigned short range_decode_short(struct ape_decoder_t* d)
+{   int tmp = range_decode_culshift(d, 16);
+    range_decode_update(d, 1, tmp);
     return tmp;
 }
 
 /* Decode n bits (n <= 16) without modelling - based on range_decode_short */
-static inline int range_decode_bits(int n)
-{   int tmp = range_decode_culshift(n);
-    range_decode_update( 1,tmp);
+static inline int range_decode_bits(struct ape_decoder_t* d, int n)
+{   int tmp = range_decode_culshift(d, n);
+    range_decode_update(d, 1, tmp);
     return tmp;
 }
 
 
 /* Finish decoding                                           */
-static inline void range_done_decoding(void)
-{   range_dec_normalize();      /* normalize to use up all bytes */
+static inline void range_done_decoding(struct ape_decoder_t* d)
+{   range_dec_normalize(d);      /* normalize to use up all bytes */
 }
 
 /*
@@ -239,45 +230,36 @@ static inline void range_done_decoding(void)
   (c) Michael Schindler
 */
 
-static inline int range_get_symbol_3980(void)
+static inline int range_get_symbol_3980(struct ape_decoder_t* d)
 {
     int symbol, cf;
 
-    cf = range_decode_culshift(16);
+    cf = range_decode_culshift(d, 16);
 
     /* figure out the symbol inefficiently; a binary search would be much better */
     for (symbol = 0; counts_3980[symbol+1] <= cf; symbol++);
 
-    range_decode_update(counts_diff_3980[symbol],counts_3980[symbol]);
+    range_decode_update(d, counts_diff_3980[symbol],counts_3980[symbol]);
 
     return symbol;
 }
 
-static inline int range_get_symbol_3970(void)
+static inline int range_get_symbol_3970(struct ape_decoder_t* d)
 {
     int symbol, cf;
 
-    cf = range_decode_culshift(16);
+    cf = range_decode_culshift(d, 16);
 
     /* figure out the symbol inefficiently; a binary search would be much better */
     for (symbol = 0; counts_3970[symbol+1] <= cf; symbol++);
 
-    range_decode_update(counts_diff_3970[symbol],counts_3970[symbol]);
+    range_decode_update(d, counts_diff_3970[symbol],counts_3970[symbol]);
 
     return symbol;
 }
 
 /* MAIN DECODING FUNCTIONS */
 
-struct rice_t
-{
-  uint32_t k;
-  uint32_t ksum;
-};
-
-static struct rice_t riceX IBSS_ATTR_DEMAC;
-static struct rice_t riceY IBSS_ATTR_DEMAC;
-
 static inline void update_rice(struct rice_t* rice, int x)
 {
     rice->ksum += ((x + 1) / 2) - ((rice->ksum + 16) >> 5);
@@ -294,7 +276,7 @@ static inline void update_rice(struct rice_t* rice, int x)
     }
 }
 
-static inline int entropy_decode3980(struct rice_t* rice)
+static inline int entropy_decode3980(struct ape_decoder_t* d, struct rice_t* rice)
 {
     int base, x, pivot, overflow;
 
@@ -302,11 +284,11 @@ static inline int entropy_decode3980(struct rice_t* rice)
     if (UNLIKELY(pivot == 0))
         pivot=1;
 
-    overflow = range_get_symbol_3980();
+    overflow = range_get_symbol_3980(d);
 
     if (UNLIKELY(overflow == (MODEL_ELEMENTS-1))) {
-        overflow = range_decode_short() << 16;
-        overflow |= range_decode_short();
+        overflow = range_decode_short(d) << 16;
+        overflow |= range_decode_short(d);
     }
 
     if (pivot >= 0x10000) {
@@ -322,17 +304,17 @@ static inline int entropy_decode3980(struct rice_t* rice)
         */
         lo_bits = (nbits - 16);
 
-        base_hi = range_decode_culfreq((pivot >> lo_bits) + 1);
-        range_decode_update(1, base_hi);
+        base_hi = range_decode_culfreq(d, (pivot >> lo_bits) + 1);
+        range_decode_update(d, 1, base_hi);
 
-        base_lo = range_decode_culshift(lo_bits);
-        range_decode_update(1, base_lo);
+        base_lo = range_decode_culshift(d, lo_bits);
+        range_decode_update(d, 1, base_lo);
 
         base = (base_hi << lo_bits) + base_lo;
     } else {
         /* Codepath for 16-bit streams */
-        base = range_decode_culfreq(pivot);
-        range_decode_update(1, base);
+        base = range_decode_culfreq(d, pivot);
+        range_decode_update(d, 1, base);
     }
 
     x = base + (overflow * pivot);
@@ -346,24 +328,24 @@ static inline int entropy_decode3980(struct rice_t* rice)
 }
 
 
-static inline int entropy_decode3970(struct rice_t* rice)
+static inline int entropy_decode3970(struct ape_decoder_t* d, struct rice_t* rice)
 {
     int x, tmpk;
 
-    int overflow = range_get_symbol_3970();
+    int overflow = range_get_symbol_3970(d);
 
     if (UNLIKELY(overflow == (MODEL_ELEMENTS - 1))) {
-        tmpk = range_decode_bits(5);
+        tmpk = range_decode_bits(d, 5);
         overflow = 0;
     } else {
         tmpk = (rice->k < 1) ? 0 : rice->k - 1;
     }
 
     if (tmpk <= 16) {
-        x = range_decode_bits(tmpk);
+        x = range_decode_bits(d, tmpk);
     } else {
-        x = range_decode_short();
-        x |= (range_decode_bits(tmpk - 16) << 16);
+        x = range_decode_short(d);
+        x |= (range_decode_bits(d, tmpk - 16) << 16);
     }
     x += (overflow << tmpk);
 
@@ -377,55 +359,62 @@ static inline int entropy_decode3970(struct rice_t* rice)
 }
 
 void init_entropy_decoder(struct ape_ctx_t* ape_ctx,
-                          unsigned char* inbuffer, int* firstbyte,
-                          int* bytesconsumed)
+                          unsigned char* inbuffer, unsigned char* inbufferend,
+                          int* firstbyte, int* bytesconsumed)
 {
-    bytebuffer = inbuffer;
-    bytebufferoffset = *firstbyte;
+    struct ape_decoder_t* d = ape_ctx->dec;
+
+    d->bytebuffer = inbuffer;
+    d->bytebufferend = inbufferend;
+    d->bytebufferoffset = *firstbyte;
 
     /* Read the CRC */
-    ape_ctx->CRC = read_byte();
-    ape_ctx->CRC = (ape_ctx->CRC << 8) | read_byte();
-    ape_ctx->CRC = (ape_ctx->CRC << 8) | read_byte();
-    ape_ctx->CRC = (ape_ctx->CRC << 8) | read_byte();
+    ape_ctx->CRC = read_byte(d);
+    ape_ctx->CRC = (ape_ctx->CRC << 8) | read_byte(d);
+    ape_ctx->CRC = (ape_ctx->CRC << 8) | read_byte(d);
+    ape_ctx->CRC = (ape_ctx->CRC << 8) | read_byte(d);
 
     /* Read the frame flags if they exist */
     ape_ctx->frameflags = 0;
     if ((ape_ctx->fileversion > 3820) && (ape_ctx->CRC & 0x80000000)) {
         ape_ctx->CRC &= ~0x80000000;
 
-        ape_ctx->frameflags = read_byte();
-        ape_ctx->frameflags = (ape_ctx->frameflags << 8) | read_byte();
-        ape_ctx->frameflags = (ape_ctx->frameflags << 8) | read_byte();
-        ape_ctx->frameflags = (ape_ctx->frameflags << 8) | read_byte();
+        ape_ctx->frameflags = read_byte(d);
+        ape_ctx->frameflags = (ape_ctx->frameflags << 8) | read_byte(d);
+        ape_ctx->frameflags = (ape_ctx->frameflags << 8) | read_byte(d);
+        ape_ctx->frameflags = (ape_ctx->frameflags << 8) | read_byte(d);
     }
     /* Keep a count of the blocks decoded in this frame */
     ape_ctx->blocksdecoded = 0;
 
     /* Initialise the rice structs */
-    riceX.k = 10;
-    riceX.ksum = (1 << riceX.k) * 16;
-    riceY.k = 10;
-    riceY.ksum = (1 << riceY.k) * 16;
+    d->riceX.k = 10;
+    d->riceX.ksum = (1 << d->riceX.k) * 16;
+    d->riceY.k = 10;
+    d->riceY.ksum = (1 << d->riceY.k) * 16;
 
     /* The first 8 bits of input are ignored. */
-    skip_byte();
+    skip_byte(d);
 
-    range_start_decoding();
+    range_start_decoding(d);
 
     /* Return the new state of the buffer */
-    *bytesconsumed = (intptr_t)bytebuffer - (intptr_t)inbuffer;
-    *firstbyte = bytebufferoffset;
+    *bytesconsumed = (intptr_t)d->bytebuffer - (intptr_t)inbuffer;
+    *firstbyte = d->bytebufferoffset;
 }
 
 void ICODE_ATTR_DEMAC entropy_decode(struct ape_ctx_t* ape_ctx,
-                                     unsigned char* inbuffer, int* firstbyte,
-                                     int* bytesconsumed,
+                                     unsigned char* inbuffer,
+                                     unsigned char* inbufferend,
+                                     int* firstbyte, int* bytesconsumed,
                                      int32_t* decoded0, int32_t* decoded1,
                                      int blockstodecode)
 {
-    bytebuffer = inbuffer;
-    bytebufferoffset = *firstbyte;
+    struct ape_decoder_t* d = ape_ctx->dec;
+
+    d->bytebuffer = inbuffer;
+    d->bytebufferend = inbufferend;
+    d->bytebufferoffset = *firstbyte;
 
     ape_ctx->blocksdecoded += blockstodecode;
 
@@ -439,25 +428,25 @@ void ICODE_ATTR_DEMAC entropy_decode(struct ape_ctx_t* ape_ctx,
     } else {
         if (ape_ctx->fileversion > 3970) {
             while (LIKELY(blockstodecode--)) {
-                *(decoded0++) = entropy_decode3980(&riceY);
+                *(decoded0++) = entropy_decode3980(d, &d->riceY);
                 if (decoded1 != NULL)
-                    *(decoded1++) = entropy_decode3980(&riceX);
+                    *(decoded1++) = entropy_decode3980(d, &d->riceX);
             }
         } else {
             while (LIKELY(blockstodecode--)) {
-                *(decoded0++) = entropy_decode3970(&riceY);
+                *(decoded0++) = entropy_decode3970(d, &d->riceY);
                 if (decoded1 != NULL)
-                    *(decoded1++) = entropy_decode3970(&riceX);
+                    *(decoded1++) = entropy_decode3970(d, &d->riceX);
             }
         }
     }
 
     if (ape_ctx->blocksdecoded == ape_ctx->currentframeblocks)
     {
-        range_done_decoding();
+        range_done_decoding(d);
     }
 
     /* Return the new state of the buffer */
-    *bytesconsumed = bytebuffer - inbuffer;
-    *firstbyte = bytebufferoffset;
+    *bytesconsumed = d->bytebuffer - inbuffer;
+    *firstbyte = d->bytebufferoffset;
 }
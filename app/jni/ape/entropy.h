@@ -28,12 +28,12 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110, USA
 #include <inttypes.h>
 
 void init_entropy_decoder(struct ape_ctx_t* ape_ctx,
-                          unsigned char* inbuffer, int* firstbyte,
-                          int* bytesconsumed);
+                          unsigned char* inbuffer, unsigned char* inbufferend,
+                          int* firstbyte, int* bytesconsumed);
 
 void entropy_decode(struct ape_ctx_t* ape_ctx,
-                    unsigned char* inbuffer, int* firstbyte,
-                    int* bytesconsumed,
+                    unsigned char* inbuffer, unsigned char* inbufferend,
+                    int* firstbyte, int* bytesconsumed,
                     int32_t* decoded0, int32_t* decoded1,
                     int blockstodecode);
 
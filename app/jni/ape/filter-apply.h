@@ -0,0 +1,165 @@
+/*
+
+libdemac - A Monkey's Audio decoder
+
+$Id$
+
+Copyright (C) Dave Chapman 2007
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110, USA
+
+*/
+
+/* The apply loops of filter.c, included once for each set of vector
+   kernels. The includer defines SFX(name) to give the kernel and loop
+   names, APPLY_ATTR for the target of the instance, and APPLY_FUSED to 1
+   when the set has the fused vector_sp_add/vector_sp_sub operations. */
+
+/* Apply the filter with state f to count entries in data[] */
+
+static void APPLY_ATTR ICODE_ATTR_DEMAC SFX(do_apply_filter_3980)(struct filter_t* f,
+                                                             int32_t* data, int count)
+{
+    int res;
+    int absres; 
+
+#ifdef PREPARE_SCALARPRODUCT
+    PREPARE_SCALARPRODUCT
+#endif
+
+    while(LIKELY(count--))
+    {
+#if APPLY_FUSED
+        if (LIKELY(*data != 0)) {
+            if (*data < 0)
+                res = SFX(vector_sp_add)(f->coeffs, f->delay - ORDER,
+                                     f->adaptcoeffs - ORDER);
+            else
+                res = SFX(vector_sp_sub)(f->coeffs, f->delay - ORDER,
+                                     f->adaptcoeffs - ORDER);
+        } else {
+            res = SFX(scalarproduct)(f->coeffs, f->delay - ORDER);
+        }
+        res = FP_TO_INT(res);
+#else
+        res = FP_TO_INT(SFX(scalarproduct)(f->coeffs, f->delay - ORDER));
+
+        if (LIKELY(*data != 0)) {
+            if (*data < 0)
+                SFX(vector_add)(f->coeffs, f->adaptcoeffs - ORDER);
+            else
+                SFX(vector_sub)(f->coeffs, f->adaptcoeffs - ORDER);
+        }
+#endif
+
+        res += *data;
+
+        *data++ = res;
+
+        /* Update the output history */
+        *f->delay++ = SATURATE(res);
+
+        /* Version 3.98 and later files */
+
+        /* Update the adaption coefficients */
+        absres = (res < 0 ? -res : res);
+
+        if (UNLIKELY(absres > 3 * f->avg))
+            *f->adaptcoeffs = ((res >> 25) & 64) - 32;
+        else if (3 * absres > 4 * f->avg)
+            *f->adaptcoeffs = ((res >> 26) & 32) - 16;
+        else if (LIKELY(absres > 0))
+            *f->adaptcoeffs = ((res >> 27) & 16) - 8;
+        else
+            *f->adaptcoeffs = 0;
+
+        f->avg += (absres - f->avg) / 16;
+
+        f->adaptcoeffs[-1] >>= 1;
+        f->adaptcoeffs[-2] >>= 1;
+        f->adaptcoeffs[-8] >>= 1;
+
+        f->adaptcoeffs++;
+
+        /* Have we filled the history buffer? */
+        if (UNLIKELY(f->delay == f->history_end)) {
+            memmove(f->coeffs + ORDER, f->delay - (ORDER*2),
+                    (ORDER*2) * sizeof(filter_int));
+            f->adaptcoeffs = f->coeffs + ORDER*2;
+            f->delay = f->coeffs + ORDER*3;
+        }
+    }
+}
+
+static void APPLY_ATTR ICODE_ATTR_DEMAC SFX(do_apply_filter_3970)(struct filter_t* f,
+                                                             int32_t* data, int count)
+{
+    int res;
+    
+#ifdef PREPARE_SCALARPRODUCT
+    PREPARE_SCALARPRODUCT
+#endif
+
+    while(LIKELY(count--))
+    {
+#if APPLY_FUSED
+        if (LIKELY(*data != 0)) {
+            if (*data < 0)
+                res = SFX(vector_sp_add)(f->coeffs, f->delay - ORDER,
+                                     f->adaptcoeffs - ORDER);
+            else
+                res = SFX(vector_sp_sub)(f->coeffs, f->delay - ORDER,
+                                     f->adaptcoeffs - ORDER);
+        } else {
+            res = SFX(scalarproduct)(f->coeffs, f->delay - ORDER);
+        }
+        res = FP_TO_INT(res);
+#else
+        res = FP_TO_INT(SFX(scalarproduct)(f->coeffs, f->delay - ORDER));
+
+        if (LIKELY(*data != 0)) {
+            if (*data < 0)
+                SFX(vector_add)(f->coeffs, f->adaptcoeffs - ORDER);
+            else
+                SFX(vector_sub)(f->coeffs, f->adaptcoeffs - ORDER);
+        }
+#endif
+
+        /* Convert res from (32-FRACBITS).FRACBITS fixed-point format to an
+           integer (rounding to nearest) and add the input value to
+           it */
+        res += *data;
+
+        *data++ = res;
+
+        /* Update the output history */
+        *f->delay++ = SATURATE(res);
+
+        /* Version ??? to < 3.98 files (untested) */
+        f->adaptcoeffs[0] = (res == 0) ? 0 : ((res >> 28) & 8) - 4;
+        f->adaptcoeffs[-4] >>= 1;
+        f->adaptcoeffs[-8] >>= 1;
+
+        f->adaptcoeffs++;
+
+        /* Have we filled the history buffer? */
+        if (UNLIKELY(f->delay == f->history_end)) {
+            memmove(f->coeffs + ORDER, f->delay - (ORDER*2),
+                    (ORDER*2) * sizeof(filter_int));
+            f->adaptcoeffs = f->coeffs + ORDER*2;
+            f->delay = f->coeffs + ORDER*3;
+        }
+    }
+}
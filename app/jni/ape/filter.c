@@ -38,19 +38,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110, USA
 #include "vector_math_generic.h"
 #endif
 
-#ifndef FILTER_TYPE_DEFINED
-#define FILTER_TYPE_DEFINED
-struct filter_t {
-    filter_int* coeffs; /* ORDER entries */
-
-    /* We store all the filter delays in a single buffer */
-    filter_int* history_end;
-
-    filter_int* delay;
-    filter_int* adaptcoeffs;
-
-    int avg;
-};
+#ifdef APE_X86
+#include "vector_math16_x86.h"
+#elif defined(APE_NEON)
+#include "vector_math16_neon64.h"
 #endif
 
 /* We name the functions according to the ORDER and FRACBITS
@@ -64,6 +55,10 @@ struct filter_t {
 #define _FLT_FUNC(A,B,C) A ## _filter_ ## B ## _ ## C
 #define FLT_FUNC(A,B,C) _FLT_FUNC(A,B,C)
 
+/* Slot in ape_decoder_t: 16/32/64 taps come first, then 256, then 1280 */
+#undef FLT_STAGE
+#define FLT_STAGE (ORDER >= 1280 ? 2 : (ORDER >= 256 ? 1 : 0))
+
 /* Some macros to handle the fixed-point stuff */
 
 /* Convert from (32-FRACBITS).FRACBITS fixed-point format to an
@@ -94,144 +89,40 @@ struct filter_t {
 #define SATURATE(x) (LIKELY((x) == (int16_t)(x)) ? (x) : ((x) >> 31) ^ 0x7FFF)
 #endif
 
-/* Apply the filter with state f to count entries in data[] */
+/* Instantiate the apply loops for each set of vector kernels built in */
 
-static void ICODE_ATTR_DEMAC ST(do_apply_filter_3980)(struct filter_t* f,
-                                                  int32_t* data, int count)
-{
-    int res;
-    int absres; 
-
-#ifdef PREPARE_SCALARPRODUCT
-    PREPARE_SCALARPRODUCT
-#endif
-
-    while(LIKELY(count--))
-    {
 #ifdef FUSED_VECTOR_MATH
-        if (LIKELY(*data != 0)) {
-            if (*data < 0)
-                res = ST(vector_sp_add)(f->coeffs, f->delay - ORDER,
-                                    f->adaptcoeffs - ORDER);
-            else
-                res = ST(vector_sp_sub)(f->coeffs, f->delay - ORDER,
-                                    f->adaptcoeffs - ORDER);
-        } else {
-            res = ST(scalarproduct)(f->coeffs, f->delay - ORDER);
-        }
-        res = FP_TO_INT(res);
+#define APPLY_FUSED 1
 #else
-        res = FP_TO_INT(ST(scalarproduct)(f->coeffs, f->delay - ORDER));
-
-        if (LIKELY(*data != 0)) {
-            if (*data < 0)
-                ST(vector_add)(f->coeffs, f->adaptcoeffs - ORDER);
-            else
-                ST(vector_sub)(f->coeffs, f->adaptcoeffs - ORDER);
-        }
-#endif
-
-        res += *data;
-
-        *data++ = res;
-
-        /* Update the output history */
-        *f->delay++ = SATURATE(res);
-
-        /* Version 3.98 and later files */
-
-        /* Update the adaption coefficients */
-        absres = (res < 0 ? -res : res);
-
-        if (UNLIKELY(absres > 3 * f->avg))
-            *f->adaptcoeffs = ((res >> 25) & 64) - 32;
-        else if (3 * absres > 4 * f->avg)
-            *f->adaptcoeffs = ((res >> 26) & 32) - 16;
-        else if (LIKELY(absres > 0))
-            *f->adaptcoeffs = ((res >> 27) & 16) - 8;
-        else
-            *f->adaptcoeffs = 0;
-
-        f->avg += (absres - f->avg) / 16;
-
-        f->adaptcoeffs[-1] >>= 1;
-        f->adaptcoeffs[-2] >>= 1;
-        f->adaptcoeffs[-8] >>= 1;
-
-        f->adaptcoeffs++;
-
-        /* Have we filled the history buffer? */
-        if (UNLIKELY(f->delay == f->history_end)) {
-            memmove(f->coeffs + ORDER, f->delay - (ORDER*2),
-                    (ORDER*2) * sizeof(filter_int));
-            f->adaptcoeffs = f->coeffs + ORDER*2;
-            f->delay = f->coeffs + ORDER*3;
-        }
-    }
-}
-
-static void ICODE_ATTR_DEMAC ST(do_apply_filter_3970)(struct filter_t* f,
-                                                  int32_t* data, int count)
-{
-    int res;
-    
-#ifdef PREPARE_SCALARPRODUCT
-    PREPARE_SCALARPRODUCT
+#define APPLY_FUSED 0
 #endif
-
-    while(LIKELY(count--))
-    {
-#ifdef FUSED_VECTOR_MATH
-        if (LIKELY(*data != 0)) {
-            if (*data < 0)
-                res = ST(vector_sp_add)(f->coeffs, f->delay - ORDER,
-                                    f->adaptcoeffs - ORDER);
-            else
-                res = ST(vector_sp_sub)(f->coeffs, f->delay - ORDER,
-                                    f->adaptcoeffs - ORDER);
-        } else {
-            res = ST(scalarproduct)(f->coeffs, f->delay - ORDER);
-        }
-        res = FP_TO_INT(res);
-#else
-        res = FP_TO_INT(ST(scalarproduct)(f->coeffs, f->delay - ORDER));
-
-        if (LIKELY(*data != 0)) {
-            if (*data < 0)
-                ST(vector_add)(f->coeffs, f->adaptcoeffs - ORDER);
-            else
-                ST(vector_sub)(f->coeffs, f->adaptcoeffs - ORDER);
-        }
+#define SFX(x) ST(x)
+#define APPLY_ATTR
+#include "filter-apply.h"
+#undef SFX
+#undef APPLY_ATTR
+#undef APPLY_FUSED
+
+#define APPLY_FUSED 1
+#ifdef APE_X86
+#define SFX(x) ST(x ## _sse2)
+#define APPLY_ATTR SSE2_ATTR
+#include "filter-apply.h"
+#undef SFX
+#undef APPLY_ATTR
+#define SFX(x) ST(x ## _avx2)
+#define APPLY_ATTR AVX2_ATTR
+#include "filter-apply.h"
+#undef SFX
+#undef APPLY_ATTR
+#elif defined(APE_NEON)
+#define SFX(x) ST(x ## _neon)
+#define APPLY_ATTR
+#include "filter-apply.h"
+#undef SFX
+#undef APPLY_ATTR
 #endif
-
-        /* Convert res from (32-FRACBITS).FRACBITS fixed-point format to an
-           integer (rounding to nearest) and add the input value to
-           it */
-        res += *data;
-
-        *data++ = res;
-
-        /* Update the output history */
-        *f->delay++ = SATURATE(res);
-
-        /* Version ??? to < 3.98 files (untested) */
-        f->adaptcoeffs[0] = (res == 0) ? 0 : ((res >> 28) & 8) - 4;
-        f->adaptcoeffs[-4] >>= 1;
-        f->adaptcoeffs[-8] >>= 1;
-
-        f->adaptcoeffs++;
-
-        /* Have we filled the history buffer? */
-        if (UNLIKELY(f->delay == f->history_end)) {
-            memmove(f->coeffs + ORDER, f->delay - (ORDER*2),
-                    (ORDER*2) * sizeof(filter_int));
-            f->adaptcoeffs = f->coeffs + ORDER*2;
-            f->delay = f->coeffs + ORDER*3;
-        }
-    }
-}
-
-static struct filter_t ST(filter)[2] IBSS_ATTR_DEMAC;
+#undef APPLY_FUSED
 
 static void ST(do_init_filter)(struct filter_t* f, filter_int* buf)
 {
@@ -249,18 +140,45 @@ static void ST(do_init_filter)(struct filter_t* f, filter_int* buf)
     f->avg = 0;
 }
 
-void FLT_FUNC(init,ORDER,FRACBITS) (filter_int* buf)
+void FLT_FUNC(init,ORDER,FRACBITS) (struct ape_ctx_t* ape_ctx)
 {
-    ST(do_init_filter)(&ST(filter)[0], buf);
-    ST(do_init_filter)(&ST(filter)[1], buf + ORDER*3 + FILTER_HISTORY_SIZE);
+    struct filter_t* f = ape_ctx->dec->filter[FLT_STAGE];
+    filter_int* buf = ape_ctx->dec->filterbuf[FLT_STAGE];
+
+    void (*apply)(struct filter_t* f, int32_t* data, int count);
+
+    if (ape_ctx->fileversion >= 3980) {
+        switch (ape_simd) {
+#ifdef APE_X86
+        case APE_SIMD_AVX2: apply = ST(do_apply_filter_3980_avx2); break;
+        case APE_SIMD_SSE2: apply = ST(do_apply_filter_3980_sse2); break;
+#elif defined(APE_NEON)
+        case APE_SIMD_NEON: apply = ST(do_apply_filter_3980_neon); break;
+#endif
+        default: apply = ST(do_apply_filter_3980);
+        }
+    } else {
+        switch (ape_simd) {
+#ifdef APE_X86
+        case APE_SIMD_AVX2: apply = ST(do_apply_filter_3970_avx2); break;
+        case APE_SIMD_SSE2: apply = ST(do_apply_filter_3970_sse2); break;
+#elif defined(APE_NEON)
+        case APE_SIMD_NEON: apply = ST(do_apply_filter_3970_neon); break;
+#endif
+        default: apply = ST(do_apply_filter_3970);
+        }
+    }
+
+    ST(do_init_filter)(&f[0], buf);
+    ST(do_init_filter)(&f[1], buf + ORDER*3 + FILTER_HISTORY_SIZE);
+    f[0].apply = f[1].apply = apply;
 }
 
-void ICODE_ATTR_DEMAC FLT_FUNC(apply,ORDER,FRACBITS) (int fileversion, int channel,
+void ICODE_ATTR_DEMAC FLT_FUNC(apply,ORDER,FRACBITS) (struct ape_ctx_t* ape_ctx, int channel,
                                    int32_t* data, int count)
 {
-    if (fileversion >= 3980)
-        ST(do_apply_filter_3980)(&ST(filter)[channel], data, count);
-    else
-        ST(do_apply_filter_3970)(&ST(filter)[channel], data, count);
+    struct filter_t* f = &ape_ctx->dec->filter[FLT_STAGE][channel];
+
+    f->apply(f, data, count);
 }
 
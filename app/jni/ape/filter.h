@@ -26,25 +26,26 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110, USA
 #define _APE_FILTER_H
 
 #include "demac_config.h"
+#include "parser.h"
 
-void init_filter_16_11(filter_int* buf);
-void apply_filter_16_11(int fileversion, int channel,
+void init_filter_16_11(struct ape_ctx_t* ape_ctx);
+void apply_filter_16_11(struct ape_ctx_t* ape_ctx, int channel,
                         int32_t* decoded, int count);
 
-void init_filter_64_11(filter_int* buf);
-void apply_filter_64_11(int fileversion, int channel,
+void init_filter_64_11(struct ape_ctx_t* ape_ctx);
+void apply_filter_64_11(struct ape_ctx_t* ape_ctx, int channel,
                         int32_t* decoded, int count);
 
-void init_filter_32_10(filter_int* buf);
-void apply_filter_32_10(int fileversion, int channel,
+void init_filter_32_10(struct ape_ctx_t* ape_ctx);
+void apply_filter_32_10(struct ape_ctx_t* ape_ctx, int channel,
                         int32_t* decoded, int count);
 
-void init_filter_256_13(filter_int* buf);
-void apply_filter_256_13(int fileversion, int channel,
+void init_filter_256_13(struct ape_ctx_t* ape_ctx);
+void apply_filter_256_13(struct ape_ctx_t* ape_ctx, int channel,
                          int32_t* decoded, int count);
 
-void init_filter_1280_15(filter_int* buf);
-void apply_filter_1280_15(int fileversion, int channel,
+void init_filter_1280_15(struct ape_ctx_t* ape_ctx);
+void apply_filter_1280_15(struct ape_ctx_t* ape_ctx, int channel,
                           int32_t* decoded, int count);
 
 #endif
@@ -64,6 +64,10 @@ avoided by writing the decoded data one sample at a time.
 #ifdef ANDROID
 #include <android/log.h>
 #endif
+#ifdef APE_NEON
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
 #define __force
 #define __bitwise
@@ -77,6 +81,11 @@ avoided by writing the decoded data one sample at a time.
 
 #define INPUT_CHUNKSIZE     (32*1024)
 
+/* The decoder reads straight from the mapping. Keep this much mapped ahead
+   of it: more than a block can take in the worst case, and the frame header. */
+#define MAX_BYTES_PER_BLOCK 32
+#define FRAME_HEADER_BYTES  64
+
 #ifndef MIN
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #endif
@@ -101,18 +110,164 @@ static int ape_calc_seekpos(struct ape_ctx_t* ape_ctx,
     return 1;
 }
 
+static void ape_simd_select(void)
+{
+    static const char *names[] = { "c", "neon", "sse2", "avx2" };
+#ifdef APE_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) ape_simd = APE_SIMD_AVX2;
+	else if(__builtin_cpu_supports("sse2")) ape_simd = APE_SIMD_SSE2;
+#endif
+#if defined(APE_NEON) && defined(HWCAP_ASIMD)
+	if(getauxval(AT_HWCAP) & HWCAP_ASIMD) ape_simd = APE_SIMD_NEON;
+#endif
+	log_info("using %s ape kernels", names[ape_simd]);
+}
+
+static void ape_simd_init(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, ape_simd_select);
+}
+
 #define MMAP_SIZE       (128*1024*1024)
 
+/* Reads the headers and the seek table, returns 0 or LIBLOSSLESS_ERR_* */
+static int ape_read_headers(int fd, struct ape_ctx_t *ape_ctx)
+{
+    unsigned char inbuffer[INPUT_CHUNKSIZE];
+
+	lseek(fd, 0, SEEK_SET);
+	if(read(fd, inbuffer, INPUT_CHUNKSIZE) != INPUT_CHUNKSIZE) {
+	    log_err("error reading headers");
+	    return LIBLOSSLESS_ERR_IO_READ;
+	}
+	if(ape_parseheaderbuf(inbuffer, ape_ctx) < 0) {
+	    log_err("error parsing headers");
+	    return LIBLOSSLESS_ERR_FORMAT;
+	}
+	if ((ape_ctx->fileversion < APE_MIN_VERSION) || (ape_ctx->fileversion > APE_MAX_VERSION)) {
+	    log_err("unsupported APE version");
+	    return LIBLOSSLESS_ERR_FORMAT;
+	}
+
+	/* Load the seek table up front, it's needed for seeking and parallel decoding */
+	if(ape_ctx->seektablelength) {
+	    ape_ctx->seektable = (uint32_t *) malloc(ape_ctx->seektablelength);
+	    if(!ape_ctx->seektable) {
+		log_err("no memory for seektable");	
+		return LIBLOSSLESS_ERR_NOMEM;
+	    }
+	    if(lseek(fd, ape_ctx->seektablefilepos, SEEK_SET) < 0
+		|| read(fd, ape_ctx->seektable, ape_ctx->seektablelength) != ape_ctx->seektablelength) {
+		log_info("cannot read seektable");
+		free(ape_ctx->seektable);
+		ape_ctx->seektable = 0;
+	    }
+	}
+    return 0;
+}
+
+/* Next track prepared by prefetch thread: headers and seek table read, decoder
+   allocated and the start of the first frame decoded. */
+
+#define PREFETCH_BLOCKS	BLOCKS_PER_LOOP
+
+struct ape_prefetch {
+    int fd;
+    off_t flen;
+    struct ape_ctx_t ape;
+    off_t off;			/* where decoding goes on */
+    int firstbyte;
+    int nblocks;		/* decoded, 0 if the frame decoder was not started */
+    int32_t *decoded[2];
+};
+
+void ape_prefetch_free(void *data)
+{
+    struct ape_prefetch *pf = (struct ape_prefetch *) data;
+	if(pf->ape.dec) ape_decoder_free(&pf->ape);
+	if(pf->ape.seektable) free(pf->ape.seektable);
+	if(pf->decoded[0]) free(pf->decoded[0]);
+	if(pf->decoded[1]) free(pf->decoded[1]);
+	if(pf->fd >= 0) close(pf->fd);
+	free(pf);
+}
+
+void *ape_prefetch(playback_ctx *ctx, const char *file)
+{
+    struct ape_prefetch *pf;
+    struct ape_ctx_t *ape;
+    const off_t pg_mask = sysconf(_SC_PAGESIZE) - 1;
+    unsigned char *mm, *mptr, *mend;
+    off_t map_off;
+    size_t map_len;
+    int n, consumed;
+
+	pf = (struct ape_prefetch *) calloc(1, sizeof(struct ape_prefetch));
+	if(!pf) return 0;
+	ape = &pf->ape;
+	pf->fd = open(file, O_RDONLY);
+	if(pf->fd < 0) {
+	    log_err("cannot open %s", file);
+	    goto err_exit;
+	}
+	pf->flen = lseek(pf->fd, 0, SEEK_END);
+	if(pf->flen <= 0 || ape_read_headers(pf->fd, ape) != 0) goto err_exit;
+	posix_fadvise(pf->fd, ape->firstframe, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+	pf->off = ape->firstframe;
+	pf->firstbyte = 3;
+	if(ape->channels != 2 || (ape->bps != 16 && ape->bps != 24) || !ape->totalframes) return pf;	/* let ape_play() complain */
+
+	ape_simd_init();
+	n = (ape->totalframes == 1) ? ape->finalframeblocks : ape->blocksperframe;
+	if(n > PREFETCH_BLOCKS) n = PREFETCH_BLOCKS;
+	pf->decoded[0] = (int32_t *) malloc(n * sizeof(int32_t));
+	pf->decoded[1] = (int32_t *) malloc(n * sizeof(int32_t));
+	if(!pf->decoded[0] || !pf->decoded[1] || ape_decoder_alloc(ape) != 0) return pf;	/* parsing is still worth something */
+
+	map_off = pf->off & ~pg_mask;
+	map_len = (pf->off & pg_mask) + FRAME_HEADER_BYTES + n * MAX_BYTES_PER_BLOCK;
+	if(map_len > pf->flen - map_off) map_len = pf->flen - map_off;
+	mm = (unsigned char *) mmap(0, map_len, PROT_READ, MAP_SHARED, pf->fd, map_off);
+	if(mm == MAP_FAILED) return pf;
+	mptr = mm + (pf->off & pg_mask);
+	mend = mm + map_len;
+	ape->currentframeblocks = (ape->totalframes == 1) ? ape->finalframeblocks : ape->blocksperframe;
+	init_frame_decoder(ape, mptr, mend, &pf->firstbyte, &consumed);
+	mptr += consumed;
+	if(decode_chunk(ape, mptr, mend, &pf->firstbyte, &consumed, pf->decoded[0], pf->decoded[1], n) < 0) {
+	    munmap(mm, map_len);
+	    goto err_exit;
+	}
+	mptr += consumed;
+	pf->off = map_off + (mptr - mm);
+	pf->nblocks = n;
+	munmap(mm, map_len);
+    return pf;
+
+    err_exit:
+	ape_prefetch_free(pf);
+    return 0;
+}
+
 int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int start) 
 {
     int currentframe, nblocks, bytesconsumed, bytesperblock, framesperblock;
-    int bytesinbuffer, blockstodecode, firstbyte;
-    int fd = -1, i = 0, n, bytes_to_write;
+    int blockstodecode, inblocks = 0, chunk, firstbyte;
+    int fd = -1, i = 0, k, n, bytes_to_write;
 
     int32_t  sample32;
    
-    unsigned char inbuffer[INPUT_CHUNKSIZE];
     int32_t *decoded[2] = { 0, 0 };
+    int32_t **out = decoded, **frame_planes = 0, *fp[2];
+    int frame_pos = 0;
+    pipeline *pl = 0;
+    decimator *dc = 0;
+    struct ape_par *par = 0;
+    struct ape_prefetch *pf = 0;
+    int32_t *pre[2];		/* decoded by prefetch, pre_left blocks from pre_pos on */
+    int pre_pos = 0, pre_left = 0;
     uint8_t *p, *pcmbuf = 0;	
 
     struct ape_ctx_t ape_ctx;
@@ -124,34 +279,31 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
     off_t off, cur_map_off;	/* file offset currently mapped to mm */
     size_t cur_map_len;		/* size of file chunk currently mapped */
     const off_t pg_mask = sysconf(_SC_PAGESIZE) - 1;
-    void *mptr, *mend, *mm = MAP_FAILED;
+    void *mm = MAP_FAILED;
+    unsigned char *mptr, *mend;		/* decoder input in the mapping */
     const playback_format_t *format;	  
  
-    int ape_read(void *buff, int nbytes) 
+    /* Make sure the next need bytes are mapped, unless the file ends first */
+    int ape_map(size_t need)
     {
-	if(mptr + nbytes > mend) {
-	    if(cur_map_off + cur_map_len == flen) nbytes = mend - mptr;  /* at EOF, no further remapping possible */
-	    else {  /* remap */
-		munmap(mm, cur_map_len);
-		off = mptr - mm;
-		cur_map_off = (cur_map_off + off) & ~pg_mask;
-		cur_map_len = (flen - cur_map_off) > MMAP_SIZE ? MMAP_SIZE : flen - cur_map_off;
-		mm = mmap(0, cur_map_len, PROT_READ, MAP_SHARED, fd, cur_map_off);
-		if(mm == MAP_FAILED) {
-		    log_err("mmap failed in %s: %s", __func__, strerror(errno));
-		    return -1;
-		}
-		mptr = mm + (off & pg_mask);
-		mend = mm + cur_map_len;
-		log_info("remapped");
-		if(mptr + nbytes > mend) nbytes = mend - mptr;  /* should be at eof */
-	    }
+	if(mptr + need <= mend || cur_map_off + cur_map_len == flen) return 0;
+	munmap(mm, cur_map_len);
+	off = cur_map_off + (mptr - (unsigned char *) mm);
+	cur_map_off = off & ~pg_mask;
+	cur_map_len = (flen - cur_map_off) > MMAP_SIZE ? MMAP_SIZE : flen - cur_map_off;
+	mm = mmap(0, cur_map_len, PROT_READ, MAP_SHARED, fd, cur_map_off);
+	if(mm == MAP_FAILED) {
+	    log_err("mmap failed in %s: %s", __func__, strerror(errno));
+	    return -1;
 	}
-	memcpy(buff, mptr, nbytes);
-	mptr += nbytes;
-	return nbytes;
-    }	
+	mptr = (unsigned char *) mm + (off & pg_mask);
+	mend = (unsigned char *) mm + cur_map_len;
+	log_info("remapped");
+	return 0;
+    }
 
+	ape_ctx.dec = 0;
+	ape_ctx.seektable = 0;
 
 #ifdef ANDROID
 	file = (*env)->GetStringUTFChars(env,jfile,NULL);
@@ -164,6 +316,17 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 #else
 	file = jfile;
 #endif
+	if(!start) pf = (struct ape_prefetch *) prefetch_take(ctx, file, FORMAT_APE);
+	if(pf) {	/* prepared while the previous track played */
+	    log_info("using prepared track, %d blocks decoded", pf->nblocks);
+	    fd = pf->fd; pf->fd = -1;
+	    flen = pf->flen;
+	    ape_ctx = pf->ape;
+	    ape_ctx.predictor.buf = ape_ctx.predictor.historybuffer + (pf->ape.predictor.buf - pf->ape.predictor.historybuffer);
+	    pf->ape.dec = 0;
+	    pf->ape.seektable = 0;
+	    goto parsed;
+	}
 	fd = open(file, O_RDONLY);
 	if(fd < 0) {
 	    log_err("cannot open %s", file);
@@ -178,45 +341,14 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 	    goto done;
 	}
 
-	lseek(fd, 0, SEEK_SET);
-
-	/* Read the file headers to populate the ape_ctx struct */
-
-	if(read(fd, inbuffer, INPUT_CHUNKSIZE) != INPUT_CHUNKSIZE) {
-	    log_err("error reading headers");
-	    ret = LIBLOSSLESS_ERR_IO_READ;
-	    goto done;
-	}
-
-	if(ape_parseheaderbuf(inbuffer, &ape_ctx) < 0) {
-	    log_err("error parsing headers");
-	    ret = LIBLOSSLESS_ERR_FORMAT;
-	    goto done;	
-	}
-
-	if ((ape_ctx.fileversion < APE_MIN_VERSION) || (ape_ctx.fileversion > APE_MAX_VERSION)) {
-	    log_err("unsupported APE version");
-	    ret = LIBLOSSLESS_ERR_FORMAT;
-	    goto done;
-	}
+	ret = ape_read_headers(fd, &ape_ctx);
+	if(ret != 0) goto done;
 
+    parsed:
 	if(start) {
-	    ape_ctx.seektable = (uint32_t *) malloc(ape_ctx.seektablelength);
 	    if(!ape_ctx.seektable) {
-		log_err("no memory for seektable");	
-		ret = LIBLOSSLESS_ERR_NOMEM;
-		goto done;
-	    }
-	    if(lseek(fd, ape_ctx.seektablefilepos, SEEK_SET) < 0) {
 		log_err("ape not seekable");	
 		ret = LIBLOSSLESS_ERR_FORMAT;
-		free(ape_ctx.seektable);
-		goto done;	
-	    }
-	    if(read(fd, ape_ctx.seektable, ape_ctx.seektablelength) != ape_ctx.seektablelength) {
-		log_err("cannot read seektable");	
-		ret = LIBLOSSLESS_ERR_FORMAT;
-		free(ape_ctx.seektable);
 		goto done;	
 	    }
 	    /* start_sample = ape_ctx.samplerate * start; */
@@ -224,11 +356,8 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 			(uint32_t *) &currentframe, (uint32_t *) &off,&samplestoskip) == 0) {
 		log_err("failed to determine seek offset");	
 		ret = LIBLOSSLESS_ERR_OFFSET;
-		free(ape_ctx.seektable);
 		goto done;
 	    }
-	    free(ape_ctx.seektable);
-	    ape_ctx.seektable = 0;
             firstbyte = 3 - (off & 3);
             off &= ~3;
 	} else {
@@ -260,6 +389,9 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 	    ctx->ape_tot = ape_ctx.totalframes - currentframe;
 	    free(decoded[0]); free(decoded[1]);
 	    free(pcmbuf);
+	    free(ape_ctx.seektable);
+	    if(ape_ctx.dec) ape_decoder_free(&ape_ctx);
+	    if(pf) ape_prefetch_free(pf);
 #ifdef ANDROID
 	    if(file) (*env)->ReleaseStringUTFChars(env,jfile,file);
 #endif
@@ -268,6 +400,20 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 	    return alsa_play_offload(ctx,fd,off);
 	}
 
+	ape_simd_init();
+	if(!ape_ctx.dec && ape_decoder_alloc(&ape_ctx) != 0) {
+	    log_err("no memory for decoder");
+	    ret = LIBLOSSLESS_ERR_NOMEM;
+	    goto done;
+	}
+	if(pf && pf->nblocks) {	/* first frame already started */
+	    off = pf->off;
+	    firstbyte = pf->firstbyte;
+	    pre[0] = pf->decoded[0];
+	    pre[1] = pf->decoded[1];
+	    pre_left = pf->nblocks;
+	}
+
 	cur_map_off = off & ~pg_mask;
 	cur_map_len = (flen - cur_map_off) > MMAP_SIZE ? MMAP_SIZE : flen - cur_map_off;
 
@@ -277,17 +423,15 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 	    ret = LIBLOSSLESS_ERR_INIT;
 	    goto done;
 	}
-	mptr = mm + (off & pg_mask);
-	mend = mm + cur_map_len;
+	mptr = (unsigned char *) mm + (off & pg_mask);
+	mend = (unsigned char *) mm + cur_map_len;
 
 	ret = audio_start(ctx, 1);
 	if(ret != 0) goto done;
-	if(ctx->rate_dec) {
-	    ret = LIBLOSSLESS_ERR_INIT;
-	    log_err("sorry, downsampling APE files not supported yet");
-	    goto done;
-	}
 	format = alsa_get_format(ctx);          /* format selected in alsa_start() */
+
+	par = ape_par_start(ctx, &ape_ctx, fd, flen);
+	if(par) pre_left = 0;	/* workers decode whole frames themselves */
 	
         update_track_time(env,obj,ctx->track_time);
 
@@ -298,6 +442,16 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 
 	if(!ctx->block_write) {
 	    if(framesperblock < ctx->block_max) framesperblock = ctx->block_max;
+	}
+	if(ctx->rate_dec) {	/* outputs whole blocks */
+	    dc = decimator_init(2, ctx->rate_dec, ape_ctx.samplerate, ape_ctx.bps, framesperblock);
+	    if(!dc) {
+		log_err("no memory");
+		ret = LIBLOSSLESS_ERR_NOMEM;
+		goto done;
+	    }
+	}
+	if(alsa_is_mmapped(ctx)) {	/* otherwise, decode into block or ring buffer directly */
 	    pcmbuf = (uint8_t *) malloc(2 * framesperblock * sizeof(int32_t));
 	    if(!pcmbuf) {
 		log_err("no memory"); 	
@@ -306,21 +460,16 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 	    }
 	}
 
-	decoded[0] = (int32_t *) malloc(framesperblock * sizeof(int32_t));
-	decoded[1] = (int32_t *) malloc(framesperblock * sizeof(int32_t));
+	/* when downsampling, decode enough for a full output block */
+	chunk = framesperblock << ctx->rate_dec;
+	decoded[0] = (int32_t *) malloc(chunk * sizeof(int32_t));
+	decoded[1] = (int32_t *) malloc(chunk * sizeof(int32_t));
 	if(!decoded[0] || !decoded[1]) {
 	    log_err("no memory"); 	
 	    ret = LIBLOSSLESS_ERR_NOMEM;
 	    goto done;	  
 	}
-
-	/* Initialise the buffer */
-	bytesinbuffer = ape_read(inbuffer, INPUT_CHUNKSIZE);
-	if(bytesinbuffer < 0) {
-	    log_err("read error");
-	    ret = LIBLOSSLESS_ERR_IO_READ;
-	    goto done;
-	}	
+	if(ctx->block_write) pl = pipeline_start(ctx, 2, chunk, framesperblock);
 
 	/* The main decoding loop - we decode the frames a small chunk at a time */
 	while(currentframe < ape_ctx.totalframes) {
@@ -331,47 +480,83 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 
 	    ape_ctx.currentframeblocks = nblocks;
 
-	    /* Initialise the frame decoder */
-	    init_frame_decoder(&ape_ctx, inbuffer, &firstbyte, &bytesconsumed);
-
-	    /* Update buffer */
-	    memmove(inbuffer, inbuffer + bytesconsumed, bytesinbuffer - bytesconsumed);
-	    bytesinbuffer -= bytesconsumed;
+	    if(par) {	/* frame is decoded by the workers */
+		decode_begin(ctx);
+		k = ape_par_next(par, currentframe, &frame_planes);
+		decode_end(ctx);
+		if(k != nblocks) {
+		    log_err("decoder error");
+		    ret = LIBLOSSLESS_ERR_DECODE;
+		    goto done;
+		}
+		frame_pos = 0;
+		goto decode;
+	    }
 
-	    n = ape_read(inbuffer + bytesinbuffer, INPUT_CHUNKSIZE - bytesinbuffer);
-	    if(n < 0) {
-		log_err("read error");
-		ret = LIBLOSSLESS_ERR_IO_READ;
-		goto done;
+	    /* Initialise the frame decoder, unless prefetch did */
+	    if(!pre_left) {
+		if(ape_map(FRAME_HEADER_BYTES) < 0) {
+		    ret = LIBLOSSLESS_ERR_IO_READ;
+		    goto done;
+		}
+		init_frame_decoder(&ape_ctx, mptr, mend, &firstbyte, &bytesconsumed);
+		mptr += bytesconsumed;
 	    }
-	    bytesinbuffer += n;
 
+	decode:
 	    /* Decode the frame a chunk at a time */
 	    while(nblocks > 0) {
 
 
-		blockstodecode = MIN(framesperblock, nblocks);
+		blockstodecode = MIN(chunk, nblocks);
 
-		if(decode_chunk(&ape_ctx, inbuffer, &firstbyte,
-			&bytesconsumed, decoded[0], decoded[1], blockstodecode) < 0)  {
-		    log_err("decoder error");
-		    ret = LIBLOSSLESS_ERR_DECODE;
-		    goto done;
+		if(pl) {	/* decode straight into pipeline block */
+		    out = pipeline_request(pl);
+		    if(!out) {
+			log_err("request for decoding buffer failed");
+			ret = LIBLOSSLESS_ERR_DECODE;
+			goto done;
+		    }
+		}
+
+		if(par) {
+		    fp[0] = frame_planes[0] + frame_pos;
+		    fp[1] = frame_planes[1] + frame_pos;
+		    frame_pos += blockstodecode;
+		    if(pl) {
+			memcpy(out[0], fp[0], blockstodecode * sizeof(int32_t));
+			memcpy(out[1], fp[1], blockstodecode * sizeof(int32_t));
+		    } else out = fp;
+		} else {
+		    k = 0;
+		    if(pre_left) {	/* decoded by prefetch */
+			k = MIN(pre_left, blockstodecode);
+			memcpy(out[0], pre[0] + pre_pos, k * sizeof(int32_t));
+			memcpy(out[1], pre[1] + pre_pos, k * sizeof(int32_t));
+			pre_pos += k;
+			pre_left -= k;
+		    }
+		    if(k < blockstodecode) {
+			if(ape_map((blockstodecode - k) * MAX_BYTES_PER_BLOCK) < 0) {
+			    ret = LIBLOSSLESS_ERR_IO_READ;
+			    goto done;
+			}
+			decode_begin(ctx);
+			k = decode_chunk(&ape_ctx, mptr, mend, &firstbyte, &bytesconsumed, out[0] + k, out[1] + k, blockstodecode - k);
+			decode_end(ctx);
+			if(k < 0) {
+			    log_err("decoder error");
+			    ret = LIBLOSSLESS_ERR_DECODE;
+			    goto done;
+			}
+			mptr += bytesconsumed;
+		    }
 		}
 
 	        if(samplestoskip) {
 		    log_info("samplestoskip %d", samplestoskip);		
 		    if(samplestoskip >= blockstodecode) {
 			samplestoskip -= blockstodecode;
-			memmove(inbuffer, inbuffer + bytesconsumed, bytesinbuffer - bytesconsumed);
-			bytesinbuffer -= bytesconsumed;
-			n = ape_read(inbuffer + bytesinbuffer, INPUT_CHUNKSIZE - bytesinbuffer);
-			if(n < 0) {
-			    log_err("read error");
-			    ret = LIBLOSSLESS_ERR_IO_READ;
-			    goto done;
-			}
-			bytesinbuffer += n;
 			nblocks -= blockstodecode;
 			continue;
 		    }
@@ -381,10 +566,23 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 		    /* Tradeoff for using block_write: we need period size from the start */	
 		    if(ctx->block_write) {
 			samplestoskip = 0;
-			continue;	
+			inblocks = blockstodecode;
+			goto consumed;
 		    }
 		}
 
+		inblocks = blockstodecode;
+		if(dc) {	/* output blocks from here on */
+		    blockstodecode = decimate(dc, out, samplestoskip, blockstodecode);
+		    if(!blockstodecode) goto consumed;
+		}
+
+	    output:
+		if(pl) {
+		    pipeline_commit(pl, blockstodecode, 1, DECORR_NONE);
+		    goto consumed;
+		}
+
 		/* Convert the output samples to PCM format and write to output file */
 
 		if(ctx->block_write) {
@@ -399,17 +597,24 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 			ret = LIBLOSSLESS_ERR_DECODE;
 			goto done;
 		    }	
+		} else if(!alsa_is_mmapped(ctx)) {
+		    p = audio_reserve(ctx, blockstodecode * ctx->channels * (format->phys_bits/8));
+		    if(!p) {
+			if(ctx->alsa_error) ret = LIBLOSSLESS_ERR_IO_WRITE;
+			goto done;
+		    }
+		    pcmbuf = p;
 		} else p = pcmbuf + bytes_to_write;
 
 		switch(format->fmt) {
 
 		    case SNDRV_PCM_FORMAT_S24_3LE:
-			for(i = samplestoskip; i < blockstodecode; i++) {
-			    sample32 = decoded[0][i];
+			for(i = samplestoskip; i < samplestoskip + blockstodecode; i++) {
+			    sample32 = out[0][i];
 			    *p++ = sample32 & 0xff;
 			    *p++ = (sample32 >> 8) & 0xff;
 			    *p++ = (sample32 >> 16) & 0xff;
-			    sample32 = decoded[1][i];
+			    sample32 = out[1][i];
 			    *p++ = sample32 & 0xff;
 			    *p++ = (sample32 >> 8) & 0xff;
 			    *p++ = (sample32 >> 16) & 0xff;
@@ -417,16 +622,16 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 			break;
 
 		    case SNDRV_PCM_FORMAT_S24_LE:
-			for(i = samplestoskip; i < blockstodecode; i++) {
-			    *((int32_t *) p) = decoded[0][i]; p += 4;
-			    *((int32_t *) p) = decoded[1][i]; p += 4;
+			for(i = samplestoskip; i < samplestoskip + blockstodecode; i++) {
+			    *((int32_t *) p) = out[0][i]; p += 4;
+			    *((int32_t *) p) = out[1][i]; p += 4;
 			}
 			break;
 
 		    case SNDRV_PCM_FORMAT_S16_LE:
-			for(i = samplestoskip; i < blockstodecode; i++) {
-			    *((int16_t *) p) = decoded[0][i]; p += 2;
-			    *((int16_t *) p) = decoded[1][i]; p += 2;
+			for(i = samplestoskip; i < samplestoskip + blockstodecode; i++) {
+			    *((int16_t *) p) = out[0][i]; p += 2;
+			    *((int16_t *) p) = out[1][i]; p += 2;
 			}
 			break;
 		    default:
@@ -444,6 +649,11 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 		    }
 		    blk_buffer_commit_decoding(ctx->blk_buff);
 
+		} else if(!alsa_is_mmapped(ctx)) {
+		    if(audio_commit(ctx, p - pcmbuf) < 0) {
+			if(ctx->alsa_error) ret = LIBLOSSLESS_ERR_IO_WRITE;
+			goto done;
+		    }
 		} else {
 		    n = p - pcmbuf;
 		    if(n >= bytesperblock) {
@@ -462,36 +672,47 @@ int ape_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, int sta
 		    bytes_to_write = n;
 		}
 
-		/* Update the buffer */
-		memmove(inbuffer, inbuffer + bytesconsumed, bytesinbuffer - bytesconsumed);
-		bytesinbuffer -= bytesconsumed;
-
-		n = ape_read(inbuffer + bytesinbuffer, INPUT_CHUNKSIZE - bytesinbuffer);
-
-		if(n < 0) {
-		    log_err("read error");
-		    ret = LIBLOSSLESS_ERR_IO_READ;
-		    goto done;
-		}
-	
-		bytesinbuffer += n;
-
+	    consumed:
 		/* Decrement the block count */
-		nblocks -= blockstodecode;
+		nblocks -= inblocks;
 
 	    }  /* while(nblocks > 0)*/
 	    currentframe++;
+
+	    /* the decimator still holds the last outputs: write them as more blocks */
+	    if(dc && currentframe >= ape_ctx.totalframes) {
+		if(pl) {
+		    out = pipeline_request(pl);
+		    if(!out) {
+			log_err("request for decoding buffer failed");
+			ret = LIBLOSSLESS_ERR_DECODE;
+			goto done;
+		    }
+		} else out = decoded;
+		samplestoskip = 0;
+		inblocks = nblocks = 0;
+		blockstodecode = decimator_flush(dc, out, 0);
+		if(blockstodecode) goto output;	/* and back here */
+		decimator_free(dc);
+		dc = 0;
+	    }
 	}  /* currentframe < ape_ctx.totalframes */
 
     done:
+	if(par) ape_par_free(par);
+	if(pl) pipeline_finish(pl, ret != 0);
+	if(dc) decimator_free(dc);
 	if(decoded[0]) free(decoded[0]);
 	if(decoded[1]) free(decoded[1]);
-	if(!ctx->block_write && pcmbuf) free(pcmbuf);
+	if(ape_ctx.dec) ape_decoder_free(&ape_ctx);
+	if(ape_ctx.seektable) free(ape_ctx.seektable);
+	if(alsa_is_mmapped(ctx) && pcmbuf) free(pcmbuf);
 #ifdef ANDROID
 	if(file) (*env)->ReleaseStringUTFChars(env,jfile,file);
 #endif
 	if(fd >= 0) close(fd);
 	if(mm != MAP_FAILED) munmap(mm, cur_map_len);
+	if(pf) ape_prefetch_free(pf);
 
 	log_info("exiting, ret=%d, err=%d", ret, ctx->alsa_error);
 	playback_complete(ctx, __func__);
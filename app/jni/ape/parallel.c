@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <errno.h>
+#ifdef ANDROID
+#include <android/log.h>
+#endif
+#include "demac.h"
+#include "../jni_sub.h"
+#include "../main.h"
+
+/*  Frame-parallel APE decoding. Every frame restarts the range coder, filters and
+    predictor, and the seek table gives the offset of each of them, so frames can be
+    decoded independently. The playback thread asks for frames in stream order; up to
+    njobs frames ahead are queued to a pool of workers, each with its own ape_ctx_t and
+    decoder state, which map their frame from the file and decode it into the planar
+    buffers of the job. Jobs are handed back strictly in order. */
+
+#define PAR_MAX_WORKERS		4
+#define PAR_JOBS_PER_WORKER	2
+#define PAR_MAX_JOBS		(PAR_MAX_WORKERS * PAR_JOBS_PER_WORKER)
+
+/* Worth it for the 256/1280-tap levels at 24/48 stereo or more */
+#define PAR_AUTO_RATE		(48000 * 2 * 24)
+#define PAR_AUTO_LEVEL		4000
+
+/* Decoder may look a few bytes past the start of the next frame */
+#define FRAME_SLACK		16
+
+#define CHUNK_BLOCKS		4608
+
+struct ape_job {
+    int frame, nblocks;
+    int ret, done;
+    int32_t *planes[2];
+};
+
+struct ape_par;
+
+struct ape_worker {
+    struct ape_par *par;
+    struct ape_ctx_t ape;	/* own copy of the header and decoder state */
+    pthread_t thread;
+};
+
+struct ape_par {
+    playback_ctx *ctx;
+    const struct ape_ctx_t *ape;	/* playback thread's context with the seek table */
+    int fd;
+    off_t flen, pg_mask;
+    struct ape_worker workers[PAR_MAX_WORKERS];
+    int nworkers, njobs;
+    struct ape_job jobs[PAR_MAX_JOBS];
+    int32_t *mem;
+    unsigned int submit, take, emit;	/* job sequence numbers */
+    int held;			/* job at emit is still being used by caller */
+    int next_frame;		/* next frame to queue */
+    int quit;
+    pthread_mutex_t mutex;
+    pthread_cond_t work, done;
+};
+
+int ape_threads = -1;
+
+static int frame_blocks(const struct ape_ctx_t *ape, int frame)
+{
+    return (frame == ape->totalframes - 1) ? ape->finalframeblocks : ape->blocksperframe;
+}
+
+static int decode_frame(struct ape_worker *w, struct ape_job *job)
+{
+    struct ape_par *par = w->par;
+    const struct ape_ctx_t *ape = par->ape;
+    off_t start = ape->seektable[job->frame], end, map_off;
+    size_t map_len;
+    int firstbyte, consumed, n, pos;
+    unsigned char *mm, *buf, *bend;
+
+	end = (job->frame == ape->totalframes - 1) ? par->flen : (off_t) ape->seektable[job->frame + 1] + FRAME_SLACK;
+	if(end > par->flen) end = par->flen;
+	map_off = start & ~par->pg_mask;
+	map_len = end - map_off;
+	mm = mmap(0, map_len, PROT_READ, MAP_SHARED, par->fd, map_off);
+	if(mm == MAP_FAILED) {
+	    log_err("mmap failed for frame %d: %s", job->frame, strerror(errno));
+	    return -1;
+	}
+	buf = mm + ((start & ~3) - map_off);
+	bend = mm + map_len;
+	firstbyte = 3 - (start & 3);
+
+	w->ape.currentframeblocks = job->nblocks;
+	init_frame_decoder(&w->ape, buf, bend, &firstbyte, &consumed);
+	buf += consumed;
+	for(pos = 0; pos < job->nblocks && buf < bend; pos += n) {
+	    n = job->nblocks - pos;
+	    if(n > CHUNK_BLOCKS) n = CHUNK_BLOCKS;
+	    if(decode_chunk(&w->ape, buf, bend, &firstbyte, &consumed, job->planes[0] + pos, job->planes[1] + pos, n) < 0) break;
+	    buf += consumed;
+	}
+	munmap(mm, map_len);
+	if(pos < job->nblocks) {
+	    log_err("frame %d truncated or corrupt", job->frame);
+	    return -1;
+	}
+    return 0;
+}
+
+static void *worker(void *a)
+{
+    struct ape_worker *w = (struct ape_worker *) a;
+    struct ape_par *par = w->par;
+    struct ape_job *job;
+    struct schedset ss = *alsa_get_schedset(par->ctx);
+
+	ss.decoder_cpu = -1;	/* spread over all cores */
+	sched_apply(&ss, 0);
+	pthread_mutex_lock(&par->mutex);
+	while(!par->quit) {
+	    if(par->take == par->submit) {
+		pthread_cond_wait(&par->work, &par->mutex);
+		continue;
+	    }
+	    job = &par->jobs[par->take++ % par->njobs];
+	    pthread_mutex_unlock(&par->mutex);
+	    job->ret = decode_frame(w, job);
+	    pthread_mutex_lock(&par->mutex);
+	    job->done = 1;
+	    pthread_cond_broadcast(&par->done);
+	}
+	pthread_mutex_unlock(&par->mutex);
+    return 0;
+}
+
+/* Returns zero if parallel decoding is off, not worth it or not possible for this file */
+struct ape_par *ape_par_start(playback_ctx *ctx, const struct ape_ctx_t *ape, int fd, off_t flen)
+{
+    struct ape_par *par;
+    int i, n = ape_threads, ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t plane = (ape->blocksperframe + 15) & ~15;
+
+	if(n < 0) {
+	    if(ncpu < 2 || ape->compressiontype < PAR_AUTO_LEVEL
+		|| (int64_t) ape->samplerate * ape->channels * ape->bps < PAR_AUTO_RATE) return 0;
+	    n = ncpu;
+	}
+	if(n == 0 || !ape->seektable || ape->totalframes < 2) return 0;
+	if(ape->numseekpoints < ape->totalframes || ape->finalframeblocks > ape->blocksperframe) {
+	    log_info("incomplete seek table, decoding sequentially");
+	    return 0;
+	}
+	for(i = 0; i < ape->totalframes; i++) {
+	    if(ape->seektable[i] < ape->firstframe || ape->seektable[i] >= flen
+		|| (i && ape->seektable[i] <= ape->seektable[i - 1])) {
+		log_info("bad seek table, decoding sequentially");
+		return 0;
+	    }
+	}
+	if(n > PAR_MAX_WORKERS) n = PAR_MAX_WORKERS;
+
+	par = (struct ape_par *) calloc(1, sizeof(struct ape_par));
+	if(!par) return 0;
+	par->ctx = ctx;
+	par->ape = ape;
+	par->fd = fd;
+	par->flen = flen;
+	par->pg_mask = sysconf(_SC_PAGESIZE) - 1;
+	par->njobs = n * PAR_JOBS_PER_WORKER;
+	par->mem = (int32_t *) malloc(par->njobs * 2 * plane * sizeof(int32_t));
+	if(!par->mem) {
+	    log_err("no memory");
+	    free(par);
+	    return 0;
+	}
+	for(i = 0; i < par->njobs; i++) {
+	    par->jobs[i].planes[0] = par->mem + (i * 2) * plane;
+	    par->jobs[i].planes[1] = par->mem + (i * 2 + 1) * plane;
+	}
+	pthread_mutex_init(&par->mutex, 0);
+	pthread_cond_init(&par->work, 0);
+	pthread_cond_init(&par->done, 0);
+	for(i = 0; i < n; i++) {
+	    struct ape_worker *w = &par->workers[i];
+	    w->par = par;
+	    w->ape = *ape;
+	    w->ape.seektable = 0;
+	    if(ape_decoder_alloc(&w->ape) != 0) break;
+	    if(pthread_create(&w->thread, 0, worker, w) != 0) {
+		ape_decoder_free(&w->ape);
+		break;
+	    }
+	}
+	par->nworkers = i;
+	if(i == 0) {
+	    log_err("cannot start decoder threads");
+	    ape_par_free(par);
+	    return 0;
+	}
+	log_info("%d decoder threads", par->nworkers);
+    return par;
+}
+
+void ape_par_free(struct ape_par *par)
+{
+    int i;
+	pthread_mutex_lock(&par->mutex);
+	par->quit = 1;
+	pthread_cond_broadcast(&par->work);
+	pthread_mutex_unlock(&par->mutex);
+	for(i = 0; i < par->nworkers; i++) {
+	    pthread_join(par->workers[i].thread, 0);
+	    ape_decoder_free(&par->workers[i].ape);
+	}
+	pthread_mutex_destroy(&par->mutex);
+	pthread_cond_destroy(&par->work);
+	pthread_cond_destroy(&par->done);
+	free(par->mem);
+	free(par);
+}
+
+/* To be called with mutex locked */
+static void wait_done(struct ape_par *par, struct ape_job *job)
+{
+	while(!job->done) pthread_cond_wait(&par->done, &par->mutex);
+}
+
+/* Returns the number of blocks in frame and its planar samples in *planes,
+   or negative on decoder error. The planes are valid until the next call. */
+int ape_par_next(struct ape_par *par, int frame, int32_t ***planes)
+{
+    struct ape_job *job;
+
+	pthread_mutex_lock(&par->mutex);
+	if(par->held) {
+	    par->emit++;
+	    par->held = 0;
+	}
+	if(par->emit != par->submit && par->jobs[par->emit % par->njobs].frame != frame) {
+	    log_info("cursor moved, dropping queued frames");
+	    for(; par->emit != par->submit; par->emit++) wait_done(par, &par->jobs[par->emit % par->njobs]);
+	}
+	if(par->emit == par->submit) par->next_frame = frame;
+	while(par->submit - par->emit < par->njobs && par->next_frame < par->ape->totalframes) {
+	    job = &par->jobs[par->submit % par->njobs];
+	    job->frame = par->next_frame++;
+	    job->nblocks = frame_blocks(par->ape, job->frame);
+	    job->done = 0;
+	    par->submit++;
+	    pthread_cond_signal(&par->work);
+	}
+	if(par->emit == par->submit) {
+	    pthread_mutex_unlock(&par->mutex);
+	    return -1;
+	}
+	job = &par->jobs[par->emit % par->njobs];
+	wait_done(par, job);
+	par->held = 1;
+	pthread_mutex_unlock(&par->mutex);
+	if(job->ret < 0) return job->ret;
+	*planes = job->planes;
+    return job->nblocks;
+}
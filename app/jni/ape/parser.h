@@ -86,6 +86,56 @@ struct predictor_t
     int32_t historybuffer[PREDICTOR_HISTORY_SIZE + PREDICTOR_SIZE];
 };
 
+/* NN filter state, one per channel and filter stage */
+struct filter_t {
+    filter_int* coeffs; /* ORDER entries */
+
+    /* We store all the filter delays in a single buffer */
+    filter_int* history_end;
+
+    filter_int* delay;
+    filter_int* adaptcoeffs;
+
+    int avg;
+
+    /* Apply loop for the file version and the selected vector kernels */
+    void (*apply)(struct filter_t* f, int32_t* data, int count);
+};
+
+struct rangecoder_t
+{
+    uint32_t low;        /* low end of interval */
+    uint32_t range;      /* length of interval */
+    uint32_t help;       /* bytes_to_follow resp. intermediate value */
+    unsigned int buffer; /* buffer for input/output */
+};
+
+struct rice_t
+{
+  uint32_t k;
+  uint32_t ksum;
+};
+
+/* Up to three filter stages: 16/32/64, 256 and 1280 taps */
+#define APE_FILTER_STAGES 3
+
+/* Per-instance decoder state, allocated by ape_decoder_alloc() together
+   with the filter histories needed for the file's compression level. */
+struct ape_decoder_t
+{
+    /* Entropy decoder */
+    unsigned char* bytebuffer;
+    unsigned char* bytebufferend;	/* reads past it return zero */
+    int bytebufferoffset;
+    struct rangecoder_t rc;
+    struct rice_t riceX;
+    struct rice_t riceY;
+
+    /* Filters */
+    struct filter_t filter[APE_FILTER_STAGES][2];
+    filter_int* filterbuf[APE_FILTER_STAGES];
+};
+
 struct ape_ctx_t
 {
     /* Derived fields */
@@ -128,6 +178,7 @@ struct ape_ctx_t
     int           currentframeblocks;
     int           blocksdecoded;
     struct predictor_t predictor;
+    struct ape_decoder_t* dec;
 };
 
 int ape_parseheader(int fd, struct ape_ctx_t* ape_ctx);
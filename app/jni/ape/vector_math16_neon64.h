@@ -0,0 +1,65 @@
+/*
+
+libdemac - A Monkey's Audio decoder
+
+$Id$
+
+Copyright (C) Dave Chapman 2007
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110, USA
+
+*/
+
+/* AArch64 NEON versions of the fused vector operations. The low and high
+   halves are accumulated separately to keep two multiply chains going. */
+
+#include <arm_neon.h>
+#include "demac_config.h"
+
+/* Calculate scalarproduct, then add or subtract a 2nd vector */
+#define VM_SP_NEON(name, op)                                                \
+static inline int32_t ST(name)(int16_t* v1, int16_t* f2, int16_t* s2)       \
+{                                                                           \
+    int32x4_t acc0 = vdupq_n_s32(0), acc1 = vdupq_n_s32(0);                 \
+    int16x8_t c, d;                                                         \
+    int i;                                                                  \
+    for (i = 0; i < ORDER; i += 8) {                                        \
+        c = vld1q_s16(v1 + i);                                              \
+        d = vld1q_s16(f2 + i);                                              \
+        acc0 = vmlal_s16(acc0, vget_low_s16(c), vget_low_s16(d));           \
+        acc1 = vmlal_high_s16(acc1, c, d);                                  \
+        vst1q_s16(v1 + i, op(c, vld1q_s16(s2 + i)));                        \
+    }                                                                       \
+    return vaddvq_s32(vaddq_s32(acc0, acc1));                               \
+}
+
+VM_SP_NEON(vector_sp_add_neon, vaddq_s16)
+VM_SP_NEON(vector_sp_sub_neon, vsubq_s16)
+
+#undef VM_SP_NEON
+
+static inline int32_t ST(scalarproduct_neon)(int16_t* v1, int16_t* v2)
+{
+    int32x4_t acc0 = vdupq_n_s32(0), acc1 = vdupq_n_s32(0);
+    int16x8_t c, d;
+    int i;
+    for (i = 0; i < ORDER; i += 8) {
+        c = vld1q_s16(v1 + i);
+        d = vld1q_s16(v2 + i);
+        acc0 = vmlal_s16(acc0, vget_low_s16(c), vget_low_s16(d));
+        acc1 = vmlal_high_s16(acc1, c, d);
+    }
+    return vaddvq_s32(vaddq_s32(acc0, acc1));
+}
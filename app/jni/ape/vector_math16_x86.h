@@ -0,0 +1,117 @@
+/*
+
+libdemac - A Monkey's Audio decoder
+
+$Id$
+
+Copyright (C) Dave Chapman 2007
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110, USA
+
+*/
+
+/* SSE2 and AVX2 versions of the fused vector operations. Both are built
+   into every x86 binary and picked at run time (see ape_simd). The delay
+   line moves by one sample per call, so all loads are unaligned. */
+
+#include <immintrin.h>
+#include "demac_config.h"
+
+#ifndef _VECTOR_MATH16_X86_H
+#define _VECTOR_MATH16_X86_H
+
+#define SSE2_ATTR __attribute__((target("sse2")))
+#define AVX2_ATTR __attribute__((target("avx2")))
+
+static inline SSE2_ATTR int32_t vm_hsum_sse2(__m128i acc)
+{
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+    return _mm_cvtsi128_si32(acc);
+}
+
+static inline AVX2_ATTR int32_t vm_hsum_avx2(__m256i acc)
+{
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                              _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+}
+
+#endif /* _VECTOR_MATH16_X86_H */
+
+/* Calculate scalarproduct, then add or subtract a 2nd vector */
+#define VM_SP_SSE2(name, op)                                                \
+static inline SSE2_ATTR int32_t ST(name)(int16_t* v1, int16_t* f2,          \
+                                         int16_t* s2)                       \
+{                                                                           \
+    __m128i acc = _mm_setzero_si128(), c;                                   \
+    int i;                                                                  \
+    for (i = 0; i < ORDER; i += 8) {                                        \
+        c = _mm_loadu_si128((__m128i*) (v1 + i));                           \
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(c,                          \
+                  _mm_loadu_si128((__m128i*) (f2 + i))));                   \
+        _mm_storeu_si128((__m128i*) (v1 + i),                               \
+                  op(c, _mm_loadu_si128((__m128i*) (s2 + i))));             \
+    }                                                                       \
+    return vm_hsum_sse2(acc);                                               \
+}
+
+#define VM_SP_AVX2(name, op)                                                \
+static inline AVX2_ATTR int32_t ST(name)(int16_t* v1, int16_t* f2,          \
+                                         int16_t* s2)                       \
+{                                                                           \
+    __m256i acc = _mm256_setzero_si256(), c;                                \
+    int i;                                                                  \
+    for (i = 0; i < ORDER; i += 16) {                                       \
+        c = _mm256_loadu_si256((__m256i*) (v1 + i));                        \
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(c,                    \
+                  _mm256_loadu_si256((__m256i*) (f2 + i))));                \
+        _mm256_storeu_si256((__m256i*) (v1 + i),                            \
+                  op(c, _mm256_loadu_si256((__m256i*) (s2 + i))));          \
+    }                                                                       \
+    return vm_hsum_avx2(acc);                                               \
+}
+
+VM_SP_SSE2(vector_sp_add_sse2, _mm_add_epi16)
+VM_SP_SSE2(vector_sp_sub_sse2, _mm_sub_epi16)
+VM_SP_AVX2(vector_sp_add_avx2, _mm256_add_epi16)
+VM_SP_AVX2(vector_sp_sub_avx2, _mm256_sub_epi16)
+
+#undef VM_SP_SSE2
+#undef VM_SP_AVX2
+
+static inline SSE2_ATTR int32_t ST(scalarproduct_sse2)(int16_t* v1, int16_t* v2)
+{
+    __m128i acc = _mm_setzero_si128();
+    int i;
+    for (i = 0; i < ORDER; i += 8)
+        acc = _mm_add_epi32(acc,
+                  _mm_madd_epi16(_mm_loadu_si128((__m128i*) (v1 + i)),
+                                 _mm_loadu_si128((__m128i*) (v2 + i))));
+    return vm_hsum_sse2(acc);
+}
+
+static inline AVX2_ATTR int32_t ST(scalarproduct_avx2)(int16_t* v1, int16_t* v2)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int i;
+    for (i = 0; i < ORDER; i += 16)
+        acc = _mm256_add_epi32(acc,
+                  _mm256_madd_epi16(_mm256_loadu_si256((__m256i*) (v1 + i)),
+                                    _mm256_loadu_si256((__m256i*) (v2 + i))));
+    return vm_hsum_avx2(acc);
+}
@@ -1,10 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#ifdef ANDROID
+#include <linux/ashmem.h>
+#endif
 #ifdef ANDROID
 #include <android/log.h>
 #endif
@@ -13,41 +25,246 @@
 
 #define BUFF_FILL_TEST	1
 
-/* TODO: elmimnate memcpys on buffer_get() */
+/* Adaptive buffer depth. On each commit the producer sets the time the decoder has
+   spent decoding since the last one (decode_begin/decode_end) against the playback time
+   of the unit (block or bytes) committed, and the consumer counts how often it finds
+   the buffer empty. Once per window the fill limit is raised if headroom 
+   is low or the consumer starved, and slowly lowered while everything is calm. */
+
+#define DEPTH_CTL_WINDOW_US	2000000
+#define DEPTH_CTL_CALM_WINDOWS	4
+
+struct depth_ctl {
+    int min, max;		/* limits, in blocks or bytes */
+    int depth;			/* current fill limit */
+    int usec_per_unit;		/* block buffer: playback time of one block */
+    int bytes_per_sec;		/* pcm buffer */
+    uint64_t dec_us, play_us;	/* over current window */
+    int primed;			/* buffer has been filled up once */
+    int starved;		/* consumer's blocked_gets at start of window */
+    int calm;			/* windows without stress */
+    const unsigned long long *dec_src;	/* decoder's running total, see decode_end() */
+    unsigned long long dec_last;	/* its value at previous commit */
+};
+
+static inline void depth_ctl_init(struct depth_ctl *dc, int depth)
+{
+    memset(dc, 0, sizeof(struct depth_ctl));
+    dc->min = dc->max = dc->depth = depth;
+}
+
+static inline void depth_ctl_set_source(struct depth_ctl *dc, const unsigned long long *dec_us)
+{
+    dc->dec_src = dec_us;
+    dc->dec_last = dec_us ? __atomic_load_n(dec_us, __ATOMIC_RELAXED) : 0;
+}
+
+/* Called by producer on commit. Returns nonzero if depth has changed. */
+static int depth_ctl_commit(struct depth_ctl *dc, uint64_t play_us, int fill, int blocked_gets)
+{
+    int depth = dc->depth, load;
+    unsigned long long us = 0, total;
+
+    if(dc->dec_src) {	/* decoding done since the previous commit, possibly on another thread */
+	total = __atomic_load_n(dc->dec_src, __ATOMIC_RELAXED);
+	if(total > dc->dec_last) us = total - dc->dec_last;
+	dc->dec_last = total;
+    }
+    if(dc->min == dc->max) return 0;
+    dc->dec_us += us;
+    dc->play_us += play_us;
+    if(!dc->primed) {
+	if(fill < dc->depth && dc->play_us < DEPTH_CTL_WINDOW_US) return 0;
+	dc->primed = 1;		/* consumer blocking until now was just startup */
+	dc->starved = blocked_gets;
+	dc->dec_us = dc->play_us = 0;
+	return 0;
+    }
+    if(dc->play_us < DEPTH_CTL_WINDOW_US) return 0;
+
+    load = (int) (dc->dec_us * 100 / dc->play_us);	/* percent of real time spent decoding */
+    if(blocked_gets != dc->starved) depth *= 2;
+    else if(load > 50) depth += depth / 2;
+    else if(load < 20 && ++dc->calm >= DEPTH_CTL_CALM_WINDOWS) depth -= depth / 4;
+    if(depth > dc->max) depth = dc->max;
+    if(depth < dc->min) depth = dc->min;
+    dc->starved = blocked_gets;
+    dc->dec_us = dc->play_us = 0;
+    if(depth == dc->depth) return 0;
+    log_info("decoder load %d%%, depth %d -> %d", load, dc->depth, depth);
+    dc->depth = depth;
+    dc->calm = 0;
+    return 1;
+}
+
+/* Single producer/single consumer ring. The producer (decoder) owns head, the consumer 
+   (audio_write_thread) owns tail; both run in [0, 2*size) so that full and empty rings 
+   can be told apart without a separate counter. Neither side takes a lock on the fast path: 
+   the other side is woken up through a futex only if it has announced it is about to block. */
+
 struct pcm_buffer_t {
     void *mem;
     int size;
-    int start_idx;              /* index of first valid byte to read */
-    int bytes;                  /* bytes currently occupying buffer */
-    volatile int should_run;
-    volatile int abort;         /* terminate immediately */
-    pthread_mutex_t mutex;
-    pthread_mutex_t mutex_cond;
-    pthread_cond_t  buff_changed;
-    pthread_t reader;   
-#ifdef BUFF_FILL_TEST
+    int head;			/* write index, updated by producer only */
+    int tail;			/* read index, updated by consumer only */
+    int should_run;
+    int abort;			/* terminate immediately */
+    int wseq, rseq;		/* futex words, bumped to wake up blocked writer/reader */
+    int wwait, rwait;		/* writer/reader is about to sleep on wseq/rseq */
+    void *wbounce, *rbounce;	/* used only when the requested window wraps around */
+    int wbounce_size, rbounce_size;
+    void *wptr;			/* window returned by the last reserve_write() */
+    int mirrored;		/* mem is mapped twice back to back: no wrap-around */
+    int locked;
+    struct depth_ctl ctl;	/* producer only */
     int total_puts, blocked_puts;
     int total_gets, blocked_gets;
-#endif
 };
 
+static inline void futex_wait(int *addr, int val)
+{
+    syscall(__NR_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/* Returns nonzero if deadline has passed */
+static inline int futex_wait_until(int *addr, int val, const struct timespec *deadline)
+{
+    struct timespec now, ts;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ts.tv_sec = deadline->tv_sec - now.tv_sec;
+    ts.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if(ts.tv_nsec < 0) {
+	ts.tv_sec--;
+	ts.tv_nsec += 1000000000;
+    }
+    if(ts.tv_sec < 0) return 1;
+    return syscall(__NR_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0) != 0 && errno == ETIMEDOUT;
+}
+
+static inline void futex_wake(int *addr)
+{
+    syscall(__NR_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline void wake_side(int *waiting, int *seq)
+{
+    if(__atomic_load_n(waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+	__atomic_fetch_add(seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(seq);
+    }
+}
+
+static inline int ring_fill(pcm_buffer *buff, int head, int tail)
+{
+    int k = head - tail;
+    return k < 0 ? k + 2 * buff->size : k;
+}
+
+static inline int ring_off(pcm_buffer *buff, int idx)
+{
+    return idx >= buff->size ? idx - buff->size : idx;
+}
+
+static inline int ring_advance(pcm_buffer *buff, int idx, int bytes)
+{
+    idx += bytes;
+    return idx >= 2 * buff->size ? idx - 2 * buff->size : idx;
+}
+
+static inline int buffer_stopped(pcm_buffer *buff) 
+{
+    return __atomic_load_n(&buff->abort, __ATOMIC_ACQUIRE) || !__atomic_load_n(&buff->should_run, __ATOMIC_ACQUIRE);
+}
+
+static void *grow_bounce(void **buf, int *cur, int bytes)
+{
+    void *p;
+    if(*cur >= bytes) return *buf;
+    p = realloc(*buf, bytes);
+    if(!p) return 0;
+    *buf = p;
+    *cur = bytes;
+    return p;
+}
+
+/* Returns fd of an anonymous shared memory object of the given size, or -1 */
+static int shm_anon(int size)
+{
+    int fd = -1;
+#ifdef __NR_memfd_create
+    fd = syscall(__NR_memfd_create, "pcm_ring", 0);
+    if(fd >= 0 && ftruncate(fd, size) != 0) {
+	close(fd);
+	fd = -1;
+    }
+#endif
+#ifdef ANDROID
+    if(fd < 0) {	/* pre-3.17 kernels */
+	fd = open("/dev/ashmem", O_RDWR);
+	if(fd >= 0 && ioctl(fd, ASHMEM_SET_SIZE, size) < 0) {
+	    close(fd);
+	    fd = -1;
+	}
+    }
+#endif
+    return fd;
+}
+
+/* Map the same pages twice, so that any window of up to size bytes 
+   starting inside [mem, mem + size) is contiguous in memory. */
+static void *ring_map(int size)
+{
+    void *base, *p;
+    int fd = shm_anon(size);
+
+    if(fd < 0) return 0;
+    base = mmap(0, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) {
+	close(fd);
+	return 0;
+    }
+    p = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    if(p == base) p = mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    close(fd);
+    if(p != base + size) {
+	munmap(base, 2 * size);
+	return 0;
+    }
+    return base;
+}
+
 pcm_buffer *pcm_buffer_create(int size) 
 {
+    int pg = getpagesize();
     pcm_buffer *buff = (pcm_buffer *) calloc(1, sizeof(pcm_buffer));
     if(!buff) return 0;	
-    buff->size = size;	
-    buff->mem = malloc(size);
+    buff->size = (size + pg - 1) & ~(pg - 1);
+    buff->mem = ring_map(buff->size);
+    if(buff->mem) buff->mirrored = 1;
+    else {
+	log_info("cannot create mirrored ring, falling back to bounce buffers");
+	buff->size = size;
+	buff->mem = malloc(size);
+    }
     if(!buff->mem) {
 	free(buff);
 	return 0;
     }
-    pthread_mutex_init(&buff->mutex, 0);	
-    pthread_mutex_init(&buff->mutex_cond, 0);	
-    pthread_cond_init(&buff->buff_changed, 0);
+    depth_ctl_init(&buff->ctl, buff->size);
     buff->should_run = 1;
     return buff;
 }
 
+/* Enables adaptive fill limit between min_bytes and the buffer size */
+void pcm_buffer_set_depth(pcm_buffer *buff, int min_bytes, int bytes_per_sec, const unsigned long long *dec_us)
+{
+    if(min_bytes > buff->size) min_bytes = buff->size;
+    buff->ctl.min = buff->ctl.depth = min_bytes;
+    buff->ctl.max = buff->size;
+    buff->ctl.bytes_per_sec = bytes_per_sec;
+    depth_ctl_set_source(&buff->ctl, dec_us);
+}
+
 void pcm_buffer_destroy(pcm_buffer *buff)
 {
     if(buff) {
@@ -55,79 +272,194 @@ void pcm_buffer_destroy(pcm_buffer *buff)
 	log_info("blocked/total: writes=%d/%d reads=%d/%d", buff->blocked_puts, buff->total_puts, 
 	    buff->blocked_gets, buff->total_gets);
 #endif
-	if(buff->mem) free(buff->mem);
-	pthread_mutex_destroy(&buff->mutex);
-	pthread_mutex_destroy(&buff->mutex_cond);
-	pthread_cond_destroy(&buff->buff_changed);
+	if(buff->locked) munlock(buff->mem, buff->size);
+	if(buff->mirrored) munmap(buff->mem, 2 * buff->size);
+	else if(buff->mem) free(buff->mem);
+	if(buff->wbounce) free(buff->wbounce);
+	if(buff->rbounce) free(buff->rbounce);
 	free(buff);
     }
 }
 
-static inline void signal_buffer_changed(pcm_buffer *buff) 
+/* Keep the ring resident; both views of a mirrored ring share the same pages */
+int pcm_buffer_mlock(pcm_buffer *buff)
+{
+    if(buff->locked) return 0;
+    if(mlock(buff->mem, buff->size) != 0) {
+	log_info("cannot lock %d bytes: %s", buff->size, strerror(errno));
+	return -1;
+    }
+    buff->locked = 1;
+    return 0;
+}
+
+/* Called by consumer */
+void pcm_buffer_get_stats(pcm_buffer *buff, struct buffer_stats *st)
 {
-    pthread_mutex_lock(&buff->mutex_cond);
-    pthread_cond_broadcast(&buff->buff_changed);
-    pthread_mutex_unlock(&buff->mutex_cond);
+    int depth = __atomic_load_n(&buff->ctl.depth, __ATOMIC_RELAXED);
+    st->fill_pct = ring_fill(buff, __atomic_load_n(&buff->head, __ATOMIC_ACQUIRE), buff->tail) * 100LL / depth;
+    st->depth = depth;
+    st->blocked_puts = __atomic_load_n(&buff->blocked_puts, __ATOMIC_RELAXED);
+    st->total_puts = __atomic_load_n(&buff->total_puts, __ATOMIC_RELAXED);
+    st->blocked_gets = buff->blocked_gets;
+    st->total_gets = buff->total_gets;
 }
 
-/* To be called with mutex locked */
 void pcm_buffer_stop(pcm_buffer *buff, int now)
 {
-    pthread_mutex_lock(&buff->mutex);
-    if(!buff->should_run) {
-	pthread_mutex_unlock(&buff->mutex);
-	return;
-    }		
+    if(!__atomic_load_n(&buff->should_run, __ATOMIC_ACQUIRE)) return;
     log_info("stopping, now=%d", now);	
-    buff->should_run = 0;
-    if(now) buff->abort = 1;
-    pthread_mutex_unlock(&buff->mutex);
-    signal_buffer_changed(buff);
-    usleep(15);	
-    signal_buffer_changed(buff);
+    if(now) __atomic_store_n(&buff->abort, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&buff->should_run, 0, __ATOMIC_SEQ_CST);
+    /* wake up both sides unconditionally */
+    __atomic_fetch_add(&buff->wseq, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&buff->rseq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&buff->wseq);
+    futex_wake(&buff->rseq);
     log_info("stopped run=%d abort=%d", buff->should_run, buff->abort);	
 }
 
+/* Producer side. Returns pointer to a contiguous window of the requested size 
+   to be filled and passed to pcm_buffer_commit_write(), or zero on stop or abort. */
+
+void *pcm_buffer_reserve_write(pcm_buffer *buff, int bytes)
+{
+    int seq, head, off, limit, bp = 0;
+
+    if(!buff || bytes <= 0 || bytes > buff->size || buffer_stopped(buff)) return 0;
+    buff->total_puts++;	
+    head = buff->head;
+    limit = (bytes > buff->ctl.depth) ? buff->size : buff->ctl.depth;
+    while(limit - ring_fill(buff, head, __atomic_load_n(&buff->tail, __ATOMIC_ACQUIRE)) < bytes) {
+	if(!bp++) buff->blocked_puts++;
+	seq = __atomic_load_n(&buff->wseq, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&buff->wwait, 1, __ATOMIC_SEQ_CST);
+	if(buffer_stopped(buff)) break;
+	if(limit - ring_fill(buff, head, __atomic_load_n(&buff->tail, __ATOMIC_SEQ_CST)) >= bytes) break;
+	futex_wait(&buff->wseq, seq);
+	if(buffer_stopped(buff)) break;
+    }
+    __atomic_store_n(&buff->wwait, 0, __ATOMIC_RELAXED);
+    if(buffer_stopped(buff)) return 0;
+
+    off = ring_off(buff, head);
+    if(off + bytes <= buff->size || buff->mirrored) buff->wptr = buff->mem + off;
+    else buff->wptr = grow_bounce(&buff->wbounce, &buff->wbounce_size, bytes);
+    return buff->wptr;	
+}
+
+/* Publishes bytes written to the window returned by pcm_buffer_reserve_write(). */
+
+int pcm_buffer_commit_write(pcm_buffer *buff, int bytes)
+{
+    int off, k;
+
+    if(!buff || !buff->wptr || bytes < 0 || bytes > buff->size) return -1;
+    off = ring_off(buff, buff->head);
+    if(buff->wptr != buff->mem + off) {
+	k = buff->size - off;
+	if(k > bytes) k = bytes;
+	memcpy(buff->mem + off, buff->wptr, k);
+	memcpy(buff->mem, buff->wptr + k, bytes - k);
+    }
+    buff->wptr = 0;
+    __atomic_store_n(&buff->head, ring_advance(buff, buff->head, bytes), __ATOMIC_SEQ_CST);
+    wake_side(&buff->rwait, &buff->rseq);
+    depth_ctl_commit(&buff->ctl, buff->ctl.bytes_per_sec ? bytes * 1000000ULL / buff->ctl.bytes_per_sec : 0,
+		ring_fill(buff, buff->head, __atomic_load_n(&buff->tail, __ATOMIC_ACQUIRE)), 
+		__atomic_load_n(&buff->blocked_gets, __ATOMIC_RELAXED));
+    return bytes;
+}
+
+/* Consumer side. On entry, *bytes is the number of bytes wanted. Blocks until they are 
+   available; after pcm_buffer_stop(buff,0) the remaining bytes may be less than requested.
+   Returns pointer to a contiguous window to be released with pcm_buffer_release_read(), 
+   or zero with *bytes set to zero on abort or if the stopped buffer is empty. */
+
+static void *peek_read(pcm_buffer *buff, int *bytes, int timeout_ms)
+{
+    int seq, tail, off, k, n = *bytes, bp = 0, timedout = 0;
+    struct timespec deadline;
+    void *p;
+
+    *bytes = 0;
+    if(!buff || n <= 0 || n > buff->size || __atomic_load_n(&buff->abort, __ATOMIC_ACQUIRE)) return 0;
+    if(timeout_ms >= 0) {
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if(deadline.tv_nsec >= 1000000000) {
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000000000;
+	}
+    }
+    buff->total_gets++;	
+    tail = buff->tail;
+    while((k = ring_fill(buff, __atomic_load_n(&buff->head, __ATOMIC_ACQUIRE), tail)) < n) {
+	if(!__atomic_load_n(&buff->should_run, __ATOMIC_ACQUIRE)) break;
+	if(timedout) break;
+	if(!bp++) __atomic_store_n(&buff->blocked_gets, buff->blocked_gets + 1, __ATOMIC_RELAXED);
+	seq = __atomic_load_n(&buff->rseq, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&buff->rwait, 1, __ATOMIC_SEQ_CST);
+	if(buffer_stopped(buff)) continue;
+	if(ring_fill(buff, __atomic_load_n(&buff->head, __ATOMIC_SEQ_CST), tail) >= n) continue;
+	if(timeout_ms < 0) futex_wait(&buff->rseq, seq);
+	else timedout = futex_wait_until(&buff->rseq, seq, &deadline);
+    }
+    __atomic_store_n(&buff->rwait, 0, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&buff->abort, __ATOMIC_ACQUIRE)) {
+	log_info("aborted");
+	return 0;
+    }
+    if(k > n) k = n;
+    if(k == 0) {
+	if(!__atomic_load_n(&buff->should_run, __ATOMIC_ACQUIRE)) return 0;	/* stopped and empty */
+	return buff->mem + ring_off(buff, tail);	/* timed out and empty */
+    }
+
+    off = ring_off(buff, tail);
+    if(off + k <= buff->size || buff->mirrored) p = buff->mem + off;
+    else {
+	p = grow_bounce(&buff->rbounce, &buff->rbounce_size, k);
+	if(!p) return 0;
+	memcpy(p, buff->mem + off, buff->size - off);
+	memcpy(p + buff->size - off, buff->mem, k - (buff->size - off));
+    }
+    *bytes = k;
+    return p;
+}
+
+void *pcm_buffer_peek_read(pcm_buffer *buff, int *bytes)
+{
+    return peek_read(buff, bytes, -1);
+}
+
+/* Same as above, but gives up waiting after timeout_ms, returning whatever is 
+   available at that time, possibly nothing */
+void *pcm_buffer_peek_read_timed(pcm_buffer *buff, int *bytes, int timeout_ms)
+{
+    return peek_read(buff, bytes, timeout_ms);
+}
+
+void pcm_buffer_release_read(pcm_buffer *buff, int bytes)
+{
+    __atomic_store_n(&buff->tail, ring_advance(buff, buff->tail, bytes), __ATOMIC_SEQ_CST);
+    wake_side(&buff->wwait, &buff->wseq);
+}
+
 /* Returns negative on error, zero on stop or abort, 
    otherwise the same nubmer of bytes as requested */
 
 int pcm_buffer_put(pcm_buffer *buff, void *src, int bytes) 
 {
-    int end_idx, k;
+    void *p;
 
-    if(!buff || bytes <= 0 || bytes > buff->size 
-	|| !buff->should_run || buff->abort) return -1;
+    if(!buff || bytes <= 0 || bytes > buff->size || buffer_stopped(buff)) return -1;
+    p = pcm_buffer_reserve_write(buff, bytes);
+    if(!p) return 0;
+    memcpy(p, src, bytes);
 
-    pthread_mutex_lock(&buff->mutex);
-#ifdef BUFF_FILL_TEST
-    buff->total_puts++;	
-    if(buff->size - buff->bytes <  bytes) buff->blocked_puts++;	
-#endif
-    while(buff->size - buff->bytes <  bytes && buff->should_run && !buff->abort) {
-	pthread_mutex_unlock(&buff->mutex);
-	pthread_mutex_lock(&buff->mutex_cond);
-	pthread_cond_signal(&buff->buff_changed);
-	pthread_cond_wait(&buff->buff_changed, &buff->mutex_cond);
-	pthread_mutex_unlock(&buff->mutex_cond);
-	pthread_mutex_lock(&buff->mutex);
-    }	
-    if(!buff->should_run || buff->abort) {
-    	pthread_mutex_unlock(&buff->mutex);	  
-	return 0;	
-    }
-    end_idx = buff->start_idx + buff->bytes;
-    if(end_idx >= buff->size) end_idx -= buff->size;
-    if(end_idx + bytes > buff->size) {
-	k = buff->size - end_idx;
-	memcpy(buff->mem + end_idx, src, k);
-	memcpy(buff->mem, src + k, bytes - k);
-    } else memcpy(buff->mem + end_idx, src, bytes);
-    buff->bytes += bytes;	    	
-
-    pthread_mutex_unlock(&buff->mutex);	  
-    signal_buffer_changed(buff);	
-     		
-    return bytes;  
+    return pcm_buffer_commit_write(buff, bytes);
 }
 
 /* Returns negative on error, zero on abort, 
@@ -136,71 +468,165 @@ int pcm_buffer_put(pcm_buffer *buff, void *src, int bytes)
 
 int pcm_buffer_get(pcm_buffer *buff, void *dst, int bytes)
 {
-    int k;     	
+    void *p;
+    int k = bytes;
 
     if(!buff || bytes <= 0 || bytes > buff->size || buff->abort) return -1;
-    
-    pthread_mutex_lock(&buff->mutex);
-#ifdef BUFF_FILL_TEST
-    buff->total_gets++;
-    if(bytes > buff->bytes) buff->blocked_gets++;	
-#endif
-    while(bytes > buff->bytes && buff->should_run && !buff->abort) {
-	pthread_mutex_unlock(&buff->mutex);
-	pthread_mutex_lock(&buff->mutex_cond);
-	pthread_cond_signal(&buff->buff_changed);
-	pthread_cond_wait(&buff->buff_changed, &buff->mutex_cond);
-	pthread_mutex_unlock(&buff->mutex_cond);
-	pthread_mutex_lock(&buff->mutex);
-    }	
-    if(buff->abort) {
-	log_info("aborted");
-    	pthread_mutex_unlock(&buff->mutex);	  
-	return 0;	
-    }
-    if(bytes > buff->bytes) bytes = buff->bytes; /* end of stream */
-#if 0
-    if(!buff->should_run) log_info("last bytes: %d", buff->bytes);	
-#endif
-    k = buff->size - buff->start_idx;
-    if(k < bytes) {
-	memcpy(dst, buff->mem + buff->start_idx, k);
-	memcpy(dst + k, buff->mem, bytes - k);
-	buff->start_idx = bytes - k;
-    } else {
-	memcpy(dst, buff->mem + buff->start_idx, bytes);
-	buff->start_idx += bytes;
-	if(buff->start_idx == buff->size) buff->start_idx = 0;
-    }	
-    buff->bytes -= bytes;	
-    pthread_mutex_unlock(&buff->mutex);	  
-    signal_buffer_changed(buff); 	
+    p = pcm_buffer_peek_read(buff, &k);
+    if(!p) return 0;
+    memcpy(dst, p, k);
+    pcm_buffer_release_read(buff, k);
 
-    return bytes;
+    return k;
 }
 
 
 /*************** Below assumes a single reader and a single writer! **********/
 	
 struct blk_buffer_t {
-    void **base;
-    int count;
-    int head, tail, elts;	/* elts = number of valid elements in buffer */
-    volatile int should_run;
-    volatile int abort;         /* terminate immediately */
-    pthread_mutex_t mutex;
-    pthread_mutex_t mutex_cond;
-    pthread_cond_t  buff_changed;
-    pthread_t output_thread;
-#ifdef BUFF_FILL_TEST
+    void *slab;			/* all blocks live in one aligned allocation */
+    size_t slab_size;
+    int slab_mapped;		/* slab comes from mmap() rather than posix_memalign() */
+    int slab_locked;
+    int stride;			/* block size rounded up to cache line */
+    int count;			/* blocks allocated */
+    unsigned char *flags;	/* per block BLK_FULL/BLK_WRAP, set by producer, cleared by consumer */
+    int head;			/* producer only */
+    int tail;			/* consumer only */
+    int elts;			/* number of valid elements in buffer */
+    struct depth_ctl ctl;	/* elts never exceed ctl.depth <= count; producer only */
+    int should_run;
+    int abort;			/* terminate immediately */
+    int wseq, rseq;		/* futex words, as in pcm_buffer */
+    int wwait, rwait;
     int total_puts, blocked_puts;
     int total_gets, blocked_gets;
-#endif
 };
 
+/* The producer wraps around as soon as it reaches the current depth and marks the 
+   block where it did so; the consumer follows these marks. Together with per-block 
+   ownership this lets depth change at any time without moving data. 
+   Like pcm_buffer, no locks are taken: a block is handed over by its BLK_FULL flag 
+   and elts, and a side that has to wait sleeps on a futex. */
+#define BLK_FULL	1
+#define BLK_WRAP	2
+
+#define BLK_ALIGN	64
+#define HUGE_PAGE_SIZE	(2*1024*1024)
+
+static inline void *blk_ptr(blk_buffer *buff, int idx)
+{
+    return buff->slab + (size_t) idx * buff->stride;
+}
+
+static void slab_free(blk_buffer *buff)
+{
+    if(!buff->slab) return;
+    if(buff->slab_locked) munlock(buff->slab, buff->slab_size);
+    buff->slab_locked = 0;
+    if(buff->slab_mapped) munmap(buff->slab, buff->slab_size);
+    else free(buff->slab);
+    buff->slab = 0;
+    buff->slab_size = 0;
+}
+
+/* Large slabs are mmapped, preferably from hugetlbfs, or else with a THP hint.
+   Pages are touched here so that playback never hits first-touch faults. */
+static int slab_alloc(blk_buffer *buff, size_t size)
+{
+    void *p = MAP_FAILED;
+
+    if(size >= HUGE_PAGE_SIZE) {
+	size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+	p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(p != MAP_FAILED) log_info("using hugetlb pages for %zd bytes", size);
+#endif
+	if(p == MAP_FAILED) {
+	    p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+	    if(p != MAP_FAILED) madvise(p, size, MADV_HUGEPAGE);
+#endif
+	}
+	if(p != MAP_FAILED) buff->slab_mapped = 1;
+    }
+    if(p == MAP_FAILED) {
+	if(posix_memalign(&p, BLK_ALIGN, size) != 0) return -1;
+	buff->slab_mapped = 0;
+    }
+    memset(p, 0, size);
+    buff->slab = p;
+    buff->slab_size = size;
+    return 0;
+}
+
+/* Prepare buffer for a new track: the slab is reallocated only if it must grow */
+int blk_buffer_reset(blk_buffer *buff, int buffsz, int count)
+{
+    int stride = (buffsz + BLK_ALIGN - 1) & ~(BLK_ALIGN - 1);
+    size_t size = (size_t) stride * count;
+    unsigned char *fl;
+
+    if(count > buff->count || !buff->flags) {
+	fl = realloc(buff->flags, count);
+	if(!fl) {
+	    log_err("no memory");
+	    return -1;
+	}
+	buff->flags = fl;
+    }
+
+    if(size > buff->slab_size) {
+	log_info("growing slab %zd -> %zd", buff->slab_size, size);
+	slab_free(buff);
+	if(slab_alloc(buff, size) != 0) {
+	    log_err("no memory for buffers");
+	    return -1;
+	}
+    }
+    buff->stride = stride;
+    buff->count = count;
+    memset(buff->flags, 0, count);
+    depth_ctl_init(&buff->ctl, count);
+    buff->head = buff->tail = 0;
+    __atomic_store_n(&buff->elts, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&buff->abort, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&buff->should_run, 1, __ATOMIC_SEQ_CST);
+    buff->total_puts = buff->blocked_puts = 0;
+    buff->total_gets = buff->blocked_gets = 0;
+    return 0;
+}
+
+/* Enables adaptive depth between min and max blocks, max is limited by the block count */
+void blk_buffer_set_depth(blk_buffer *buff, int min, int max, int usec_per_blk, const unsigned long long *dec_us)
+{
+    if(max > buff->count) max = buff->count;
+    if(min > max) min = max;
+    buff->ctl.min = buff->ctl.depth = min;
+    buff->ctl.max = max;
+    buff->ctl.usec_per_unit = usec_per_blk;
+    depth_ctl_set_source(&buff->ctl, dec_us);
+}
+
+/* Give back pages of idle blocks beyond current depth. Called by producer, which
+   does not touch these blocks; the ones still owned by consumer are skipped. */
+static void blk_buffer_trim(blk_buffer *buff)
+{
+    int i;
+    size_t pg = getpagesize();
+    uintptr_t start, end;
+
+    if(!buff->slab_mapped || buff->slab_locked) return;
+    for(i = buff->ctl.depth; i < buff->count; i++) {
+	if(__atomic_load_n(&buff->flags[i], __ATOMIC_ACQUIRE) & BLK_FULL) continue;
+	start = ((uintptr_t) blk_ptr(buff, i) + pg - 1) & ~(pg - 1);
+	end = ((uintptr_t) blk_ptr(buff, i) + buff->stride) & ~(pg - 1);
+	if(end > start) madvise((void *) start, end - start, MADV_DONTNEED);
+    }
+}
+
 blk_buffer *blk_buffer_create(int buffsz, int count) 
 {
-    int i, k;
     blk_buffer *buff;
 
     buff = (blk_buffer *) calloc(1, sizeof(blk_buffer));
@@ -208,158 +634,140 @@ blk_buffer *blk_buffer_create(int buffsz, int count)
 	log_err("no memory");
 	return 0;
     }		
-    buff->count = count;	
-    buff->base = malloc(count * sizeof(void *));
-    if(!buff->base) {
-	free(buff); 
-	log_err("no memory");
-	return 0;	
+    if(blk_buffer_reset(buff, buffsz, count) != 0) {
+	free(buff);
+	return 0;
     }
-    for(i = 0; i < count; i++) {
-	buff->base[i] = malloc(buffsz);
-	if(!buff->base[i]) {
-	    for(k = 0; k < i; k++) free(buff->base[k]);
-	    free(buff);	
-	    log_err("no memory for buffers");
-	    return 0;	
-	}
-    }	
-    pthread_mutex_init(&buff->mutex, 0);	
-    pthread_mutex_init(&buff->mutex_cond, 0);	
-    pthread_cond_init(&buff->buff_changed, 0);
-    buff->should_run = 1;
-
     return buff;
 }
 
 void blk_buffer_destroy(blk_buffer *buff)
 {
-    int i;
     if(buff) {
 #ifdef BUFF_FILL_TEST
 	log_info("blocked/total: writes=%d/%d reads=%d/%d", buff->blocked_puts, buff->total_puts, 
 	    buff->blocked_gets, buff->total_gets);
 #endif
-	for(i = 0; i < buff->count; i++) 
-		if(buff->base[i]) free(buff->base[i]);
-	if(buff->base) free(buff->base);
-	pthread_mutex_destroy(&buff->mutex);
-	pthread_mutex_destroy(&buff->mutex_cond);
-	pthread_cond_destroy(&buff->buff_changed);
+	slab_free(buff);
+	if(buff->flags) free(buff->flags);
 	free(buff);
     }
 }
 
-static inline void signal_blk_buffer_changed(blk_buffer *buff) 
+static inline int blk_stopped(blk_buffer *buff) 
 {
-    pthread_mutex_lock(&buff->mutex_cond);
-    pthread_cond_broadcast(&buff->buff_changed);
-    pthread_mutex_unlock(&buff->mutex_cond);
+    return __atomic_load_n(&buff->abort, __ATOMIC_ACQUIRE) || !__atomic_load_n(&buff->should_run, __ATOMIC_ACQUIRE);
 }
 
-/* To be called with mutex locked */
 void blk_buffer_stop(blk_buffer *buff, int now)
 {
-    pthread_mutex_lock(&buff->mutex);
-    if(!buff->should_run) {
-	pthread_mutex_unlock(&buff->mutex);
-	return;
-    }		
+    if(!__atomic_load_n(&buff->should_run, __ATOMIC_ACQUIRE)) return;
     log_info("stopping, now=%d", now);	
-    buff->should_run = 0;
-    if(now) buff->abort = 1;
-    pthread_mutex_unlock(&buff->mutex);
-    signal_blk_buffer_changed(buff);
-    usleep(15);	
-    signal_blk_buffer_changed(buff);
+    if(now) __atomic_store_n(&buff->abort, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&buff->should_run, 0, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&buff->wseq, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&buff->rseq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&buff->wseq);
+    futex_wake(&buff->rseq);
     log_info("stopped run=%d abort=%d", buff->should_run, buff->abort);	
 }
 
+static inline int blk_can_put(blk_buffer *buff)
+{
+    return !(__atomic_load_n(&buff->flags[buff->head], __ATOMIC_ACQUIRE) & BLK_FULL) 
+	&& __atomic_load_n(&buff->elts, __ATOMIC_ACQUIRE) < buff->ctl.depth;
+}
+
 void *blk_buffer_request_decoding(blk_buffer *buff) 
 {
-    int bp = 0;
-    if(!buff) return 0;	
-#ifdef BUFF_FILL_TEST
-    buff->total_puts++;	
-#endif
-    pthread_mutex_lock(&buff->mutex);
-    while(buff->elts == buff->count && buff->should_run && !buff->abort) {
-#ifdef BUFF_FILL_TEST
-	if(!bp) { 
-	     buff->blocked_puts++;
-	     bp++;
-	} 		
-#endif
-	pthread_mutex_unlock(&buff->mutex);
-	pthread_mutex_lock(&buff->mutex_cond);
-	pthread_cond_signal(&buff->buff_changed); 
-	pthread_cond_wait(&buff->buff_changed, &buff->mutex_cond);
-	pthread_mutex_unlock(&buff->mutex_cond);
-	pthread_mutex_lock(&buff->mutex);
-    }
-    if(!buff->should_run || buff->abort) {
-	pthread_mutex_unlock(&buff->mutex);	  
-	return 0;	
+    int seq, bp = 0;
+    if(!buff || blk_stopped(buff)) return 0;	
+    __atomic_store_n(&buff->total_puts, buff->total_puts + 1, __ATOMIC_RELAXED);
+    while(!blk_can_put(buff)) {
+	if(!bp++) __atomic_store_n(&buff->blocked_puts, buff->blocked_puts + 1, __ATOMIC_RELAXED);
+	seq = __atomic_load_n(&buff->wseq, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&buff->wwait, 1, __ATOMIC_SEQ_CST);
+	if(blk_stopped(buff) || blk_can_put(buff)) break;
+	futex_wait(&buff->wseq, seq);
+	if(blk_stopped(buff)) break;
     }
-    pthread_mutex_unlock(&buff->mutex);	  
-    return buff->base[buff->head];
+    __atomic_store_n(&buff->wwait, 0, __ATOMIC_RELAXED);
+    if(blk_stopped(buff)) return 0;
+    return blk_ptr(buff, buff->head);
 }
 
 void blk_buffer_commit_decoding(blk_buffer *buff)
 {
-    pthread_mutex_lock(&buff->mutex);
-    buff->head++;
-    if(buff->head == buff->count) buff->head = 0;	
-    buff->elts++;
-    pthread_mutex_unlock(&buff->mutex);	  
-    signal_blk_buffer_changed(buff);
+    int depth = buff->ctl.depth, idx = buff->head;
+
+    if(buff->head + 1 >= depth) {
+	buff->head = 0;
+	__atomic_store_n(&buff->flags[idx], BLK_FULL | BLK_WRAP, __ATOMIC_RELEASE);
+    } else {
+	buff->head++;
+	__atomic_store_n(&buff->flags[idx], BLK_FULL, __ATOMIC_RELEASE);
+    }
+    __atomic_fetch_add(&buff->elts, 1, __ATOMIC_SEQ_CST);
+    wake_side(&buff->rwait, &buff->rseq);
+    if(depth_ctl_commit(&buff->ctl, buff->ctl.usec_per_unit, __atomic_load_n(&buff->elts, __ATOMIC_RELAXED), 
+	__atomic_load_n(&buff->blocked_gets, __ATOMIC_RELAXED)) && buff->ctl.depth < depth) blk_buffer_trim(buff);
 }
 
 void *blk_buffer_request_playback(blk_buffer *buff)
 {
-    int bp = 0;
+    int seq, bp = 0;
     if(!buff) return 0;	
-#ifdef BUFF_FILL_TEST
-    buff->total_gets++;	
-#endif
-    pthread_mutex_lock(&buff->mutex);
-    while(!buff->elts && buff->should_run && !buff->abort) {
-#ifdef BUFF_FILL_TEST
-	if(!bp) { 
-	     buff->blocked_gets++;
-	     bp++;
-	} 		
-#endif
-	pthread_mutex_unlock(&buff->mutex);
-	pthread_mutex_lock(&buff->mutex_cond);
-	pthread_cond_signal(&buff->buff_changed); 
-	pthread_cond_wait(&buff->buff_changed, &buff->mutex_cond);
-	pthread_mutex_unlock(&buff->mutex_cond);
-	pthread_mutex_lock(&buff->mutex);
-    }
-    if(buff->abort) {
-	pthread_mutex_unlock(&buff->mutex);	  
-	return 0;	
+    __atomic_store_n(&buff->total_gets, buff->total_gets + 1, __ATOMIC_RELAXED);
+    while(!__atomic_load_n(&buff->elts, __ATOMIC_ACQUIRE)) {
+	if(blk_stopped(buff)) break;
+	if(!bp++) __atomic_store_n(&buff->blocked_gets, buff->blocked_gets + 1, __ATOMIC_RELAXED);
+	seq = __atomic_load_n(&buff->rseq, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&buff->rwait, 1, __ATOMIC_SEQ_CST);
+	if(blk_stopped(buff) || __atomic_load_n(&buff->elts, __ATOMIC_SEQ_CST)) continue;
+	futex_wait(&buff->rseq, seq);
     }
-    if(!buff->should_run) {
-	if(!buff->elts) {
+    __atomic_store_n(&buff->rwait, 0, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&buff->abort, __ATOMIC_ACQUIRE)) return 0;
+    if(!__atomic_load_n(&buff->should_run, __ATOMIC_ACQUIRE)) {
+	if(!__atomic_load_n(&buff->elts, __ATOMIC_ACQUIRE)) {
 	    log_info("no more buffers, exiting");
-	    pthread_mutex_unlock(&buff->mutex);	  
 	    return 0;
 	} else log_info("last buffers %d", buff->elts);	
     }
-    pthread_mutex_unlock(&buff->mutex);	  
-    return buff->base[buff->tail];
+    return blk_ptr(buff, buff->tail);
 }
 
 void blk_buffer_commit_playback(blk_buffer *buff)
 {
-    pthread_mutex_lock(&buff->mutex);
-    buff->tail++;
-    if(buff->tail == buff->count) buff->tail = 0;	
-    buff->elts--;
-    pthread_mutex_unlock(&buff->mutex);	  
-    signal_blk_buffer_changed(buff);
+    int idx = buff->tail;
+
+    if(__atomic_load_n(&buff->flags[idx], __ATOMIC_RELAXED) & BLK_WRAP) buff->tail = 0;
+    else buff->tail++;
+    __atomic_store_n(&buff->flags[idx], 0, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&buff->elts, 1, __ATOMIC_SEQ_CST);
+    wake_side(&buff->wwait, &buff->wseq);
+}
+
+/* Called by consumer */
+void blk_buffer_get_stats(blk_buffer *buff, struct buffer_stats *st)
+{
+    int depth = __atomic_load_n(&buff->ctl.depth, __ATOMIC_RELAXED);
+    st->fill_pct = __atomic_load_n(&buff->elts, __ATOMIC_ACQUIRE) * 100 / depth;
+    st->depth = depth;
+    st->blocked_puts = __atomic_load_n(&buff->blocked_puts, __ATOMIC_RELAXED);
+    st->total_puts = __atomic_load_n(&buff->total_puts, __ATOMIC_RELAXED);
+    st->blocked_gets = buff->blocked_gets;
+    st->total_gets = buff->total_gets;
 }
 
+int blk_buffer_mlock(blk_buffer *buff)
+{
+    if(buff->slab_locked) return 0;
+    if(mlock(buff->slab, buff->slab_size) != 0) {
+	log_info("cannot lock %d bytes: %s", (int) buff->slab_size, strerror(errno));
+	return -1;
+    }
+    buff->slab_locked = 1;
+    return 0;
+}
 
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <sys/time.h>
+#ifdef ANDROID
+#include <android/log.h>
+#endif
+#include <jni_sub.h>
+#define __force
+#define __bitwise
+#define __user
+#include <sound/asound.h>
+#include "main.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define CONV_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONV_NEON
+#endif
+
+/*  Output stage of the decoders: takes planar samples, undoes stereo decorrelation,
+    interleaves and converts to the device format in a single pass, writing straight
+    into the output buffer. Every rate_dec step takes each stride-th sample.
+    Stereo is specialized for each decorrelation mode and format, and vectorized
+    for stride 1 with SSE2 or NEON. */
+
+#define ALWAYS_INLINE	inline __attribute__((always_inline))
+
+static ALWAYS_INLINE void decorrelate(int mode, int32_t *l, int32_t *r)
+{
+    int32_t a = *l, b = *r;
+	switch(mode) {
+	    case DECORR_LEFT_SIDE:
+		*r = a - b;
+		break;
+	    case DECORR_RIGHT_SIDE:
+		*l = a + b;
+		break;
+	    case DECORR_MID_SIDE:
+		a -= b >> 1;
+		*l = a + b;
+		*r = a;
+		break;
+	}
+}
+
+static ALWAYS_INLINE void stereo_c(int mode, int fmt, const int32_t *l, const int32_t *r, int frames, int stride, void *out)
+{
+    int32_t a, b, *d32 = (int32_t *) out;
+    int16_t *d16 = (int16_t *) out;
+    uint8_t *d8 = (uint8_t *) out;
+    int k;
+	for(k = 0; k < frames; k++, l += stride, r += stride) {
+	    a = *l;
+	    b = *r;
+	    decorrelate(mode, &a, &b);
+	    switch(fmt) {
+		case SNDRV_PCM_FORMAT_S32_LE:
+		    *d32++ = a;
+		    *d32++ = b;
+		    break;
+		case SNDRV_PCM_FORMAT_S16_LE:
+		    *d16++ = (int16_t) a;
+		    *d16++ = (int16_t) b;
+		    break;
+		case SNDRV_PCM_FORMAT_S24_3LE:
+		    d8[0] = (uint8_t) a;
+		    d8[1] = (uint8_t) (a >> 8);
+		    d8[2] = (uint8_t) (a >> 16);
+		    d8[3] = (uint8_t) b;
+		    d8[4] = (uint8_t) (b >> 8);
+		    d8[5] = (uint8_t) (b >> 16);
+		    d8 += 6;
+		    break;
+	    }
+	}
+}
+
+/* Returns the number of frames done, the rest is left to stereo_c() */
+static ALWAYS_INLINE int stereo_simd(int mode, int fmt, const int32_t *l, const int32_t *r, int frames, void *out)
+{
+    int k = 0;
+#if defined(CONV_SSE2)
+    __m128i a, b, t, lo, hi;
+	if(fmt == SNDRV_PCM_FORMAT_S24_3LE) return 0;
+	for(; k + 4 <= frames; k += 4) {
+	    a = _mm_loadu_si128((const __m128i *) (l + k));
+	    b = _mm_loadu_si128((const __m128i *) (r + k));
+	    switch(mode) {
+		case DECORR_LEFT_SIDE:
+		    b = _mm_sub_epi32(a, b);
+		    break;
+		case DECORR_RIGHT_SIDE:
+		    a = _mm_add_epi32(a, b);
+		    break;
+		case DECORR_MID_SIDE:
+		    t = _mm_sub_epi32(a, _mm_srai_epi32(b, 1));
+		    a = _mm_add_epi32(t, b);
+		    b = t;
+		    break;
+	    }
+	    lo = _mm_unpacklo_epi32(a, b);
+	    hi = _mm_unpackhi_epi32(a, b);
+	    if(fmt == SNDRV_PCM_FORMAT_S32_LE) {
+		_mm_storeu_si128((__m128i *) ((int32_t *) out + 2 * k), lo);
+		_mm_storeu_si128((__m128i *) ((int32_t *) out + 2 * k + 4), hi);
+	    } else {
+		/* truncate like the scalar (int16_t) cast, packs would saturate */
+		lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+		hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+		_mm_storeu_si128((__m128i *) ((int16_t *) out + 2 * k), _mm_packs_epi32(lo, hi));
+	    }
+	}
+#elif defined(CONV_NEON)
+    int32x4_t a, b, t;
+	if(fmt == SNDRV_PCM_FORMAT_S24_3LE) return 0;
+	for(; k + 4 <= frames; k += 4) {
+	    a = vld1q_s32(l + k);
+	    b = vld1q_s32(r + k);
+	    switch(mode) {
+		case DECORR_LEFT_SIDE:
+		    b = vsubq_s32(a, b);
+		    break;
+		case DECORR_RIGHT_SIDE:
+		    a = vaddq_s32(a, b);
+		    break;
+		case DECORR_MID_SIDE:
+		    t = vsubq_s32(a, vshrq_n_s32(b, 1));
+		    a = vaddq_s32(t, b);
+		    b = t;
+		    break;
+	    }
+	    if(fmt == SNDRV_PCM_FORMAT_S32_LE) {
+		int32x4x2_t v = { { a, b } };
+		vst2q_s32((int32_t *) out + 2 * k, v);
+	    } else {
+		int16x4x2_t v = { { vmovn_s32(a), vmovn_s32(b) } };
+		vst2_s16((int16_t *) out + 2 * k, v);
+	    }
+	}
+#endif
+    return k;
+}
+
+static ALWAYS_INLINE void stereo(int mode, int fmt, int32_t **planes, int frames, int stride, void *out)
+{
+    int k = 0, fbytes = (fmt == SNDRV_PCM_FORMAT_S16_LE) ? 4 : (fmt == SNDRV_PCM_FORMAT_S24_3LE) ? 6 : 8;
+	if(stride == 1) k = stereo_simd(mode, fmt, planes[0], planes[1], frames, out);
+	stereo_c(mode, fmt, planes[0] + k * stride, planes[1] + k * stride, frames - k, stride, out + k * fbytes);
+}
+
+#define STEREO_FMT(mode) \
+	switch(fmt) { \
+	    case SNDRV_PCM_FORMAT_S32_LE: stereo(mode, SNDRV_PCM_FORMAT_S32_LE, planes, frames, stride, out); break; \
+	    case SNDRV_PCM_FORMAT_S16_LE: stereo(mode, SNDRV_PCM_FORMAT_S16_LE, planes, frames, stride, out); break; \
+	    case SNDRV_PCM_FORMAT_S24_3LE: stereo(mode, SNDRV_PCM_FORMAT_S24_3LE, planes, frames, stride, out); break; \
+	}
+
+static void convert_stereo(int fmt, int32_t **planes, int frames, int stride, int decorr, void *out)
+{
+	switch(decorr) {
+	    case DECORR_LEFT_SIDE: STEREO_FMT(DECORR_LEFT_SIDE) break;
+	    case DECORR_RIGHT_SIDE: STEREO_FMT(DECORR_RIGHT_SIDE) break;
+	    case DECORR_MID_SIDE: STEREO_FMT(DECORR_MID_SIDE) break;
+	    default: STEREO_FMT(DECORR_NONE) break;
+	}
+}
+
+/* Any other number of channels, no decorrelation */
+static void convert_planes(int fmt, int32_t **planes, int channels, int frames, int stride, void *out)
+{
+    int i, k;
+    int32_t *src, *dst;
+    int16_t *dst16;
+    uint8_t *dst8;
+
+	switch(fmt) {
+	    case SNDRV_PCM_FORMAT_S32_LE:
+		for(i = 0; i < channels; i++) {
+		    src = planes[i];
+		    dst = (int32_t *) out + i;
+		    for(k = 0; k < frames; k++) {
+			*dst = *src;
+			dst += channels;
+			src += stride;
+		    }
+		}
+		break;
+	    case SNDRV_PCM_FORMAT_S24_3LE:
+		for(i = 0; i < channels; i++) {
+		    src = planes[i];
+		    dst8 = (uint8_t *) out + i * 3;
+		    for(k = 0; k < frames; k++) {
+			uint32_t y = (uint32_t) *src;
+			dst8[0] = (uint8_t) y;
+			dst8[1] = (uint8_t) (y >> 8);
+			dst8[2] = (uint8_t) (y >> 16);
+			dst8 += channels * 3;
+			src += stride;
+		    }
+		}
+		break;
+	    case SNDRV_PCM_FORMAT_S16_LE:
+		for(i = 0; i < channels; i++) {
+		    src = planes[i];
+		    dst16 = (int16_t *) out + i;
+		    for(k = 0; k < frames; k++) {
+			*dst16 = (int16_t) *src;
+			dst16 += channels;
+			src += stride;
+		    }
+		}
+		break;
+	}
+}
+
+/* Downmix of 3 or more channels to stereo: out = sum of coef[out][ch] * in[ch], done in
+   float and rounded to nearest. Defaults are for the flac channel orders, and can only
+   be changed before playback: each stream folds with its own copy in ctx->dmx. */
+
+#define DMX_CHUNK	256	/* frames, stereo result stays in L1 */
+
+static float dmx_coefs[PIPE_MAX_CHANNELS + 1][2][PIPE_MAX_CHANNELS] = {
+    [3] = {	/* FL FR FC */
+	{ 0.625f, 0, 0.3125f },
+	{ 0, 0.625f, 0.3125f } },
+    [4] = {	/* FL FR RL RR */
+	{ 0.5f, 0, 0.5f, 0 },
+	{ 0, 0.5f, 0, 0.5f } },
+    [5] = {	/* FL FR FC RL RR */
+	{ 0.375f, 0, 0.1875f, 0.375f, 0 },
+	{ 0, 0.375f, 0.1875f, 0, 0.375f } },
+    [6] = {	/* FL FR FC LFE RL RR */
+	{ 0.3125f, 0, 0.15625f, 0.15625f, 0.3125f, 0 },
+	{ 0, 0.3125f, 0.15625f, 0.15625f, 0, 0.3125f } },
+};
+
+/* Copies the matrix for this number of channels to m, returns zero if there is none */
+int downmix_matrix(int channels, float (*m)[PIPE_MAX_CHANNELS])
+{
+    int c;
+	if(channels < 3 || channels > PIPE_MAX_CHANNELS) return 0;
+	for(c = 0; c < channels; c++)
+	    if(dmx_coefs[channels][0][c] != 0 || dmx_coefs[channels][1][c] != 0) break;
+	if(c == channels) return 0;
+	memcpy(m, dmx_coefs[channels], sizeof(dmx_coefs[channels]));
+    return 1;
+}
+
+/* Sets the matrix from "channels:l0,l1,...,r0,r1,...". Returns -1 if malformed. */
+int downmix_set(const char *spec)
+{
+    float m[2][PIPE_MAX_CHANNELS];
+    char *end;
+    int i, n = strtol(spec, &end, 10);
+	if(*end != ':' || n < 3 || n > PIPE_MAX_CHANNELS) return -1;
+	for(i = 0; i < 2 * n; i++) {
+	    m[i / n][i % n] = strtof(end + 1, &end);
+	    if(*end != (i == 2 * n - 1 ? 0 : ',')) return -1;
+	}
+	memcpy(dmx_coefs[n], m, sizeof(m));
+    return 0;
+}
+
+static void downmix_c(const float (*m)[PIPE_MAX_CHANNELS], int32_t **planes, int channels, int from, int frames, int stride, int32_t *l, int32_t *r)
+{
+    float a, b, x;
+    int c, k;
+	for(k = 0; k < frames; k++) {
+	    a = b = 0;
+	    for(c = 0; c < channels; c++) {
+		x = (float) planes[c][(from + k) * stride];
+		a += m[0][c] * x;
+		b += m[1][c] * x;
+	    }
+	    l[k] = (int32_t) lrintf(a);
+	    r[k] = (int32_t) lrintf(b);
+	}
+}
+
+/* Returns the number of frames done, the rest is left to downmix_c() */
+static int downmix_simd(const float (*m)[PIPE_MAX_CHANNELS], int32_t **planes, int channels, int from, int frames, int32_t *l, int32_t *r)
+{
+    int k = 0;
+#if defined(CONV_SSE2)
+    __m128 a, b, x;
+    int c;
+	for(; k + 4 <= frames; k += 4) {
+	    a = b = _mm_setzero_ps();
+	    for(c = 0; c < channels; c++) {
+		x = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (planes[c] + from + k)));
+		a = _mm_add_ps(a, _mm_mul_ps(_mm_set1_ps(m[0][c]), x));
+		b = _mm_add_ps(b, _mm_mul_ps(_mm_set1_ps(m[1][c]), x));
+	    }
+	    _mm_storeu_si128((__m128i *) (l + k), _mm_cvtps_epi32(a));
+	    _mm_storeu_si128((__m128i *) (r + k), _mm_cvtps_epi32(b));
+	}
+#elif defined(CONV_NEON) && defined(__aarch64__)
+    float32x4_t a, b, x;
+    int c;
+	for(; k + 4 <= frames; k += 4) {
+	    a = b = vdupq_n_f32(0);
+	    for(c = 0; c < channels; c++) {
+		x = vcvtq_f32_s32(vld1q_s32(planes[c] + from + k));
+		a = vaddq_f32(a, vmulq_n_f32(x, m[0][c]));
+		b = vaddq_f32(b, vmulq_n_f32(x, m[1][c]));
+	    }
+	    vst1q_s32(l + k, vcvtnq_s32_f32(a));
+	    vst1q_s32(r + k, vcvtnq_s32_f32(b));
+	}
+#endif
+    return k;
+}
+
+/* Folds the channels to stereo a chunk at a time and converts the result */
+static void convert_downmix(int fmt, const float (*m)[PIPE_MAX_CHANNELS], int32_t **planes, int channels, int frames, int stride, void *out)
+{
+    int32_t l[DMX_CHUNK], r[DMX_CHUNK], *lr[2] = { l, r };
+    int k, n, d, fbytes = (fmt == SNDRV_PCM_FORMAT_S16_LE) ? 4 : (fmt == SNDRV_PCM_FORMAT_S24_3LE) ? 6 : 8;
+	for(k = 0; k < frames; k += n) {
+	    n = (frames - k < DMX_CHUNK) ? frames - k : DMX_CHUNK;
+	    d = (stride == 1) ? downmix_simd(m, planes, channels, k, n, l, r) : 0;
+	    downmix_c(m, planes, channels, k + d, n - d, stride, l + d, r + d);
+	    convert_stereo(fmt, lr, n, 1, DECORR_NONE, out + k * fbytes);
+	}
+}
+
+/* Writes frames of the planar samples to out in the device format, folding them to
+   stereo with the matrix dmx if out_channels is less than channels. Stereo decorrelation is one of DECORR_*,
+   ignored unless there are two channels. Returns -1 if the format is not supported. */
+int pcm_convert(const playback_format_t *format, int32_t **planes, int channels, int out_channels, int frames, int stride, int decorr, const float (*dmx)[PIPE_MAX_CHANNELS], void *out)
+{
+    int fmt = format->fmt;
+	switch(fmt) {
+	    case SNDRV_PCM_FORMAT_S24_LE:	/* same layout */
+		fmt = SNDRV_PCM_FORMAT_S32_LE;
+		/* fall through */
+	    case SNDRV_PCM_FORMAT_S32_LE:
+	    case SNDRV_PCM_FORMAT_S24_3LE:
+	    case SNDRV_PCM_FORMAT_S16_LE:
+		break;
+	    default:
+		return -1;
+	}
+	if(out_channels < channels) {
+	    if(out_channels != 2 || channels > PIPE_MAX_CHANNELS) return -1;
+	    convert_downmix(fmt, dmx, planes, channels, frames, stride, out);
+	} else if(channels == 2) convert_stereo(fmt, planes, frames, stride, decorr, out);
+	else convert_planes(fmt, planes, channels, frames, stride, out);
+    return 0;
+}
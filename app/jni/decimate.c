@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <sys/time.h>
+#ifdef ANDROID
+#include <android/log.h>
+#endif
+#include <jni_sub.h>
+#define __force
+#define __bitwise
+#define __user
+#include <sound/asound.h>
+#include "main.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DEC_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DEC_NEON
+#endif
+
+/*  Rate conversion for files played at 1/2 or 1/4 of their rate (rate_dec). Each halving
+    is a half-band FIR: every other tap is zero and the center one is 0.5, so an output
+    costs k symmetric tap pairs. A stage that still outputs 88.2 kHz or more only has to
+    keep aliases out of the audio band and gets a short filter, one down to 44.1/48 kHz a
+    steep one. Runs in float on each plane in place, a chunk at a time, with the taps
+    vectorized over 8 outputs with SSE2 or NEON. Output t of a stage is centered on its
+    input 2t, with zeros before the start; decimator_flush() feeds zeros past the end,
+    so a track keeps its length and the next one starts on time in gapless mode.
+    The first pass thus gives fewer outputs than the later ones, and blocks would come
+    out short at the start. Outputs are held back instead and handed out a period at
+    a time, so only the last one at the end of stream may be shorter. */
+
+#define DEC_CHUNK	1024	/* input frames per pass */
+#define DEC_MAX_STAGES	2
+
+/* Side taps for x[c - (2k+1)] and x[c + (2k+1)], Kaiser windowed sinc.
+   Short: 31 taps, beta 13, flat to 0.113 fs, -120 dB from 0.387 fs.
+   Long: 159 taps, beta 11, flat to 0.227 fs, -109 dB from 0.273 fs. */
+#define HB_SHORT_K	8
+#define HB_LONG_K	40
+
+static const float hb_short[HB_SHORT_K] = {
+    3.095879087e-01f, -8.244917493e-02f, 3.119282332e-02f, -1.077822915e-02f,
+    2.944739335e-03f, -5.495802199e-04f, 5.194208969e-05f, -4.291818360e-07f,
+};
+
+static const float hb_long[HB_LONG_K] = {
+    3.180426299e-01f, -1.053037420e-01f, 6.233746747e-02f, -4.363538937e-02f,
+    3.303387512e-02f, -2.612762877e-02f, 2.122451359e-02f, -1.753646869e-02f,
+    1.464739267e-02f, -1.231708074e-02f, 1.039718836e-02f, -8.791039757e-03f,
+    7.432735429e-03f, -6.275558158e-03f, 5.285193924e-03f, -4.435597418e-03f,
+    3.706383296e-03f, -3.081134932e-03f, 2.546284552e-03f, -2.090359810e-03f,
+    1.703471092e-03f, -1.376959927e-03f, 1.103156670e-03f, -8.752127901e-04f,
+    6.869841595e-04f, -5.329488966e-04f, 4.081482477e-04f, -3.081423387e-04f,
+    2.289750452e-04f, -1.671439650e-04f, 1.195727740e-04f, -8.358420317e-05f,
+    5.687260629e-05f, -3.747562575e-05f, 2.374486369e-05f, -1.431574835e-05f,
+    8.076973254e-06f, -4.139997580e-06f, 1.809143423e-06f, -5.528223992e-07f,
+};
+
+struct dec_stage {
+    const float *h;
+    int k;		/* tap pairs */
+    int hist;		/* input samples kept between passes, 4k - 2 */
+    int phase;		/* offset of the first filter window in x, 2k - 1 to start on input 0 */
+    float *x[PIPE_MAX_CHANNELS];	/* hist old samples, then up to DEC_CHUNK new ones */
+};
+
+struct decimator_t {
+    int channels, nstages;
+    float lo, hi;	/* output range */
+    struct dec_stage st[DEC_MAX_STAGES];
+    float *mem;
+    int period;		/* outputs handed out at a time */
+    int held;		/* outputs waiting in out[] */
+    int flushed;
+    int32_t *out[PIPE_MAX_CHANNELS];	/* room for two periods and the flush */
+};
+
+/* Taps split into even e[] (the pairs) and odd o[] (the centers) samples of x:
+   y[i] = 0.5 * o[i] + sum of h[j] * (e[i + k - 1 - j] + e[i + k + j]) */
+static void halfband_c(const float *h, int k, const float *e, const float *o, int from, int n, float *y)
+{
+    float a;
+    int i, j;
+	for(i = from; i < n; i++) {
+	    a = 0.5f * o[i];
+	    for(j = 0; j < k; j++) a += h[j] * (e[i + k - 1 - j] + e[i + k + j]);
+	    y[i] = a;
+	}
+}
+
+/* Returns the number of outputs done, the rest is left to halfband_c().
+   Two accumulators of 4 outputs each share the tap loads. */
+static int halfband_simd(const float *h, int k, const float *e, const float *o, int n, float *y)
+{
+    int i = 0;
+#if defined(DEC_SSE2)
+    __m128 a, b, c;
+    int j;
+	for(; i + 8 <= n; i += 8) {
+	    a = _mm_mul_ps(_mm_set1_ps(0.5f), _mm_loadu_ps(o + i));
+	    b = _mm_mul_ps(_mm_set1_ps(0.5f), _mm_loadu_ps(o + i + 4));
+	    for(j = 0; j < k; j++) {
+		c = _mm_set1_ps(h[j]);
+		a = _mm_add_ps(a, _mm_mul_ps(c, _mm_add_ps(_mm_loadu_ps(e + i + k - 1 - j), _mm_loadu_ps(e + i + k + j))));
+		b = _mm_add_ps(b, _mm_mul_ps(c, _mm_add_ps(_mm_loadu_ps(e + i + k + 3 - j), _mm_loadu_ps(e + i + k + 4 + j))));
+	    }
+	    _mm_storeu_ps(y + i, a);
+	    _mm_storeu_ps(y + i + 4, b);
+	}
+#elif defined(DEC_NEON)
+    float32x4_t a, b;
+    int j;
+	for(; i + 8 <= n; i += 8) {
+	    a = vmulq_n_f32(vld1q_f32(o + i), 0.5f);
+	    b = vmulq_n_f32(vld1q_f32(o + i + 4), 0.5f);
+	    for(j = 0; j < k; j++) {
+		a = vmlaq_n_f32(a, vaddq_f32(vld1q_f32(e + i + k - 1 - j), vld1q_f32(e + i + k + j)), h[j]);
+		b = vmlaq_n_f32(b, vaddq_f32(vld1q_f32(e + i + k + 3 - j), vld1q_f32(e + i + k + 4 + j)), h[j]);
+	    }
+	    vst1q_f32(y + i, a);
+	    vst1q_f32(y + i + 4, b);
+	}
+#endif
+    return i;
+}
+
+/* Filters the n new samples of channel c, writes the outputs to y and returns their number */
+static int stage_run(struct dec_stage *s, int c, int n, float *y)
+{
+    float e[DEC_CHUNK / 2 + 2 * HB_LONG_K], o[DEC_CHUNK / 2 + 1];
+    const float *x = s->x[c] + s->phase;
+    int i, m = (n > s->phase) ? (n - s->phase + 1) / 2 : 0;
+	for(i = 0; i < m + 2 * s->k - 1; i++) e[i] = x[2 * i];
+	for(i = 0; i < m; i++) o[i] = x[2 * i + 2 * s->k - 1];
+	i = halfband_simd(s->h, s->k, e, o, m, y);
+	halfband_c(s->h, s->k, e, o, i, m, y);
+	memmove(s->x[c], s->x[c] + n, s->hist * sizeof(float));
+    return m;
+}
+
+/* Rounds and clips to the range of the file */
+static void store(decimator *d, const float *y, int n, int32_t *out)
+{
+    int i = 0;
+#if defined(DEC_SSE2)
+    __m128 lo = _mm_set1_ps(d->lo), hi = _mm_set1_ps(d->hi);
+	for(; i + 4 <= n; i += 4)
+	    _mm_storeu_si128((__m128i *) (out + i), _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(y + i), lo), hi)));
+#elif defined(DEC_NEON) && defined(__aarch64__)
+    float32x4_t lo = vdupq_n_f32(d->lo), hi = vdupq_n_f32(d->hi);
+	for(; i + 4 <= n; i += 4)
+	    vst1q_s32(out + i, vcvtnq_s32_f32(vminq_f32(vmaxq_f32(vld1q_f32(y + i), lo), hi)));
+#endif
+	for(; i < n; i++) out[i] = (int32_t) lrintf(y[i] < d->lo ? d->lo : (y[i] > d->hi ? d->hi : y[i]));
+}
+
+/* Input to decimate() comes at most period << rate_dec frames at a time.
+   Returns zero if rate_dec is not 1 or 2 or there's no memory */
+decimator *decimator_init(int channels, int rate_dec, int rate, int bps, int period)
+{
+    decimator *d;
+    struct dec_stage *s;
+    int i, c, size = 0;
+    float *p;
+
+	if(rate_dec < 1 || rate_dec > DEC_MAX_STAGES || channels > PIPE_MAX_CHANNELS) return 0;
+	d = (decimator *) calloc(1, sizeof(decimator));
+	if(!d) return 0;
+	d->channels = channels;
+	d->nstages = rate_dec;
+	d->hi = (float) ((1 << (bps - 1)) - 1);
+	d->lo = -d->hi - 1;
+	for(i = 0; i < d->nstages; i++) {
+	    s = &d->st[i];
+	    rate >>= 1;
+	    if(rate >= 88200) {
+		s->h = hb_short;
+		s->k = HB_SHORT_K;
+	    } else {
+		s->h = hb_long;
+		s->k = HB_LONG_K;
+	    }
+	    s->hist = 4 * s->k - 2;
+	    s->phase = 2 * s->k - 1;
+	    size += channels * (s->hist + DEC_CHUNK);
+	}
+	d->period = period;
+	size += channels * (2 * period + DEC_MAX_STAGES * HB_LONG_K);	/* int32_t, same size */
+	d->mem = (float *) calloc(size, sizeof(float));
+	if(!d->mem) {
+	    free(d);
+	    return 0;
+	}
+	for(i = 0, p = d->mem; i < d->nstages; i++) {
+	    s = &d->st[i];
+	    for(c = 0; c < channels; c++, p += s->hist + DEC_CHUNK) s->x[c] = p;
+	}
+	for(c = 0; c < channels; c++, p += 2 * period + DEC_MAX_STAGES * HB_LONG_K) d->out[c] = (int32_t *) p;
+	log_info("downsampling by %d", 1 << rate_dec);
+    return d;
+}
+
+void decimator_free(decimator *d)
+{
+	free(d->mem);
+	free(d);
+}
+
+/* Runs the n new samples at the input of stage first of channel c through
+   the rest of the stages, returns the number of outputs left in y */
+static int stages_run(decimator *d, int first, int c, int n, float *y)
+{
+    struct dec_stage *s, *next;
+    int i;
+	for(i = first; i < d->nstages; i++) {
+	    s = &d->st[i];
+	    next = (i + 1 < d->nstages) ? &d->st[i + 1] : 0;
+	    n = stage_run(s, c, n, next ? next->x[c] + next->hist : y);
+	}
+    return n;
+}
+
+/* Same for all channels, updated once they're done */
+static int stages_advance(decimator *d, int first, int n)
+{
+    struct dec_stage *s;
+    int i, in;
+	for(i = first; i < d->nstages; i++) {
+	    s = &d->st[i];
+	    in = n;
+	    n = (in > s->phase) ? (in - s->phase + 1) / 2 : 0;
+	    s->phase += 2 * n - in;
+	}
+    return n;
+}
+
+/* Moves up to n held outputs to the planes from index from on, returns how many */
+static int hand_out(decimator *d, int32_t **planes, int from, int n)
+{
+    int c;
+	if(n > d->held) n = d->held;
+	for(c = 0; c < d->channels; c++) {
+	    memcpy(planes[c] + from, d->out[c], n * sizeof(int32_t));
+	    memmove(d->out[c], d->out[c] + n, (d->held - n) * sizeof(int32_t));
+	}
+	d->held -= n;
+    return n;
+}
+
+/* Takes frames samples of each plane from index from on. Replaces them with a period
+   of downsampled ones once there are enough, and returns the period, or 0 until then.
+   Filter state carries over to the next call. */
+int decimate(decimator *d, int32_t **planes, int from, int frames)
+{
+    float y[DEC_CHUNK / 2 + 1];
+    int32_t *src;
+    float *x;
+    int c, i, k, n, m;
+
+	for(k = 0; k < frames; k += n) {
+	    n = (frames - k < DEC_CHUNK) ? frames - k : DEC_CHUNK;
+	    for(c = 0; c < d->channels; c++) {
+		src = planes[c] + from + k;
+		x = d->st[0].x[c] + d->st[0].hist;
+		for(i = 0; i < n; i++) x[i] = (float) src[i];
+		m = stages_run(d, 0, c, n, y);
+		store(d, y, m, d->out[c] + d->held);
+	    }
+	    d->held += stages_advance(d, 0, n);
+	}
+    return (d->held < d->period) ? 0 : hand_out(d, planes, from, d->period);
+}
+
+/* End of stream: feeds each stage the 2k - 1 zeros its last outputs still wait for,
+   then hands out what is held a period at a time. Call until it returns 0. */
+int decimator_flush(decimator *d, int32_t **planes, int from)
+{
+    float y[DEC_CHUNK / 2 + 1];
+    struct dec_stage *s;
+    int c, i, n, m;
+
+	for(i = 0; i < d->nstages && !d->flushed; i++) {
+	    s = &d->st[i];
+	    n = 2 * s->k - 1;
+	    for(c = 0; c < d->channels; c++) {
+		memset(s->x[c] + s->hist, 0, n * sizeof(float));
+		m = stages_run(d, i, c, n, y);
+		store(d, y, m, d->out[c] + d->held);
+	    }
+	    d->held += stages_advance(d, i, n);
+	}
+	d->flushed = 1;
+    return hand_out(d, planes, from, d->period);
+}
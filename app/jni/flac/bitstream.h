@@ -27,6 +27,59 @@
 #define swap16(x) __builtin_bswap32(x)
 #endif
 
+#if defined(__LP64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HAVE_BITREADER64
+#include <string.h>
+
+/* 64-bit cache reader working on a GetBitContext for a run of codes.
+   The next bit is the msb of cache and the first "left" bits of it are valid,
+   it is refilled from pos only when the caller runs short of bits. */
+typedef struct BitReader64 {
+    uint64_t cache;
+    unsigned int pos;   /* stream position of the msb of cache */
+    int left;
+} BitReader64;
+
+static inline void br64_refill(const GetBitContext *gb, BitReader64 *br)
+{
+    const uint8_t *p = gb->buffer + (br->pos >> 3);
+    uint64_t v = 0;
+    int i;
+
+    if (p + 8 <= gb->buffer_end) {
+        memcpy(&v, p, 8);
+        v = __builtin_bswap64(v);
+    } else {
+        /* never read past the buffer, zeros are flagged by the pos check */
+        for (i = 0; i < 8; i++)
+            v = (v << 8) | (p + i < gb->buffer_end ? p[i] : 0);
+    }
+    br->cache = v << (br->pos & 7);
+    br->left = 64 - (br->pos & 7);
+}
+
+static inline void br64_open(const GetBitContext *gb, BitReader64 *br)
+{
+    br->pos = gb->index;
+    br64_refill(gb, br);
+}
+
+/* n < 64 */
+static inline void br64_skip(BitReader64 *br, int n)
+{
+    br->cache <<= n;
+    br->pos += n;
+    br->left -= n;
+}
+
+/* Returns nonzero if the reader went past the end of data */
+static inline int br64_close(GetBitContext *gb, const BitReader64 *br)
+{
+    gb->index = br->pos;
+    return br->pos > (unsigned int) gb->size_in_bits;
+}
+#endif
+
 
 #if (CONFIG_CPU == MCF5250) || (CONFIG_CPU == PP5022) || (CONFIG_CPU == PP5024)
 #define ICODE_ATTR_FLAC ICODE_ATTR
@@ -42,10 +42,6 @@
 
 #include "decoder.h"
 
-#ifdef CPU_ARM
-#include "arm.h"
-#endif
-
 #include <sys/types.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -147,8 +143,13 @@ static int get_crc8(const uint8_t *buf, int count)
     return crc;
 }
 
-static int decode_residuals(FLACContext *s, int32_t* decoded, int pred_order) ICODE_ATTR_FLAC;
-static int decode_residuals(FLACContext *s, int32_t* decoded, int pred_order)
+/*  Subframes are decoded by inline functions taking the block size and bits per sample
+    as arguments. They are instantiated for common stream shapes below, so that these
+    fold into constants, and once more for any other stream. */
+
+#define ALWAYS_INLINE	inline __attribute__((always_inline))
+
+static ALWAYS_INLINE int decode_residuals(FLACContext *s, int32_t* decoded, int pred_order, const int blocksize)
 {
     int i, tmp, partition, method_type, rice_order;
     int sample = 0, samples;
@@ -161,7 +162,7 @@ static int decode_residuals(FLACContext *s, int32_t* decoded, int pred_order)
     
     rice_order = get_bits(&s->gb, 4);
 
-    samples= s->blocksize >> rice_order;
+    samples= blocksize >> rice_order;
 
     sample= 
     i= pred_order;
@@ -175,11 +176,11 @@ static int decode_residuals(FLACContext *s, int32_t* decoded, int pred_order)
             for (; i < samples; i++, sample++)
                 decoded[sample] = get_sbits(&s->gb, tmp);
         }
-        else
+        else if (i < samples)
         {
-            for (; i < samples; i++, sample++){
-                decoded[sample] = get_sr_golomb_flac(&s->gb, tmp, INT_MAX, 0);
-            }
+            if (get_sr_golomb_flac_partition(&s->gb, decoded + sample, samples - i, tmp) < 0)
+                return -3;
+            sample += samples - i;
         }
         i= 0;
     }
@@ -187,10 +188,8 @@ static int decode_residuals(FLACContext *s, int32_t* decoded, int pred_order)
     return 0;
 }    
 
-static int decode_subframe_fixed(FLACContext *s, int32_t* decoded, int pred_order) ICODE_ATTR_FLAC;
-static int decode_subframe_fixed(FLACContext *s, int32_t* decoded, int pred_order)
+static ALWAYS_INLINE int decode_subframe_fixed(FLACContext *s, int32_t* decoded, int pred_order, const int blocksize)
 {
-    const int blocksize = s->blocksize;
     int a, b, c, d, i;
         
     /* warm up samples */
@@ -199,7 +198,7 @@ static int decode_subframe_fixed(FLACContext *s, int32_t* decoded, int pred_orde
         decoded[i] = get_sbits(&s->gb, s->curr_bps);
     }
     
-    if (decode_residuals(s, decoded, pred_order) < 0)
+    if (decode_residuals(s, decoded, pred_order, blocksize) < 0)
         return -4;
 #if 0
 SIGSEGV	
@@ -246,8 +245,7 @@ SIGSEGV
     return 0;
 }
 
-static int decode_subframe_lpc(FLACContext *s, int32_t* decoded, int pred_order) ICODE_ATTR_FLAC;
-static int decode_subframe_lpc(FLACContext *s, int32_t* decoded, int pred_order)
+static ALWAYS_INLINE int decode_subframe_lpc(FLACContext *s, int32_t* decoded, int pred_order, const int blocksize)
 {
     int i;
     int coeff_prec, qlevel;
@@ -277,42 +275,24 @@ static int decode_subframe_lpc(FLACContext *s, int32_t* decoded, int pred_order)
         coeffs[i] = get_sbits(&s->gb, coeff_prec);
     }
     
-    if (decode_residuals(s, decoded, pred_order) < 0)
+    if (decode_residuals(s, decoded, pred_order, blocksize) < 0)
         return -8;
 
-    if ((s->bps + coeff_prec + av_log2(pred_order)) <= 32) {
-        #ifdef CPU_ARM
-        lpc_decode_arm(s->blocksize - pred_order, qlevel, pred_order,
-                       decoded + pred_order, coeffs);
-        #else
-        for (i = pred_order; i < s->blocksize; i++)
-        {
-            int j, sum = 0;
-            for (j = 0; j < pred_order; j++)
-                sum += coeffs[j] * decoded[i-j-1];
-            decoded[i] += sum >> qlevel;
-        }
-        #endif
-    } else {
-        for (i = pred_order; i < s->blocksize; i++)
-        {
-            int j;
-	    int64_t wsum = 0;
-            for (j = 0; j < pred_order; j++)
-                wsum += (int64_t)coeffs[j] * (int64_t)decoded[i-j-1];
-            decoded[i] += wsum >> qlevel;
-        }
-    }
+    /* curr_bps rather than bps: side channels have one bit more */
+    if ((s->curr_bps + coeff_prec + av_log2(pred_order)) <= 32)
+        flac_lpc32(decoded, blocksize, coeffs, pred_order, qlevel);
+    else
+        flac_lpc64(decoded, blocksize, coeffs, pred_order, qlevel);
     
     return 0;
 }
 
-static inline int decode_subframe(FLACContext *s, int channel, int32_t* decoded)
+static ALWAYS_INLINE int decode_subframe(FLACContext *s, int channel, int32_t* decoded, const int blocksize, const int bps)
 {
     int type, wasted = 0;
     int i, tmp;
     
-    s->curr_bps = s->bps;
+    s->curr_bps = bps;
     if(channel == 0){
         if(s->decorrelation == RIGHT_SIDE)
             s->curr_bps++;
@@ -356,25 +336,25 @@ static inline int decode_subframe(FLACContext *s, int channel, int32_t* decoded)
     {
         //fprintf(stderr,"coding type: constant\n");
         tmp = get_sbits(&s->gb, s->curr_bps);
-        for (i = 0; i < s->blocksize; i++)
+        for (i = 0; i < blocksize; i++)
             decoded[i] = tmp;
     }
     else if (type == 1)
     {
         //fprintf(stderr,"coding type: verbatim\n");
-        for (i = 0; i < s->blocksize; i++)
+        for (i = 0; i < blocksize; i++)
             decoded[i] = get_sbits(&s->gb, s->curr_bps);
     }
     else if ((type >= 8) && (type <= 12))
     {
         //fprintf(stderr,"coding type: fixed\n");
-        if (decode_subframe_fixed(s, decoded, type & ~0x8) < 0)
+        if (decode_subframe_fixed(s, decoded, type & ~0x8, blocksize) < 0)
             return -10;
     }
     else if (type >= 32)
     {
         //fprintf(stderr,"coding type: lpc\n");
-        if (decode_subframe_lpc(s, decoded, (type & ~0x20)+1) < 0)
+        if (decode_subframe_lpc(s, decoded, (type & ~0x20)+1, blocksize) < 0)
             return -11;
     }
     else
@@ -386,21 +366,19 @@ static inline int decode_subframe(FLACContext *s, int channel, int32_t* decoded)
     if (wasted)
     {
         int i;
-        for (i = 0; i < s->blocksize; i++)
+        for (i = 0; i < blocksize; i++)
             decoded[i] <<= wasted;
     }
 
     return 0;
 }
 
-static int decode_frame(FLACContext *s,
-                        void (*yield)(void)) ICODE_ATTR_FLAC;
-static int decode_frame(FLACContext *s,
-                        void (*yield)(void))
+/* Parses the frame header into s */
+static int decode_frame_header(FLACContext *s) ICODE_ATTR_FLAC;
+static int decode_frame_header(FLACContext *s)
 {
     int blocksize_code, sample_rate_code, sample_size_code, assignment, crc8;
     int decorrelation, bps, blocksize, samplerate;
-    int res, ch;
     
     blocksize_code = get_bits(&s->gb, 4);
 
@@ -486,13 +464,19 @@ static int decode_frame(FLACContext *s,
     s->bps          = bps;
     s->decorrelation= decorrelation;
 
-    for (ch=0; ch<s->channels; ++ch) {
-        yield();
-        if ((res=decode_subframe(s, ch, s->decoded[ch])) < 0)
+    return 0;
+}
+
+/* Zero for any of channels, bps or blocksize means as given by the frame header */
+static ALWAYS_INLINE int decode_subframes(FLACContext *s, const int channels, const int bps, const int blocksize)
+{
+    int res, ch;
+
+    for (ch=0; ch<(channels ? channels : s->channels); ++ch) {
+        if ((res=decode_subframe(s, ch, s->decoded[ch], blocksize ? blocksize : s->blocksize, bps ? bps : s->bps)) < 0)
             return res-100;
     }
     
-    yield();
     align_get_bits(&s->gb);
 
     /* frame footer */
@@ -501,91 +485,47 @@ static int decode_frame(FLACContext *s,
     return 0;
 }
 
-static int flac_downmix(FLACContext *s) ICODE_ATTR_FLAC;
-static int flac_downmix(FLACContext *s)
+static int decode_frame(FLACContext *s) ICODE_ATTR_FLAC;
+static int decode_frame(FLACContext *s)
 {
-    int32_t *FL, *FR, *FC, *SB, *RL, *RR;
-    int32_t *outL = s->decoded[0];
-    int32_t *outR = s->decoded[1];
-    int i;
+    int res = decode_frame_header(s);
+    return res < 0 ? res : decode_subframes(s, 0, 0, 0);
+}
 
-    switch(s->channels)
-    {
-        case 3: /* 3.0 channel order: FL FR FC */
-            FL = s->decoded[0];
-            FR = s->decoded[1];
-            FC = s->decoded[2];
-            /* LF = 0.66 LF + 0.33 FC
-               LR = 0.66 LR + 0.33 FC */
-            for (i=0; i<s->blocksize; ++i) {
-                int32_t a = *(FL)*2 + *(FC);
-                int32_t b = *(FR)*2 + *(FC);
-                *outL++ = ((a + (a<<2))>>4); /* 1/3 ~= 5>>4 */
-                *outR++ = ((b + (b<<2))>>4); /* 1/3 ~= 5>>4 */
-                FL++; FR++; FC++;
-            }
-            break;
-        case 4: /* 4.0 channel order: FL FR RL RR */
-            FL = s->decoded[0];
-            FR = s->decoded[1];
-            RL = s->decoded[2];
-            RR = s->decoded[3];
-            /* LF = 0.50 LF + 0.50 RL + 0.00 RR
-               LR = 0.50 LR + 0.00 RL + 0.50 RR */
-            for (i=0; i<s->blocksize; ++i) {
-                int32_t a = *(FL) + *(RL);
-                int32_t b = *(FR) + *(RR);
-                *outL++ = (a>>1);
-                *outR++ = (b>>1);
-                FL++; FR++; RL++; RR++;
-            }
-            break;
-        case 5: /* 5.0 channel order: FL FR FC RL RR */
-            FL = s->decoded[0];
-            FR = s->decoded[1];
-            FC = s->decoded[2];
-            RL = s->decoded[3];
-            RR = s->decoded[4];
-            /* LF = 0.40 LF + 0.20 FC + 0.40 RL + 0.00 RR
-               LR = 0.40 LR + 0.20 FC + 0.00 RL + 0.40 RR */
-            for (i=0; i<s->blocksize; ++i) {
-                int32_t a = *(FL)*2 + *(FC) + *(RL)*2;
-                int32_t b = *(FR)*2 + *(FC) + *(RR)*2;
-                *outL++ = ((a + (a<<1))>>4); /* 3>>4 ~= 1/5 */
-                *outR++ = ((b + (b<<1))>>4); /* 3>>4 ~= 1/5 */
-                FL++; FR++; FC++; RL++; RR++;
-            }
-            break;
-        case 6: /* 5.1 channel order: FL FR FC SUB RL RR */
-            FL = s->decoded[0];
-            FR = s->decoded[1];
-            FC = s->decoded[2];
-            SB = s->decoded[3];
-            RL = s->decoded[4];
-            RR = s->decoded[5];
-            /* LF = 0.33 LF + 0.16 SUB + 0.16 FC + 0.33 RL + 0.00 RR
-               LR = 0.33 LR + 0.16 SUB + 0.16 FC + 0.00 RL + 0.33 RR */
-            for (i=0; i<s->blocksize; ++i) {
-                int32_t a = *(FL)*2 + *(SB) + *(FC) + *(RL)*2;
-                int32_t b = *(FR)*2 + *(SB) + *(FC) + *(RR)*2;
-                *outL++ = ((a + (a<<2))>>5); /* 5>>5 ~= 1/6 */
-                *outR++ = ((b + (b<<2))>>5); /* 5>>5 ~= 1/6 */
-                FL++; FR++; SB++; FC++; RL++; RR++;
-            }
-            break;
-        default: /* 1.0 and 2.0 do not need downmix, other formats unknown. */
-            return -501;
-            break;
-    }
-    return 0;
+/* Frames of another shape, such as the last one of the stream, take the generic path */
+#define FRAME_DECODER(name, CH, BPS, BS) \
+static int name(FLACContext *s) \
+{ \
+    int res = decode_frame_header(s); \
+    if (res < 0) \
+        return res; \
+    if ((CH && s->channels != CH) || (BPS && s->bps != BPS) || (BS && s->blocksize != BS)) \
+        return decode_subframes(s, 0, 0, 0); \
+    return decode_subframes(s, CH, BPS, BS); \
 }
 
-int flac_decode_frame(FLACContext *s,
-                      uint8_t *buf, int buf_size,
-                      void (*yield)(void))
+FRAME_DECODER(decode_frame_s16_4096, 2, 16, 4096)
+FRAME_DECODER(decode_frame_s24_4096, 2, 24, 4096)
+FRAME_DECODER(decode_frame_s24_8192, 2, 24, 8192)
+FRAME_DECODER(decode_frame_mono, 1, 0, 0)
+
+/* Picks the frame decoder for the stream described by STREAMINFO */
+void flac_select_decoder(FLACContext *s)
+{
+    s->decode = decode_frame;
+    if (s->channels == 1)
+        s->decode = decode_frame_mono;
+    else if (s->channels == 2 && s->max_blocksize == 4096 && s->bps == 16)
+        s->decode = decode_frame_s16_4096;
+    else if (s->channels == 2 && s->max_blocksize == 4096 && s->bps == 24)
+        s->decode = decode_frame_s24_4096;
+    else if (s->channels == 2 && s->max_blocksize == 8192 && s->bps == 24)
+        s->decode = decode_frame_s24_8192;
+}
+
+int flac_decode_frame(FLACContext *s, uint8_t *buf, int buf_size)
 {
     int tmp;
-    int i;
     int framesize;
 
     init_get_bits(&s->gb, buf, buf_size*8);
@@ -595,45 +535,21 @@ int flac_decode_frame(FLACContext *s,
         return -41;
     }
 
-    if ((framesize=decode_frame(s,yield)) < 0){
+    if ((framesize=(s->decode ? s->decode(s) : decode_frame(s))) < 0){
        s->bitstream_size=0;
        s->bitstream_index=0;
        return framesize;
     }
 
-    yield();
-    
-#define DECORRELATE(left, right)\
-             for (i = 0; i < s->blocksize; i++) {\
-                int32_t a = s->decoded[0][i];\
-                int32_t b = s->decoded[1][i];\
-                s->decoded[0][i] = (left);\
-                s->decoded[1][i] = (right);\
-             }\
-
-    switch(s->decorrelation)
-    {
-        case INDEPENDENT:
-            if (s->channels <= 2) {
-                DECORRELATE(a, b) /* Always decorrelate exactly the two supported channels. */
-            } else {
-                if ((tmp=flac_downmix(s)) != 0)
-                    return tmp;
-            }
-            break;
-        case LEFT_SIDE:
-            DECORRELATE(a, a-b)
-            break;
-        case RIGHT_SIDE:
-            DECORRELATE(a+b, b)
-            break;
-        case MID_SIDE:
-            DECORRELATE( (a-=b>>1) + b, a)	/* a + b/2, a - b/2 */
-            break;
-    }
-
     s->framesize = (get_bits_count(&s->gb)+7)>>3;
 
+    /* crc-16 of the whole frame including its footer is zero */
+    if (s->check_crc && (s->framesize > buf_size || flac_crc16(buf, s->framesize) != 0))
+        return -19;
+
+    /* Stereo decorrelation and downmix of more channels are left to the output
+       stage (pcm_convert() with s->decorrelation) */
+
     return 0;
 }
 
@@ -3,7 +3,7 @@
  
 #include "bitstream.h"
 
-#define MAX_CHANNELS 6       /* Maximum supported channels, only left/right will be played back */
+#define MAX_CHANNELS 8       /* STREAMINFO allows up to 8, more than 2 are downmixed in the output stage */
 //#define MAX_BLOCKSIZE 4608   /* Maxsize in samples of one uncompressed frame */
 #define MAX_BLOCKSIZE 16384   /* Maxsize in samples of one uncompressed frame */
 #define MAX_FRAMESIZE 65536  /* Maxsize in bytes of one compressed frame */
@@ -47,14 +47,31 @@ typedef struct FLACContext {
     int framesize;
     
     int32_t *decoded[MAX_CHANNELS];
+    void *arena;		/* holds decoded[] and seekpoints */
+    int (*decode)(struct FLACContext *s);	/* frame decoder for this stream */
+
+    uint8_t md5[16];	/* of the decoded stream, zero if not computed by the encoder */
+    int check_crc;	/* verify crc-16 of each frame */
 
     int nseekpoints;	
     struct FLACseekpoint *seekpoints;	   
  
 } FLACContext;
 
-int flac_decode_frame(FLACContext *s,
-                      uint8_t *buf, int buf_size,
-                      void (*yield)(void)) ICODE_ATTR_FLAC;
+int flac_decode_frame(FLACContext *s, uint8_t *buf, int buf_size) ICODE_ATTR_FLAC;
+void flac_select_decoder(FLACContext *s);
+
+/* lpc.c: restores data[order..len-1], kernels are selected by flac_lpc_init() */
+typedef void (*flac_lpc_fn)(int32_t *data, int len, const int *coeffs, int order, int qlevel);
+extern flac_lpc_fn flac_lpc32, flac_lpc64;
+void flac_lpc_init(void);
+
+/* verify.c */
+struct flac_verify;
+void flac_crc16_init(void);
+int flac_crc16(const uint8_t *p, int len);
+struct flac_verify *flac_verify_start(const FLACContext *fc, int threaded);
+void flac_verify_frame(struct flac_verify *v, int32_t **planes, int blocksize, int decorr);
+int flac_verify_finish(struct flac_verify *v, int complete);
 
 #endif
@@ -87,6 +87,52 @@ static inline int get_sr_golomb_flac(GetBitContext *gb, int k, int limit, int es
     return (v>>1) ^ -(v&1);
 }
 
+/**
+ * read a partition of n signed golomb rice codes (flac) with parameter k <= 30.
+ * On 64-bit targets the whole partition is decoded from a 64-bit cache,
+ * which is refilled only when a code does not fit in what is left of it.
+ * @return 0, or -1 if the codes run past the end of the buffer
+ */
+static inline int get_sr_golomb_flac_partition(GetBitContext *gb, int32_t *out, int n, int k){
+#ifdef HAVE_BITREADER64
+    BitReader64 br;
+    unsigned int q, u;
+    int i, z;
+    uint64_t t;
+
+    br64_open(gb, &br);
+    for(i=0; i<n; i++){
+        /* unary part: count zeros, refilling if it or the k low bits do not fit */
+        for(q=0;;){
+            z= br.cache ? __builtin_clzll(br.cache) : br.left;
+            if(z + 1 + k <= br.left)
+                break;
+            q += z;
+            br.pos += z;
+            if(br.pos > (unsigned int) gb->size_in_bits){
+                br64_close(gb, &br);
+                return -1;
+            }
+            br64_refill(gb, &br);
+        }
+        q += z;
+        t= br.cache << z;
+        /* t has the stop bit on top, followed by the k low bits */
+        u= (q << k) + (unsigned int)(t >> (63 - k)) - (1u << k);
+        br.cache= (t << 1) << k;
+        br.pos += z + 1 + k;
+        br.left -= z + 1 + k;
+        out[i]= (u >> 1) ^ -(u & 1);
+    }
+    return br64_close(gb, &br) ? -1 : 0;
+#else
+    int i;
+    for(i=0; i<n; i++)
+        out[i]= get_sr_golomb_flac(gb, k, INT_MAX, 0);
+    return 0;
+#endif
+}
+
 /**
  * read unsigned golomb rice code (shorten).
  */
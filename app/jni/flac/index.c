@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef ANDROID
+#include <android/log.h>
+#endif
+#include <jni_sub.h>
+#define __force
+#define __bitwise
+#define __user
+#include <sound/asound.h>
+
+#include "main.h"
+
+/*  Frame index: sample number -> byte offset of the frame starting there, one point
+    per INDEX_SPACING bytes of stream. It is filled while playing and saved to a sidecar file named
+    after a hash of the path, which also stores the path, size and mtime of the file
+    to match it. A point is marked contiguous when everything up to the next point has
+    been played through, so any sample below the next point is reached by decoding
+    forward from it; playing to the end adds a final point at the end of stream. */
+
+#define INDEX_SPACING		(64*1024)
+#define INDEX_MAX_POINTS	(1 << 20)
+#define INDEX_MAGIC		"ALPFIDX1"
+
+#if defined(ANDROID) || defined(ANDLINUX)
+#define INDEX_DIR_FMT		"/sdcard/.alsaplayer%s"
+#define INDEX_DIR_ARG		""
+#else
+#define INDEX_DIR_FMT		"%s/.alsaplayer"
+#define INDEX_DIR_ARG		getenv("HOME")
+#endif
+
+struct index_hdr {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime;
+    uint32_t path_len;
+    uint32_t npoints;
+};
+
+struct flac_index {
+    char *path;			/* of the audio file */
+    char cache[PATH_MAX];	/* sidecar file */
+    uint64_t size;
+    int64_t mtime;
+    struct flac_index_point *pts;
+    int n, max;
+    int dirty;
+    int run;			/* a contiguous run is being recorded */
+    uint64_t run_last, run_next;	/* its last point, offset due for the next one */
+};
+
+static uint64_t fnv1a(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+	while(*s) {
+	    h ^= (uint8_t) *s++;
+	    h *= 0x100000001b3ULL;
+	}
+    return h;
+}
+
+/* Directory of the sidecar files, returns -1 if there is none (HOME unset) */
+static int index_dir(char *dir, size_t size)
+{
+    const char *arg = INDEX_DIR_ARG;
+	if(!arg) return -1;
+	snprintf(dir, size, INDEX_DIR_FMT, arg);
+    return 0;
+}
+
+/* Last point with sample <= target, or -1 */
+static int lookup(const struct flac_index *idx, uint64_t target)
+{
+    int lo = 0, hi = idx->n - 1, mid;
+	while(lo <= hi) {
+	    mid = (lo + hi) / 2;
+	    if(idx->pts[mid].sample <= target) lo = mid + 1;
+	    else hi = mid - 1;
+	}
+    return hi;
+}
+
+static void load(struct flac_index *idx)
+{
+    struct index_hdr hdr;
+    char path[PATH_MAX];
+    int fd = open(idx->cache, O_RDONLY);
+	if(fd < 0) return;
+	if(read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr.magic, INDEX_MAGIC, 8) != 0
+	    || hdr.size != idx->size || hdr.mtime != idx->mtime || hdr.path_len >= PATH_MAX
+	    || hdr.npoints > INDEX_MAX_POINTS) goto stale;
+	if(read(fd, path, hdr.path_len) != hdr.path_len) goto stale;
+	path[hdr.path_len] = 0;
+	if(strcmp(path, idx->path) != 0) goto stale;	/* hash collision */
+	idx->pts = (struct flac_index_point *) malloc(hdr.npoints * sizeof(struct flac_index_point));
+	if(!idx->pts) goto stale;
+	if(read(fd, idx->pts, hdr.npoints * sizeof(struct flac_index_point)) != hdr.npoints * sizeof(struct flac_index_point)) {
+	    free(idx->pts);
+	    idx->pts = 0;
+	    goto stale;
+	}
+	idx->n = idx->max = hdr.npoints;
+	close(fd);
+	log_info("loaded frame index with %d points", idx->n);
+	return;
+    stale:
+	close(fd);
+	log_info("frame index for %s is stale", idx->path);
+}
+
+static void save(struct flac_index *idx)
+{
+    struct index_hdr hdr;
+    char tmp[PATH_MAX + 8], dir[PATH_MAX];
+    int fd, len = sizeof(struct flac_index_point) * idx->n;
+	if(index_dir(dir, sizeof(dir)) != 0) return;
+	mkdir(dir, 0755);
+	strncat(dir, "/index", sizeof(dir) - strlen(dir) - 1);
+	mkdir(dir, 0755);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", idx->cache);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+	    log_err("cannot create %s: %s", tmp, strerror(errno));
+	    return;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, INDEX_MAGIC, 8);
+	hdr.size = idx->size;
+	hdr.mtime = idx->mtime;
+	hdr.path_len = strlen(idx->path);
+	hdr.npoints = idx->n;
+	if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || write(fd, idx->path, hdr.path_len) != hdr.path_len
+	    || write(fd, idx->pts, len) != len) {
+	    log_err("cannot write %s", tmp);
+	    close(fd);
+	    unlink(tmp);
+	    return;
+	}
+	close(fd);
+	if(rename(tmp, idx->cache) != 0) unlink(tmp);
+	else log_info("saved frame index with %d points", idx->n);
+}
+
+struct flac_index *flac_index_open(const char *file)
+{
+    struct flac_index *idx;
+    struct stat st;
+    char dir[PATH_MAX - 32];	/* room for the file name in idx->cache */
+	if(!file || stat(file, &st) != 0) return 0;
+	if(index_dir(dir, sizeof(dir)) != 0) {
+	    log_info("no directory for frame index");
+	    return 0;
+	}
+	idx = (struct flac_index *) calloc(1, sizeof(struct flac_index));
+	if(!idx) return 0;
+	idx->path = realpath(file, 0);
+	if(!idx->path) {	/* no stable name to key the sidecar on */
+	    free(idx);
+	    return 0;
+	}
+	idx->size = st.st_size;
+	idx->mtime = st.st_mtime;
+	snprintf(idx->cache, sizeof(idx->cache), "%s/index/%016" PRIx64 ".idx", dir, fnv1a(idx->path));
+	load(idx);
+    return idx;
+}
+
+void flac_index_close(struct flac_index *idx)
+{
+	if(idx->dirty) save(idx);
+	free(idx->pts);
+	free(idx->path);
+	free(idx);
+}
+
+/* Returns position of the point at sample, inserting it if needed, or -1 */
+static int insert(struct flac_index *idx, uint64_t sample, uint64_t offset)
+{
+    int i = lookup(idx, sample);
+    struct flac_index_point *p;
+	if(i >= 0 && idx->pts[i].sample == sample) return i;
+	if(idx->n == idx->max) {
+	    int max = idx->max ? idx->max * 2 : 256;
+	    if(max > INDEX_MAX_POINTS) return -1;
+	    p = (struct flac_index_point *) realloc(idx->pts, max * sizeof(struct flac_index_point));
+	    if(!p) return -1;
+	    idx->pts = p;
+	    idx->max = max;
+	}
+	i++;
+	memmove(idx->pts + i + 1, idx->pts + i, (idx->n - i) * sizeof(struct flac_index_point));
+	idx->pts[i].sample = sample;
+	idx->pts[i].offset = offset;
+	idx->pts[i].cont = 0;
+	idx->n++;
+	idx->dirty = 1;
+    return i;
+}
+
+/* Every point of the run from run_last up to i has been played through */
+static void mark_run(struct flac_index *idx, int i)
+{
+    int k;
+	for(k = lookup(idx, idx->run_last); k >= 0 && k < i; k++) {
+	    if(!idx->pts[k].cont) idx->dirty = 1;
+	    idx->pts[k].cont = 1;
+	}
+}
+
+/* Called for each frame played, in stream order: its first sample and file offset */
+void flac_index_add(struct flac_index *idx, uint64_t sample, uint64_t offset)
+{
+    int i;
+	if(idx->run && offset < idx->run_next) return;
+	i = insert(idx, sample, offset);
+	if(i < 0) return;
+	if(idx->run) mark_run(idx, i);
+	idx->run = 1;
+	idx->run_last = sample;
+	idx->run_next = offset + INDEX_SPACING;
+}
+
+/* Playback has reached the end of stream: sample count and file length */
+void flac_index_end(struct flac_index *idx, uint64_t sample, uint64_t offset)
+{
+    int i;
+	if(!idx->run) return;
+	i = insert(idx, sample, offset);
+	if(i >= 0) mark_run(idx, i);
+	idx->run = 0;
+}
+
+/* Returns 1 if target is reached by decoding forward from the frame at *lo, 0 if
+   lo and hi only bound it (either may have sample set to -1 if none) */
+int flac_index_find(const struct flac_index *idx, uint64_t target, struct flac_index_point *lo, struct flac_index_point *hi)
+{
+    int i = lookup(idx, target);
+	lo->sample = hi->sample = (uint64_t) -1;
+	if(i >= 0) *lo = idx->pts[i];
+	if(i + 1 < idx->n) *hi = idx->pts[i + 1];
+    return i >= 0 && i + 1 < idx->n && idx->pts[i].cont;
+}
@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef ANDROID
+#include <android/log.h>
+#endif
+#include <jni_sub.h>
+#define __force
+#define __bitwise
+#define __user
+#include <sound/asound.h>
+
+#include "flac/decoder.h"
+#include "main.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LPC_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define LPC_NEON
+#elif defined(CPU_ARM)
+#include "arm.h"
+#endif
+
+/*  LPC restoration: data[i] += sum(coeffs[j] * data[i-j-1]) >> qlevel for i >= order.
+    lpc32 is used when the sums fit in 32 bits, lpc64 otherwise.
+    Every sample depends on the ones just restored, so vector kernels take a block of
+    w outputs at once: lane t accumulates data[i-1-m] * coeffs[m+t] over the history
+    before the block, which is known, and the remaining terms of the triangle inside
+    the block are added by scalar code. All kernels are instantiated for each order. */
+
+#define LPC_MAX_ORDER	32
+#define LPC_SIMD_MIN_ORDER	7	/* below that unrolled scalar code is as fast */
+
+#define ALWAYS_INLINE	inline __attribute__((always_inline))
+
+#define LPC_ORDERS(f, data, from, len, coeffs, order, qlevel) \
+	switch(order) { \
+	    case 1: f(data, from, len, coeffs, 1, qlevel); break; \
+	    case 2: f(data, from, len, coeffs, 2, qlevel); break; \
+	    case 3: f(data, from, len, coeffs, 3, qlevel); break; \
+	    case 4: f(data, from, len, coeffs, 4, qlevel); break; \
+	    case 5: f(data, from, len, coeffs, 5, qlevel); break; \
+	    case 6: f(data, from, len, coeffs, 6, qlevel); break; \
+	    case 7: f(data, from, len, coeffs, 7, qlevel); break; \
+	    case 8: f(data, from, len, coeffs, 8, qlevel); break; \
+	    case 9: f(data, from, len, coeffs, 9, qlevel); break; \
+	    case 10: f(data, from, len, coeffs, 10, qlevel); break; \
+	    case 11: f(data, from, len, coeffs, 11, qlevel); break; \
+	    case 12: f(data, from, len, coeffs, 12, qlevel); break; \
+	    case 13: f(data, from, len, coeffs, 13, qlevel); break; \
+	    case 14: f(data, from, len, coeffs, 14, qlevel); break; \
+	    case 15: f(data, from, len, coeffs, 15, qlevel); break; \
+	    case 16: f(data, from, len, coeffs, 16, qlevel); break; \
+	    case 17: f(data, from, len, coeffs, 17, qlevel); break; \
+	    case 18: f(data, from, len, coeffs, 18, qlevel); break; \
+	    case 19: f(data, from, len, coeffs, 19, qlevel); break; \
+	    case 20: f(data, from, len, coeffs, 20, qlevel); break; \
+	    case 21: f(data, from, len, coeffs, 21, qlevel); break; \
+	    case 22: f(data, from, len, coeffs, 22, qlevel); break; \
+	    case 23: f(data, from, len, coeffs, 23, qlevel); break; \
+	    case 24: f(data, from, len, coeffs, 24, qlevel); break; \
+	    case 25: f(data, from, len, coeffs, 25, qlevel); break; \
+	    case 26: f(data, from, len, coeffs, 26, qlevel); break; \
+	    case 27: f(data, from, len, coeffs, 27, qlevel); break; \
+	    case 28: f(data, from, len, coeffs, 28, qlevel); break; \
+	    case 29: f(data, from, len, coeffs, 29, qlevel); break; \
+	    case 30: f(data, from, len, coeffs, 30, qlevel); break; \
+	    case 31: f(data, from, len, coeffs, 31, qlevel); break; \
+	    case 32: f(data, from, len, coeffs, 32, qlevel); break; \
+	    default: f(data, from, len, coeffs, order, qlevel); break; \
+	}
+
+static ALWAYS_INLINE void lpc32_order(int32_t *data, int from, int len, const int *coeffs, int order, int qlevel)
+{
+    int i, j, sum;
+	for(i = from; i < len; i++) {
+	    for(j = 0, sum = 0; j < order; j++) sum += coeffs[j] * data[i-j-1];
+	    data[i] += sum >> qlevel;
+	}
+}
+
+static ALWAYS_INLINE void lpc64_order(int32_t *data, int from, int len, const int *coeffs, int order, int qlevel)
+{
+    int i, j;
+    int64_t sum;
+	for(i = from; i < len; i++) {
+	    for(j = 0, sum = 0; j < order; j++) sum += (int64_t) coeffs[j] * data[i-j-1];
+	    data[i] += sum >> qlevel;
+	}
+}
+
+static void lpc32_c(int32_t *data, int len, const int *coeffs, int order, int qlevel)
+{
+	LPC_ORDERS(lpc32_order, data, order, len, coeffs, order, qlevel)
+}
+
+static void lpc64_c(int32_t *data, int len, const int *coeffs, int order, int qlevel)
+{
+	LPC_ORDERS(lpc64_order, data, order, len, coeffs, order, qlevel)
+}
+
+flac_lpc_fn flac_lpc32 = lpc32_c;
+flac_lpc_fn flac_lpc64 = lpc64_c;
+
+/* Coefficients followed by zeros, so that coeffs[m+t] may be loaded for any lane */
+static ALWAYS_INLINE void pad_coeffs(int32_t *cz, const int *coeffs, int order)
+{
+    int m;
+	for(m = 0; m < order; m++) cz[m] = coeffs[m];
+	for(; m < order + 8; m++) cz[m] = 0;
+}
+
+/* Completes a block of w outputs at data from the partial sums s. Samples are
+   stored one by one: the next block loads them back, and forwarding a dword from
+   a wide store to such a load may stall. */
+static ALWAYS_INLINE void block32(int32_t *data, const int32_t *s, const int32_t *cz, int w, int qlevel)
+{
+    int32_t out[8];
+    int t, j, sum;
+	for(t = 0; t < w; t++) {
+#pragma GCC unroll 8
+	    for(j = 0, sum = s[t]; j < t; j++) sum += cz[j] * out[t-j-1];
+	    data[t] = out[t] = data[t] + (sum >> qlevel);
+	}
+}
+
+static ALWAYS_INLINE void block64(int32_t *data, const int64_t *s, const int32_t *cz, int w, int qlevel)
+{
+    int32_t out[8];
+    int t, j;
+    int64_t sum;
+	for(t = 0; t < w; t++) {
+#pragma GCC unroll 8
+	    for(j = 0, sum = s[t]; j < t; j++) sum += (int64_t) cz[j] * out[t-j-1];
+	    data[t] = out[t] = data[t] + (sum >> qlevel);
+	}
+}
+
+#define SIMD_KERNEL(name, body, scalar) \
+void name(int32_t *data, int len, const int *coeffs, int order, int qlevel) \
+{ \
+	if(order < LPC_SIMD_MIN_ORDER || order > LPC_MAX_ORDER) { \
+	    scalar(data, len, coeffs, order, qlevel); \
+	    return; \
+	} \
+	LPC_ORDERS(body, data, order, len, coeffs, order, qlevel) \
+}
+
+#ifdef LPC_X86
+
+#define SSE4 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+
+static ALWAYS_INLINE SSE4 void lpc32_sse4_body(int32_t *data, int i, int len, const int *coeffs, int order, int qlevel)
+{
+    int32_t cz[LPC_MAX_ORDER + 8], s[4] __attribute__((aligned(16)));
+    __m128i c[LPC_MAX_ORDER], acc;
+    int m;
+	pad_coeffs(cz, coeffs, order);
+	for(m = 0; m < order; m++) c[m] = _mm_loadu_si128((const __m128i *) (cz + m));
+	for(; i + 4 <= len; i += 4) {
+	    acc = _mm_mullo_epi32(_mm_set1_epi32(data[i-1]), c[0]);
+	    for(m = 1; m < order; m++)
+		acc = _mm_add_epi32(acc, _mm_mullo_epi32(_mm_set1_epi32(data[i-1-m]), c[m]));
+	    _mm_store_si128((__m128i *) s, acc);
+	    block32(data + i, s, cz, 4, qlevel);
+	}
+	lpc32_order(data, i, len, coeffs, order, qlevel);
+}
+
+static ALWAYS_INLINE SSE4 void lpc64_sse4_body(int32_t *data, int i, int len, const int *coeffs, int order, int qlevel)
+{
+    int32_t cz[LPC_MAX_ORDER + 8];
+    int64_t s[4] __attribute__((aligned(16)));
+    __m128i c0[LPC_MAX_ORDER], c1[LPC_MAX_ORDER], acc0, acc1, x;
+    int m;
+	pad_coeffs(cz, coeffs, order);
+	for(m = 0; m < order; m++) {
+	    c0[m] = _mm_cvtepi32_epi64(_mm_loadl_epi64((const __m128i *) (cz + m)));
+	    c1[m] = _mm_cvtepi32_epi64(_mm_loadl_epi64((const __m128i *) (cz + m + 2)));
+	}
+	for(; i + 4 <= len; i += 4) {
+	    acc0 = acc1 = _mm_setzero_si128();
+	    for(m = 0; m < order; m++) {
+		x = _mm_set1_epi32(data[i-1-m]);
+		acc0 = _mm_add_epi64(acc0, _mm_mul_epi32(x, c0[m]));
+		acc1 = _mm_add_epi64(acc1, _mm_mul_epi32(x, c1[m]));
+	    }
+	    _mm_store_si128((__m128i *) s, acc0);
+	    _mm_store_si128((__m128i *) (s + 2), acc1);
+	    block64(data + i, s, cz, 4, qlevel);
+	}
+	lpc64_order(data, i, len, coeffs, order, qlevel);
+}
+
+static ALWAYS_INLINE AVX2 void lpc32_avx2_body(int32_t *data, int i, int len, const int *coeffs, int order, int qlevel)
+{
+    int32_t cz[LPC_MAX_ORDER + 8], s[8] __attribute__((aligned(32)));
+    __m256i c[LPC_MAX_ORDER], acc;
+    int m;
+	pad_coeffs(cz, coeffs, order);
+	for(m = 0; m < order; m++) c[m] = _mm256_loadu_si256((const __m256i *) (cz + m));
+	for(; i + 8 <= len; i += 8) {
+	    acc = _mm256_mullo_epi32(_mm256_set1_epi32(data[i-1]), c[0]);
+	    for(m = 1; m < order; m++)
+		acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(_mm256_set1_epi32(data[i-1-m]), c[m]));
+	    _mm256_store_si256((__m256i *) s, acc);
+	    block32(data + i, s, cz, 8, qlevel);
+	}
+	lpc32_order(data, i, len, coeffs, order, qlevel);
+}
+
+static ALWAYS_INLINE AVX2 void lpc64_avx2_body(int32_t *data, int i, int len, const int *coeffs, int order, int qlevel)
+{
+    int32_t cz[LPC_MAX_ORDER + 8];
+    int64_t s[4] __attribute__((aligned(32)));
+    __m256i c[LPC_MAX_ORDER], acc;
+    int m;
+	pad_coeffs(cz, coeffs, order);
+	for(m = 0; m < order; m++) c[m] = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *) (cz + m)));
+	for(; i + 4 <= len; i += 4) {
+	    acc = _mm256_mul_epi32(_mm256_set1_epi32(data[i-1]), c[0]);
+	    for(m = 1; m < order; m++)
+		acc = _mm256_add_epi64(acc, _mm256_mul_epi32(_mm256_set1_epi32(data[i-1-m]), c[m]));
+	    _mm256_store_si256((__m256i *) s, acc);
+	    block64(data + i, s, cz, 4, qlevel);
+	}
+	lpc64_order(data, i, len, coeffs, order, qlevel);
+}
+
+static SSE4 SIMD_KERNEL(lpc32_sse4, lpc32_sse4_body, lpc32_c)
+static SSE4 SIMD_KERNEL(lpc64_sse4, lpc64_sse4_body, lpc64_c)
+static AVX2 SIMD_KERNEL(lpc32_avx2, lpc32_avx2_body, lpc32_c)
+static AVX2 SIMD_KERNEL(lpc64_avx2, lpc64_avx2_body, lpc64_c)
+
+#endif	/* LPC_X86 */
+
+#ifdef LPC_NEON
+
+static ALWAYS_INLINE void lpc32_neon_body(int32_t *data, int i, int len, const int *coeffs, int order, int qlevel)
+{
+    int32_t cz[LPC_MAX_ORDER + 8], s[4];
+    int32x4_t c[LPC_MAX_ORDER], acc;
+    int m;
+	pad_coeffs(cz, coeffs, order);
+	for(m = 0; m < order; m++) c[m] = vld1q_s32(cz + m);
+	for(; i + 4 <= len; i += 4) {
+	    acc = vmulq_n_s32(c[0], data[i-1]);
+	    for(m = 1; m < order; m++) acc = vmlaq_n_s32(acc, c[m], data[i-1-m]);
+	    vst1q_s32(s, acc);
+	    block32(data + i, s, cz, 4, qlevel);
+	}
+	lpc32_order(data, i, len, coeffs, order, qlevel);
+}
+
+static ALWAYS_INLINE void lpc64_neon_body(int32_t *data, int i, int len, const int *coeffs, int order, int qlevel)
+{
+    int32_t cz[LPC_MAX_ORDER + 8];
+    int64_t s[4];
+    int32x4_t c[LPC_MAX_ORDER];
+    int64x2_t acc0, acc1;
+    int m;
+	pad_coeffs(cz, coeffs, order);
+	for(m = 0; m < order; m++) c[m] = vld1q_s32(cz + m);
+	for(; i + 4 <= len; i += 4) {
+	    acc0 = vmull_n_s32(vget_low_s32(c[0]), data[i-1]);
+	    acc1 = vmull_high_n_s32(c[0], data[i-1]);
+	    for(m = 1; m < order; m++) {
+		acc0 = vmlal_n_s32(acc0, vget_low_s32(c[m]), data[i-1-m]);
+		acc1 = vmlal_high_n_s32(acc1, c[m], data[i-1-m]);
+	    }
+	    vst1q_s64(s, acc0);
+	    vst1q_s64(s + 2, acc1);
+	    block64(data + i, s, cz, 4, qlevel);
+	}
+	lpc64_order(data, i, len, coeffs, order, qlevel);
+}
+
+static SIMD_KERNEL(lpc32_neon, lpc32_neon_body, lpc32_c)
+static SIMD_KERNEL(lpc64_neon, lpc64_neon_body, lpc64_c)
+
+#endif	/* LPC_NEON */
+
+#if defined(CPU_ARM) && !defined(LPC_NEON)
+static void lpc32_arm(int32_t *data, int len, const int *coeffs, int order, int qlevel)
+{
+	lpc_decode_arm(len - order, qlevel, order, data + order, (int *) coeffs);
+}
+#endif
+
+struct lpc_kernels {
+    const char *name;
+    flac_lpc_fn lpc32, lpc64;
+};
+
+/* Best first */
+static const struct lpc_kernels kernels[] = {
+#ifdef LPC_X86
+    { "avx2", lpc32_avx2, lpc64_avx2 },
+    { "sse4.1", lpc32_sse4, lpc64_sse4 },
+#endif
+#ifdef LPC_NEON
+    { "neon", lpc32_neon, lpc64_neon },
+#endif
+#if defined(CPU_ARM) && !defined(LPC_NEON)
+    { "armv7", lpc32_arm, lpc64_c },
+#endif
+    { "c", lpc32_c, lpc64_c },
+};
+
+#define NKERNELS	(sizeof(kernels) / sizeof(kernels[0]))
+
+static bool kernel_supported(const struct lpc_kernels *k)
+{
+#ifdef LPC_X86
+	__builtin_cpu_init();
+	if(k->lpc32 == lpc32_avx2) return __builtin_cpu_supports("avx2");
+	if(k->lpc32 == lpc32_sse4) return __builtin_cpu_supports("sse4.1");
+#endif
+#if defined(LPC_NEON) && defined(HWCAP_ASIMD)
+	if(k->lpc32 == lpc32_neon) return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#endif
+    return true;
+}
+
+static void lpc_select(void)
+{
+    int i;
+	for(i = 0; i < NKERNELS; i++) if(kernel_supported(&kernels[i])) break;
+	flac_lpc32 = kernels[i].lpc32;
+	flac_lpc64 = kernels[i].lpc64;
+	log_info("using %s lpc kernels", kernels[i].name);
+}
+
+void flac_lpc_init(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, lpc_select);
+}
+
+/* Restores a block of random residuals for each order with every supported kernel,
+   checks the result against scalar code and prints time per sample. */
+
+#define BENCH_BLOCK	4096
+#define BENCH_ROUNDS	400
+
+static double bench_one(flac_lpc_fn fn, const int32_t *res, int32_t *data, const int *coeffs, int order, int qlevel)
+{
+    struct timespec t0, t1;
+    double ns = 0;
+    int r;
+	for(r = 0; r < BENCH_ROUNDS; r++) {
+	    memcpy(data, res, BENCH_BLOCK * sizeof(int32_t));
+	    clock_gettime(CLOCK_MONOTONIC, &t0);
+	    fn(data, BENCH_BLOCK, coeffs, order, qlevel);
+	    clock_gettime(CLOCK_MONOTONIC, &t1);
+	    ns += (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	}
+    return ns / BENCH_ROUNDS / (BENCH_BLOCK - order);
+}
+
+int flac_lpc_bench(void)
+{
+    int32_t *res, *ref, *out;
+    int coeffs[LPC_MAX_ORDER];
+    int i, k, order, wide, bad = 0;
+    double t, tc;
+
+	res = malloc(BENCH_BLOCK * sizeof(int32_t));
+	ref = malloc(BENCH_BLOCK * sizeof(int32_t));
+	out = malloc(BENCH_BLOCK * sizeof(int32_t));
+	if(!res || !ref || !out) return -1;
+	srand(1);
+	for(wide = 0; wide < 2; wide++) {
+	    printf("%s accumulator, ns/sample (speedup):\norder\tc", wide ? "64-bit" : "32-bit");
+	    for(k = 0; k < NKERNELS - 1; k++) if(kernel_supported(&kernels[k])) printf("\t%s", kernels[k].name);
+	    printf("\n");
+	    for(order = 1; order <= LPC_MAX_ORDER; order++) {
+		/* small residuals and coefficients keep the restored signal bounded */
+		for(i = 0; i < BENCH_BLOCK; i++) res[i] = (rand() % 512) - 256;
+		for(i = 0; i < order; i++) res[i] = (rand() % (wide ? 1 << 22 : 1 << 14)) - (wide ? 1 << 21 : 1 << 13);
+		for(i = 0; i < order; i++) coeffs[i] = (rand() % (wide ? 8192 : 64)) - (wide ? 4096 : 32);
+		coeffs[0] = wide ? 1 << 14 : 1 << 6;
+		tc = bench_one(wide ? lpc64_c : lpc32_c, res, ref, coeffs, order, wide ? 14 : 6);
+		printf("%d\t%.2f", order, tc);
+		for(k = 0; k < NKERNELS - 1; k++) {
+		    if(!kernel_supported(&kernels[k])) continue;
+		    t = bench_one(wide ? kernels[k].lpc64 : kernels[k].lpc32, res, out, coeffs, order, wide ? 14 : 6);
+		    if(memcmp(out, ref, BENCH_BLOCK * sizeof(int32_t)) != 0) {
+			printf("\tMISMATCH");
+			bad++;
+		    } else printf("\t%.2f (%.1fx)", t, tc / t);
+		}
+		printf("\n");
+	    }
+	}
+	free(res);
+	free(ref);
+	free(out);
+    return bad;
+}
@@ -55,34 +55,70 @@
 
 #define MAX_SUPPORTED_SEEKTABLE_SIZE 5000
 
-static void flac_exit(FLACContext* fc)
+/*  Decoder buffers: the planes for the channels and block size given in STREAMINFO and
+    the seektable, all in one block. When a context is freed its block is parked in the
+    playback context and reused by the next track if large enough, so that track changes
+    do not fault in fresh pages. */
+
+struct flac_arena {
+    size_t size;
+};
+
+#define ARENA_ALIGN	64
+
+static struct flac_arena *arena_get(playback_ctx *ctx, size_t size)
+{
+    struct flac_arena *a = 0;
+	if(ctx) a = __atomic_exchange_n((struct flac_arena **) &ctx->flac_arena, 0, __ATOMIC_ACQ_REL);
+	if(a && a->size >= size) return a;
+	free(a);
+	if(posix_memalign((void **) &a, ARENA_ALIGN, ARENA_ALIGN + size) != 0) return 0;
+	a->size = size;
+    return a;
+}
+
+static void arena_put(playback_ctx *ctx, struct flac_arena *a)
+{
+	if(ctx) a = __atomic_exchange_n((struct flac_arena **) &ctx->flac_arena, a, __ATOMIC_ACQ_REL);
+	free(a);
+}
+
+void flac_arena_free(playback_ctx *ctx)
+{
+	arena_put(0, __atomic_exchange_n((struct flac_arena **) &ctx->flac_arena, 0, __ATOMIC_ACQ_REL));
+}
+
+static void flac_exit(playback_ctx *ctx, FLACContext* fc)
 {	
-    int i;
     if(fc) {
-	if(fc->seekpoints) free(fc->seekpoints);
-	for(i = 0; i < MAX_CHANNELS; i++) if(fc->decoded[i]) free(fc->decoded[i]);
+	if(fc->arena) arena_put(ctx, fc->arena);
 	free(fc);
     }
 }
 
-static FLACContext *flac_init(unsigned char *mmap_addr)
+static FLACContext *flac_init(playback_ctx *ctx, unsigned char *mmap_addr)
 {
     bool found_streaminfo = false;
     uint32_t seekpoint_hi,seekpoint_lo;
     uint32_t offset_hi,offset_lo;
     uint16_t blocksize, max_blocksize;
-    int k, endofmetadata = 0;
+    int k, endofmetadata = 0, seektable_len = 0;
     uint32_t blocklength;
     FLACContext *fc = 0;
-    unsigned char *mptr = mmap_addr, *c;
+    unsigned char *mptr = mmap_addr, *c, *seektable = 0;
+    size_t plane, seek_size;
+    char *mem;
 
+	flac_lpc_init();
+	flac_crc16_init();
 	fc = calloc(1, sizeof(FLACContext));
 	if(!fc) return fc;
+	fc->check_crc = flac_verify;
 
 	if(memcmp(mptr, "fLaC", 4) != 0) {
 	    if(memcmp(mptr, "ID3",3) !=0) {
 		log_err("flac signature not found");
-		flac_exit(fc);
+		flac_exit(ctx, fc);
 		return 0;
 	    }
 	    fc->metadatalength = 10;		/* ID3X[4]+len[6] */
@@ -93,7 +129,7 @@ static FLACContext *flac_init(unsigned char *mmap_addr)
 	    mptr += fc->metadatalength;		/* [len] */ 
 	    if(memcmp(mptr, "fLaC", 4) != 0) {
 		log_err("flac signature not found");
-		flac_exit(fc);
+		flac_exit(ctx, fc);
 		return 0;
 	    }
 	    fc->metadatalength += 4; /* fLaC[4]  */
@@ -101,23 +137,6 @@ static FLACContext *flac_init(unsigned char *mmap_addr)
 	
 	mptr += 4;	
 	
-	for(k = 0; k < MAX_CHANNELS; k++) {
-	    fc->decoded[k] = (int32_t *) calloc(MAX_BLOCKSIZE, sizeof(int32_t));
-	    if(!fc->decoded[k])	{
-		log_err("no memory for decoded blocks");
-		flac_exit(fc);
-		return 0;
-	    }	
-	}
-
-	fc->seekpoints = calloc(MAX_SUPPORTED_SEEKTABLE_SIZE, sizeof(struct FLACseekpoint));
-	if(!fc->seekpoints) {
-	    log_err("no memory for seekpoints");
-	    flac_exit(fc);
-	    return 0;
-	}
-
-
 	while(!endofmetadata) {
 
 	    endofmetadata = (mptr[0] & 0x80);
@@ -132,7 +151,7 @@ static FLACContext *flac_init(unsigned char *mmap_addr)
 
 		if(max_blocksize > MAX_BLOCKSIZE) {
 		    log_err("FLAC: Maximum blocksize is too large (%d > %d)\n", max_blocksize, MAX_BLOCKSIZE);
-		    flac_exit(fc);
+		    flac_exit(ctx, fc);
 		    return 0;
 		}
 
@@ -142,32 +161,24 @@ static FLACContext *flac_init(unsigned char *mmap_addr)
 		fc->samplerate = (mptr[10] << 12) | (mptr[11] << 4) | ((mptr[12] & 0xf0) >> 4);
 		fc->channels = ((mptr[12] & 0x0e) >> 1) + 1;
 		fc->bps = (((mptr[12] & 0x01) << 4) | ((mptr[13] & 0xf0) >> 4) ) + 1;
+		if(fc->channels > MAX_CHANNELS) {
+		    log_err("FLAC: too many channels (%d > %d)", fc->channels, MAX_CHANNELS);
+		    flac_exit(ctx, fc);
+		    return 0;
+		}
 
 		/* totalsamples is a 36-bit field, but we assume <= 32 bits are used */
 		fc->totalsamples = (mptr[14] << 24) | (mptr[15] << 16) | (mptr[16] << 8) | mptr[17];
+		memcpy(fc->md5, mptr + 18, 16);
 
 		/* Calculate track length (in ms) and estimate the bitrate (in kbit/s) */
 		fc->length = ((int64_t) fc->totalsamples * 1000) / fc->samplerate;
 		found_streaminfo = true;
 
 	    } else if((mptr[0] & 0x7f) == 3) {
-
 		mptr += 4;
-		for(k = 0; (fc->nseekpoints < MAX_SUPPORTED_SEEKTABLE_SIZE) && (k < blocklength); k += 18) {		
-		    c = mptr + k;	
-		    seekpoint_hi = (c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
-		    seekpoint_lo = (c[4] << 24) | (c[5] << 16) | (c[6] << 8) | c[7];
-		    offset_hi = (c[8] << 24) | (c[9] << 16) | (c[10] << 8) | c[11];
-		    offset_lo = (c[12] << 24) | (c[13] << 16) | (c[14] << 8) | c[15];
-		    blocksize = (c[16] << 8) | c[17];
-		    /* Only store seekpoints where the high 32 bits are zero */
-		    if((seekpoint_hi == 0) && (seekpoint_lo != 0xffffffff) && (offset_hi == 0)) {
-			fc->seekpoints[fc->nseekpoints].sample=seekpoint_lo;
-			fc->seekpoints[fc->nseekpoints].offset=offset_lo;
-			fc->seekpoints[fc->nseekpoints].blocksize=blocksize;
-			fc->nseekpoints++;
-		    }
-		}
+		seektable = mptr;	/* parsed once buffers are allocated */
+		seektable_len = blocklength;
 	    } else mptr += 4;
 
 	    mptr += blocklength;
@@ -175,16 +186,46 @@ static FLACContext *flac_init(unsigned char *mmap_addr)
 
 	if(!found_streaminfo) {
 	    log_err("streaminfo block not found\n");
-	    flac_exit(fc);
+	    flac_exit(ctx, fc);
+	    return 0;
+	}
+
+	/* frames larger than max_blocksize are rejected by the decoder */
+	plane = ((fc->max_blocksize * sizeof(int32_t)) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	k = seektable_len / 18;
+	if(k > MAX_SUPPORTED_SEEKTABLE_SIZE) k = MAX_SUPPORTED_SEEKTABLE_SIZE;
+	seek_size = k * sizeof(struct FLACseekpoint);
+	fc->arena = arena_get(ctx, fc->channels * plane + seek_size);
+	if(!fc->arena) {
+	    log_err("no memory for decoder buffers");
+	    flac_exit(ctx, fc);
 	    return 0;
 	}
+	mem = (char *) fc->arena + ARENA_ALIGN;
+	for(k = 0; k < fc->channels; k++) fc->decoded[k] = (int32_t *) (mem + k * plane);
+	fc->seekpoints = (struct FLACseekpoint *) (mem + fc->channels * plane);
+	flac_select_decoder(fc);
+
+	for(k = 0; seektable && (fc->nseekpoints < MAX_SUPPORTED_SEEKTABLE_SIZE) && (k + 18 <= seektable_len); k += 18) {		
+	    c = seektable + k;	
+	    seekpoint_hi = (c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
+	    seekpoint_lo = (c[4] << 24) | (c[5] << 16) | (c[6] << 8) | c[7];
+	    offset_hi = (c[8] << 24) | (c[9] << 16) | (c[10] << 8) | c[11];
+	    offset_lo = (c[12] << 24) | (c[13] << 16) | (c[14] << 8) | c[15];
+	    blocksize = (c[16] << 8) | c[17];
+	    /* Only store seekpoints where the high 32 bits are zero */
+	    if((seekpoint_hi == 0) && (seekpoint_lo != 0xffffffff) && (offset_hi == 0)) {
+		fc->seekpoints[fc->nseekpoints].sample=seekpoint_lo;
+		fc->seekpoints[fc->nseekpoints].offset=offset_lo;
+		fc->seekpoints[fc->nseekpoints].blocksize=blocksize;
+		fc->nseekpoints++;
+	    }
+	}
 
     return fc;
 }
 
 
-void yield() { }
-
 /* Synchronize to next frame in stream - adapted from libFLAC 1.1.3b2 */
 
 static bool frame_sync(FLACContext* fc, int fd, void *buff, int buff_size) 
@@ -221,14 +262,15 @@ static bool frame_sync(FLACContext* fc, int fd, void *buff, int buff_size)
 	/* Decode the frame to verify the frame crc and fill fc with its metadata. */
 	init_get_bits(&fc->gb, buff, buff_size * 8);
 
-	if(flac_decode_frame(fc, buff, buff_size, yield) < 0) return false;
+	if(flac_decode_frame(fc, buff, buff_size) < 0) return false;
 
     return true;
 
 }
 
 /* Seek to sample - adapted from libFLAC 1.1.3b2+ */
-static bool flac_seek(FLACContext* fc, int fd, uint32_t target_sample, void *bit_buffer, int buff_size) 
+static bool flac_seek(FLACContext* fc, int fd, uint32_t target_sample, void *bit_buffer, int buff_size,
+	const struct flac_index_point *lo, const struct flac_index_point *hi) 
 {
     off_t orig_pos, pos = -1;
     unsigned long lower_bound, upper_bound;
@@ -279,6 +321,16 @@ static bool flac_seek(FLACContext* fc, int fd, uint32_t target_sample, void *bit
         }
     }
 
+    /* Points of the frame index are exact frame offsets, use them if they are closer. */
+    if(lo && lo->sample != (uint64_t) -1 && lo->sample >= lower_bound_sample) {
+	lower_bound = lo->offset;
+	lower_bound_sample = lo->sample;
+    }
+    if(hi && hi->sample != (uint64_t) -1 && hi->sample <= upper_bound_sample) {
+	upper_bound = hi->offset;
+	upper_bound_sample = hi->sample;
+    }
+
     while(1) {
 
         /* Check if bounds are still ok. */
@@ -356,13 +408,116 @@ seek_err:
 /* 128 Mb not too much for 192/24 flacs, yeah? */
 #define MMAP_SIZE	(128*1024*1024)
 
+/* Next track prepared by prefetch thread: open, mapped and parsed, 
+   with the first frames decoded in planar form. */
+
+#define PREFETCH_FRAMES	8
+
+struct flac_prefetch {
+    playback_ctx *ctx;
+    int fd;
+    void *mm;
+    size_t map_len;
+    off_t flen;
+    FLACContext *fc;
+    int nframes;
+    int blocksize[PREFETCH_FRAMES];
+    int framelen[PREFETCH_FRAMES];	/* bytes in stream */
+    int decorrelation[PREFETCH_FRAMES];	/* still to be undone by pcm_convert() */
+    int32_t *decoded;			/* PREFETCH_FRAMES x channels x max_blocksize */
+};
+
+static void flac_prefetch_blocks_free(struct flac_prefetch *pf)
+{
+    if(pf->decoded) free(pf->decoded);
+    free(pf);
+}
+
+void flac_prefetch_free(void *data)
+{
+    struct flac_prefetch *pf = (struct flac_prefetch *) data;
+    if(pf->fc) flac_exit(pf->ctx, pf->fc);
+    if(pf->mm != MAP_FAILED) munmap(pf->mm, pf->map_len);
+    if(pf->fd >= 0) close(pf->fd);
+    flac_prefetch_blocks_free(pf);
+}
+
+void *flac_prefetch(playback_ctx *ctx, const char *file)
+{
+    struct flac_prefetch *pf;
+    FLACContext *fc;
+    unsigned char *mptr, *mend;
+    int i, k, c, bsz;
+
+	pf = (struct flac_prefetch *) calloc(1, sizeof(struct flac_prefetch));
+	if(!pf) return 0;
+	pf->ctx = ctx;
+	pf->mm = MAP_FAILED;
+	pf->fd = open(file, O_RDONLY);
+	if(pf->fd < 0) {
+	    log_err("cannot open %s", file);
+	    goto err_exit;
+	}
+	pf->flen = lseek(pf->fd, 0, SEEK_END);
+	if(pf->flen <= 0) goto err_exit;
+	lseek(pf->fd, 0, SEEK_SET);
+	pf->map_len = pf->flen > MMAP_SIZE ? MMAP_SIZE : pf->flen;
+	posix_fadvise(pf->fd, 0, pf->map_len, POSIX_FADV_WILLNEED);
+	pf->mm = mmap(0, pf->map_len, PROT_READ, MAP_SHARED, pf->fd, 0);
+	if(pf->mm == MAP_FAILED) {
+	    log_err("mmap failed for %s: %s", file, strerror(errno));	
+	    goto err_exit;
+	}
+	fc = pf->fc = flac_init(ctx, pf->mm);
+	if(!fc) goto err_exit;
+	fc->filesize = pf->flen;
+	fc->bitrate = ((int64_t) (fc->filesize - fc->metadatalength) * 8) / fc->length;
+
+	bsz = fc->max_blocksize ? fc->max_blocksize : MAX_BLOCKSIZE;
+	pf->decoded = (int32_t *) malloc(PREFETCH_FRAMES * fc->channels * bsz * sizeof(int32_t));
+	if(!pf->decoded) return pf;	/* parsing is still worth something */
+
+	mptr = pf->mm + fc->metadatalength;
+	mend = pf->mm + pf->map_len;
+	for(k = 0; k < PREFETCH_FRAMES && mptr < mend; k++) {
+	    i = (mend - mptr < MAX_FRAMESIZE) ? mend - mptr : MAX_FRAMESIZE;
+	    if(i < MAX_FRAMESIZE && pf->map_len != pf->flen) break;	/* needs remapping, leave it to flac_play */
+	    if(flac_decode_frame(fc, mptr, i) < 0 || fc->blocksize > bsz) break;
+	    for(c = 0; c < fc->channels; c++)
+		memcpy(pf->decoded + (k * fc->channels + c) * bsz, fc->decoded[c], fc->blocksize * sizeof(int32_t));
+	    pf->blocksize[k] = fc->blocksize;
+	    pf->framelen[k] = fc->gb.index/8;
+	    pf->decorrelation[k] = fc->decorrelation;
+	    mptr += pf->framelen[k];
+	}
+	pf->nframes = k;
+    return pf;
+
+    err_exit:
+	flac_prefetch_free(pf);
+    return 0;
+}
+
+static void verify_report(struct flac_verify *vf)
+{
+	switch(flac_verify_finish(vf, 1)) {
+	    case 0:
+		log_info("md5 ok");
+		break;
+	    case 1:
+		log_err("md5 mismatch, decoded audio differs from the original");
+		break;
+	    case 2:
+		log_err("stream length differs from streaminfo");
+		break;
+	}
+}
+
 int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int start)
 {
     int i, k, phys_bps, ret = 0, fd = -1;
     void *mptr, *mend, *mm = MAP_FAILED;
     FLACContext *fc = 0;
-    int32_t *src, *dst; 
-    int16_t *dst16;   
     void *pcmbuf = 0; 
     const char *file = 0;
     off_t flen = 0; 
@@ -372,6 +527,16 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
     int bsz, stride;   
     const playback_format_t *format;	
     struct timeval tstart, tstop, tdiff;
+    struct flac_prefetch *pf = 0;
+    int npf = 0, adv, c;
+    pipeline *pl = 0;
+    int32_t **planes, **dec, *own_planes[MAX_CHANNELS];
+    struct flac_par *par = 0;
+    struct flac_index *idx = 0;
+    struct flac_index_point lo, hi;
+    uint64_t cur_sample = 0, target;
+    int skip = 0;		/* samples to drop before start */
+    struct flac_verify *vf = 0;
 
 #ifdef ANDROID
 	file = (*env)->GetStringUTFChars(env,jfile,NULL);
@@ -384,6 +549,21 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
 #else
 	file = jfile;
 #endif
+	idx = flac_index_open(file);
+	if(!start) pf = (struct flac_prefetch *) prefetch_take(ctx, file, FORMAT_FLAC);
+	if(pf) {	/* already opened and parsed */
+	    log_info("using prepared track, %d frames decoded", pf->nframes);
+	    fd = pf->fd;
+	    mm = pf->mm;
+	    flen = pf->flen;
+	    cur_map_off = 0;
+	    cur_map_len = pf->map_len;
+	    fc = pf->fc;
+#ifdef ANDROID
+	    (*env)->ReleaseStringUTFChars(env,jfile,file);
+#endif
+	    goto parsed;
+	}
 	fd = open(file, O_RDONLY);
 	if(fd < 0) {
 	    log_err("cannot open %s", file);
@@ -410,7 +590,7 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
 #ifdef ANDROID
 	if(file) (*env)->ReleaseStringUTFChars(env,jfile,file);
 #endif
-	fc = flac_init(mm);
+	fc = flac_init(ctx, mm);
 	if(!fc) {
 	    ret = LIBLOSSLESS_ERR_INIT;
 	    goto done;	
@@ -419,8 +599,10 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
 	fc->filesize = flen;
 	fc->bitrate = ((int64_t) (fc->filesize - fc->metadatalength) * 8) / fc->length;
 
+    parsed:
 	ctx->samplerate = fc->samplerate;	/* ctx->samplerate may change after audio_start() */
 	ctx->channels = fc->channels;	
+	ctx->downmix = 1;
 	ctx->bps = fc->bps;
 	ctx->track_time = fc->totalsamples / fc->samplerate;
 	ctx->block_min = fc->min_blocksize;
@@ -440,21 +622,34 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
 		ret = LIBLOSSLESS_ERR_NOMEM;
 		goto done; 
 	    }
-	    lseek(fd, fc->metadatalength, SEEK_SET);	
-	    if(!flac_seek(fc, fd, start * fc->samplerate, bbuff, bsize)) {
-		if(!flac_seek(fc, fd, (start + 1) * fc->samplerate, bbuff, bsize)) {  /* helps sometimes */
-		    free(bbuff);
-		    ret = LIBLOSSLESS_ERR_OFFSET;
-		    log_err("seek to %d sec failed", start);
-		    goto done; 
+	    target = (uint64_t) start * fc->samplerate;
+	    if(idx && flac_index_find(idx, target, &lo, &hi)) {	/* frame known, no search needed */
+		off = lo.offset;
+		cur_sample = lo.sample;
+		skip = target - lo.sample;
+		log_info("indexed seek to frame at %" PRIu64, cur_sample);
+	    } else {
+		lseek(fd, fc->metadatalength, SEEK_SET);	
+		if(!flac_seek(fc, fd, target, bbuff, bsize, idx ? &lo : 0, idx ? &hi : 0)) {
+		    target += fc->samplerate;
+		    if(idx) flac_index_find(idx, target, &lo, &hi);
+		    if(!flac_seek(fc, fd, target, bbuff, bsize, idx ? &lo : 0, idx ? &hi : 0)) {  /* helps sometimes */
+			free(bbuff);
+			ret = LIBLOSSLESS_ERR_OFFSET;
+			log_err("seek to %d sec failed", start);
+			goto done; 
+		    }
 		}
+		off = lseek(fd, 0, SEEK_CUR);
+		cur_sample = fc->samplenumber;
+		skip = fc->sample_skip;
 	    }
 	    free(bbuff);
 	    munmap(mm, cur_map_len);
-	    off = lseek(fd, 0, SEEK_CUR);
 	    if(alsa_is_offload(ctx)) {
-		flac_exit(fc);
+		flac_exit(ctx, fc);
 		munmap(mm, cur_map_len);
+		if(idx) flac_index_close(idx);
 		log_info("switching to offload playback");
 		update_track_time(env, obj, ctx->track_time);
 		return alsa_play_offload(ctx,fd,off);
@@ -472,8 +667,10 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
 	} else {
 	    if(alsa_is_offload(ctx)) {
 		off = fc->metadatalength;
-		flac_exit(fc);
+		if(pf) flac_prefetch_blocks_free(pf);
+		flac_exit(ctx, fc);
 		munmap(mm, cur_map_len);
+		if(idx) flac_index_close(idx);
 		log_info("switching to offload playback");
 		update_track_time(env, obj, ctx->track_time);
 		return alsa_play_offload(ctx,fd,off);
@@ -488,8 +685,8 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
 	format = alsa_get_format(ctx);		/* format selected in alsa_start() */
 	phys_bps = format->phys_bits;
 
-	if(!ctx->block_write) {	
-	    pcmbuf = malloc(fc->channels * (phys_bps/8) * MAX_BLOCKSIZE);
+	if(alsa_is_mmapped(ctx)) {	/* otherwise, decode into block or ring buffer directly */
+	    pcmbuf = malloc(fc->channels * (phys_bps/8) * fc->max_blocksize);
 	    if(!pcmbuf) {
 		log_err("no memory");
 		ret = LIBLOSSLESS_ERR_NOMEM;	
@@ -497,6 +694,13 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
 	    }
 	}
 
+	if(flac_verify && !start) vf = flac_verify_start(fc, 1);	/* md5 needs the whole stream */
+	par = flac_par_start(ctx, fc);
+	if(ctx->block_write && !par) {	/* with parallel decoding, conversion stays on this thread */
+	    pl = pipeline_start(ctx, fc->channels, fc->max_blocksize, ctx->block_min >> ctx->rate_dec);
+	    if(pl) memcpy(own_planes, fc->decoded, sizeof(own_planes));	/* decoder writes straight into pipeline blocks */
+	}
+
 	update_track_time(env, obj, ctx->track_time);
 	gettimeofday(&tstart,0);
 
@@ -520,20 +724,77 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
 		log_info("remapped");
 	    }
 
-	    k = flac_decode_frame(fc, mptr, i, yield);
+	    if(pl) {
+		planes = pipeline_request(pl);
+		if(!planes) {
+		    log_info("pipeline stopped");
+		    goto done;
+		}
+		for(c = 0; c < fc->channels; c++) fc->decoded[c] = planes[c];
+	    }
+
+	    dec = fc->decoded;
+	    decode_begin(ctx);
+	    if(pf && npf < pf->nframes) {	/* frames decoded in advance */
+		int max = fc->max_blocksize ? fc->max_blocksize : MAX_BLOCKSIZE;
+		for(c = 0; c < fc->channels; c++)
+		    memcpy(fc->decoded[c], pf->decoded + (npf * fc->channels + c) * max, pf->blocksize[npf] * sizeof(int32_t));
+		fc->blocksize = pf->blocksize[npf];
+		fc->decorrelation = pf->decorrelation[npf];
+		adv = pf->framelen[npf++];
+		k = 0;
+	    } else if(par && (k = flac_par_next(par, mptr, mend, cur_map_off + cur_map_len == flen, &dec, &adv)) != 0) {
+		if(k > 0) k = 0;
+	    } else {
+		k = flac_decode_frame(fc, mptr, i);
+		adv = fc->gb.index/8;
+	    }
+	    decode_end(ctx);
 	    if(k < 0) {
 		if(cur_map_off + cur_map_len == flen && (unsigned int) (mend - mptr) < 0x2000) {
 		    log_info("garbage at EOF skipped");
+		    if(idx) flac_index_end(idx, cur_sample, cur_map_off + (mptr - mm));
+		    if(vf) verify_report(vf);
+		    vf = 0;
 		    goto done;	
 		}
+		if(k == -19) log_err("crc error in frame at offset %lld", (long long) (cur_map_off + (mptr - mm)));
 		log_err("decoder error %d", k);
 		ret = LIBLOSSLESS_ERR_DECODE;
 		goto done;
 	    }
+	    if(vf) flac_verify_frame(vf, dec, fc->blocksize, fc->decorrelation);
+	    if(idx) flac_index_add(idx, cur_sample, cur_map_off + (mptr - mm));
+	    cur_sample += fc->blocksize;
+
+	    if(skip) {	/* after seek: drop samples before the target */
+		if(skip >= fc->blocksize) {
+		    skip -= fc->blocksize;
+		    mptr += adv;
+		    continue;
+		}
+		if(!ctx->block_write) {	/* blocks are padded up to block_min, keep them whole */
+		    for(c = 0; c < fc->channels; c++) memmove(dec[c], dec[c] + skip, (fc->blocksize - skip) * sizeof(int32_t));
+		    fc->blocksize -= skip;
+		}
+		skip = 0;
+	    }
 
 	    bsz = (fc->blocksize >> ctx->rate_dec);
 	    stride = (1 << ctx->rate_dec);	
 
+	    if(pl) {
+		if(bsz > (ctx->block_max >> ctx->rate_dec)) {
+		    log_err("decoder returned too large buffer: size=%d (max=%d)", bsz,
+			ctx->block_max >> ctx->rate_dec); 
+		    ret = LIBLOSSLESS_ERR_DECODE;
+		    goto done;
+		}
+		pipeline_commit(pl, bsz, stride, fc->decorrelation);
+		mptr += adv;
+		continue;
+	    }
+
 	    if(ctx->block_write) {
 		if(bsz > (ctx->block_max >> ctx->rate_dec)) {
 		    log_err("decoder returned too large buffer: size=%d (max=%d)", bsz,
@@ -546,75 +807,30 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
 		    log_err("request for decoding buffer failed, should be stopped");
 		    goto done;
 		}
+	    } else if(!alsa_is_mmapped(ctx)) {
+		pcmbuf = audio_reserve(ctx, bsz * ctx->channels * (phys_bps/8));
+		if(!pcmbuf) {
+		    if(ctx->alsa_error) ret = LIBLOSSLESS_ERR_IO_WRITE;
+		    log_info("exiting, alsa_error=%d", ctx->alsa_error);
+		    break;
+		}
 	    }
  
-	    switch(format->fmt) {
-
-		case SNDRV_PCM_FORMAT_S32_LE:
-		    for(i = 0; i < fc->channels; i++) {
-			src = fc->decoded[i];
-			dst = (int32_t *) pcmbuf + i;
-			for(k = 0; k < bsz; k++)  {
-			    *dst = *src;
-			     dst += fc->channels;
-			     src += stride;
-			}
-		    }
-		    break;	
-
-		case SNDRV_PCM_FORMAT_S24_3LE:
-		    for(i = 0; i < fc->channels; i++) {
-			uint8_t *dst8 = (uint8_t *) pcmbuf + i * 3;
-			src = fc->decoded[i];
-			for(k = 0; k < bsz; k++) {
-			     uint32_t y = (uint32_t) *src; 
-			     dst8[0] = (uint8_t) y;
-			     dst8[1] = (uint8_t) (y >> 8);
-			     dst8[2] = (uint8_t) (y >> 16);
-			     dst8 += fc->channels * 3;
-			     src += stride;
-			}
-		    }
-		    break;
-
-		case SNDRV_PCM_FORMAT_S24_LE:
-		    for(i = 0; i < fc->channels; i++) {
-			src = fc->decoded[i];
-			dst = (int32_t *) pcmbuf + i;
-			for(k = 0; k < bsz; k++) {
-			    *dst = *src;
-			     dst += fc->channels;
-			     src += stride;	
-			}
-		    }
-		    break;
-
-		case SNDRV_PCM_FORMAT_S16_LE:		
-		    for(i = 0; i < fc->channels; i++) {
-			src = fc->decoded[i];
-			dst16 = (int16_t *) pcmbuf + i;
-		    	for(k = 0; k < bsz; k++) {
-			    *dst16 = (int16_t) *src;
-			     dst16 += fc->channels;
-			     src += stride;	
-			}
-		    }
-		    break;	
-		default:
-		    log_err("internal error: format not supported");
-		    ret = LIBLOSSLESS_ERR_INIT;
-		    goto done; 	
-	     }
+	    if(pcm_convert(format, dec, fc->channels, ctx->channels, bsz, stride, fc->decorrelation, ctx->dmx, pcmbuf) < 0) {
+		log_err("internal error: format not supported");
+		ret = LIBLOSSLESS_ERR_INIT;
+		goto done;
+	    }
 	     if(ctx->block_write) {	
 		if(bsz < (ctx->block_min >> ctx->rate_dec)) {
 		    log_info("short buffer, should be eof");
-		    memset(pcmbuf + bsz * fc->channels * (phys_bps/8), 0, 
-			((ctx->block_min >> ctx->rate_dec) - bsz) * fc->channels * (phys_bps/8) );	
+		    memset(pcmbuf + bsz * ctx->channels * (phys_bps/8), 0, 
+			((ctx->block_min >> ctx->rate_dec) - bsz) * ctx->channels * (phys_bps/8) );	
 		}
 		blk_buffer_commit_decoding(ctx->blk_buff);
 	     } else {	
-		if(!alsa_is_mmapped(ctx)) bsz *= fc->channels * (phys_bps/8); /* need bytes rather than frames */
-		i = audio_write(ctx, pcmbuf, bsz);
+		if(alsa_is_mmapped(ctx)) i = audio_write(ctx, pcmbuf, bsz);
+		else i = audio_commit(ctx, bsz * ctx->channels * (phys_bps/8)); /* need bytes rather than frames */
 		if(i < 0) {
 		    if(ctx->alsa_error) ret = LIBLOSSLESS_ERR_IO_WRITE;
 		    log_info("exiting, alsa_error=%d", ctx->alsa_error);
@@ -623,13 +839,26 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
 	    }	
 
 
-	    mptr += fc->gb.index/8; /* step over the bytes consumed by flac_decode_frame() */	
+	    mptr += adv; /* step over the bytes consumed by flac_decode_frame() */	
 
 	} /* while(mptr < mend) */
+	if(mptr >= mend && cur_map_off + cur_map_len == flen) {
+	    if(idx) flac_index_end(idx, cur_sample, flen);
+	    if(vf) verify_report(vf);
+	    vf = 0;
+	}
 
     done:
-	if(fc) flac_exit(fc);
-	if(!ctx->block_write && pcmbuf) free(pcmbuf);
+	if(vf) flac_verify_finish(vf, 0);
+	if(idx) flac_index_close(idx);
+	if(par) flac_par_free(par);
+	if(pl) {
+	    pipeline_finish(pl, ret != 0);
+	    memcpy(fc->decoded, own_planes, sizeof(own_planes));
+	}
+	if(pf) flac_prefetch_blocks_free(pf);
+	if(fc) flac_exit(ctx, fc);
+	if(alsa_is_mmapped(ctx) && pcmbuf) free(pcmbuf);
 	if(fd >= 0) close(fd);
 	if(mm != MAP_FAILED) munmap(mm, cur_map_len);
 	if(ret == 0) {
@@ -643,6 +872,73 @@ int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int st
 }
 
 
+/* Decodes the whole file checking the crc of every frame and the md5 of the stream.
+   Returns 0 if it is intact, 1 if corrupt, negative if it could not be read; the
+   outcome is described in msg. */
+int flac_verify_file(const char *file, char *msg, int size)
+{
+    int fd, k, ret = -1;
+    off_t flen;
+    uint8_t *mm = MAP_FAILED, *mptr, *mend;
+    FLACContext *fc = 0;
+    struct flac_verify *vf = 0;
+    uint64_t samples = 0;
+
+	fd = open(file, O_RDONLY);
+	if(fd < 0) {
+	    snprintf(msg, size, "cannot open: %s", strerror(errno));
+	    return -1;
+	}
+	flen = lseek(fd, 0, SEEK_END);
+	if(flen > 0) mm = mmap(0, flen, PROT_READ, MAP_SHARED, fd, 0);
+	if(mm == MAP_FAILED) {
+	    snprintf(msg, size, "cannot map");
+	    goto done;
+	}
+	fc = flac_init(0, mm);
+	if(!fc) {
+	    snprintf(msg, size, "not a flac stream");
+	    goto done;
+	}
+	fc->check_crc = 1;
+	vf = flac_verify_start(fc, 0);
+	mptr = mm + fc->metadatalength;
+	mend = mm + flen;
+	ret = 1;
+	while(mptr < mend && (fc->totalsamples == 0 || samples < fc->totalsamples)) {
+	    k = flac_decode_frame(fc, mptr, (mend - mptr < MAX_FRAMESIZE) ? mend - mptr : MAX_FRAMESIZE);
+	    if(k < 0) {
+		if(fc->totalsamples == 0 && mend - mptr < 0x2000) break;	/* garbage at eof */
+		snprintf(msg, size, "%s at offset %lld", k == -19 ? "crc error" : "decoder error",
+		    (long long) (mptr - mm));
+		goto done;
+	    }
+	    if(vf) flac_verify_frame(vf, fc->decoded, fc->blocksize, fc->decorrelation);
+	    samples += fc->blocksize;
+	    mptr += fc->framesize;
+	}
+	if(fc->totalsamples && samples != fc->totalsamples) {
+	    snprintf(msg, size, "%" PRIu64 " samples, %lu expected", samples, fc->totalsamples);
+	    goto done;
+	}
+	if(vf) {
+	    k = flac_verify_finish(vf, 1);
+	    vf = 0;
+	    if(k != 0) {
+		snprintf(msg, size, "md5 mismatch");
+		goto done;
+	    }
+	    snprintf(msg, size, "md5 ok");
+	} else snprintf(msg, size, "frame crc ok, no md5");
+	ret = 0;
+    done:
+	if(vf) flac_verify_finish(vf, 0);
+	if(fc) flac_exit(0, fc);
+	if(mm != MAP_FAILED) munmap(mm, flen);
+	close(fd);
+    return ret;
+}
+
 #ifdef ANDROID
 #ifdef SWAP32
 #undef SWAP32
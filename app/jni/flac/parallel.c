@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifdef ANDROID
+#include <android/log.h>
+#endif
+#include <jni_sub.h>
+#define __force
+#define __bitwise
+#define __user
+#include <sound/asound.h>
+
+#include "flac/decoder.h"
+#include "main.h"
+
+/*  Frame-parallel decoding. Frames are independent, so once their boundaries are known
+    they can be decoded by several threads at once. The playback thread scans ahead of its
+    cursor for frame headers (sync code, header crc and the expected frame/sample number)
+    and queues each frame to a pool of workers; each worker has its own FLACContext and
+    decodes into the planar buffers of the job. Jobs are handed back to the playback thread
+    strictly in stream order. Scanning never crosses the end of the mapped region unless it
+    is the end of file, so flac_play() may remap once everything queued has been consumed. */
+
+#define PAR_MAX_WORKERS	4
+#define PAR_JOBS_PER_WORKER	3
+#define PAR_MAX_JOBS	(PAR_MAX_WORKERS * PAR_JOBS_PER_WORKER)
+
+/* Worth it if one core might not keep up: 24/96 stereo or more */
+#define PAR_AUTO_RATE	(96000 * 2 * 24)
+
+struct flac_job {
+    uint8_t *buf;
+    int len;
+    int ret, blocksize;
+    enum decorrelation_type decorrelation;
+    int done;
+    int32_t *planes[MAX_CHANNELS];
+};
+
+struct flac_par;
+
+struct flac_worker {
+    struct flac_par *par;
+    FLACContext fc;		/* own copy, decoded[] point to current job */
+    pthread_t thread;
+};
+
+struct flac_par {
+    playback_ctx *ctx;
+    FLACContext *fc;		/* playback thread's context */
+    struct flac_worker workers[PAR_MAX_WORKERS];
+    int nworkers, njobs;
+    struct flac_job jobs[PAR_MAX_JOBS];
+    int32_t *mem;
+    unsigned int submit, take, emit;	/* job sequence numbers */
+    int held;			/* job at emit is still being used by caller */
+    uint8_t *scan;		/* start of the next frame to queue */
+    uint64_t next_num;		/* its frame or sample number */
+    int quit;
+    pthread_mutex_t mutex;
+    pthread_cond_t work, done;
+};
+
+int flac_threads = -1;
+
+static const int blocksize_table[16] = {
+     0,    192, 576<<0, 576<<1, 576<<2, 576<<3,      0,      0,
+256<<0, 256<<1, 256<<2, 256<<3, 256<<4, 256<<5, 256<<6, 256<<7
+};
+
+static int crc8(const uint8_t *p, int n)
+{
+    int i, crc = 0;
+	while(n--) {
+	    crc ^= *p++;
+	    for(i = 0; i < 8; i++) crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) & 0xff : (crc << 1) & 0xff;
+	}
+    return crc;
+}
+
+/* Checks that a valid frame header for this stream starts at p.
+   Returns its coded frame (or sample) number and block size. */
+static bool frame_header(const FLACContext *fc, const uint8_t *p, const uint8_t *end, uint64_t *num, int *blocksize)
+{
+    const uint8_t *q = p + 4;
+    int bs_code, sr_code, ch, ss, ones, bs;
+    uint64_t v;
+
+	if(end - p < 6 || p[0] != 0xff || (p[1] & 0xfe) != 0xf8) return false;
+	bs_code = p[2] >> 4;
+	sr_code = p[2] & 15;
+	ch = p[3] >> 4;
+	ss = (p[3] >> 1) & 7;
+	if(bs_code == 0 || sr_code == 15 || ss == 3 || ss == 7 || (p[3] & 1)) return false;
+	if(ch < 8) {
+	    if(ch + 1 != fc->channels) return false;
+	} else if(ch > 10 || fc->channels != 2) return false;
+
+	for(ones = 0; ones < 8 && (*q & (0x80 >> ones)); ones++) ;
+	if(ones == 1 || ones > 7) return false;
+	v = *q++ & (0x7f >> ones);
+	for(ones = ones ? ones - 1 : 0; ones; ones--, q++) {
+	    if(q >= end || (*q & 0xc0) != 0x80) return false;
+	    v = (v << 6) | (*q & 0x3f);
+	}
+	if(bs_code == 6) bs = (q < end) ? *q++ + 1 : 0;
+	else if(bs_code == 7) {
+	    bs = (q + 1 < end) ? ((q[0] << 8) | q[1]) + 1 : 0;
+	    q += 2;
+	} else bs = blocksize_table[bs_code];
+	if(sr_code == 12) q++;
+	else if(sr_code == 13 || sr_code == 14) q += 2;
+	if(q >= end || bs == 0 || bs > fc->max_blocksize) return false;
+	if(crc8(p, q - p) != *q) return false;
+	*num = v;
+	*blocksize = bs;
+    return true;
+}
+
+/* Returns length of the frame at p, or 0 if it cannot be determined within [p, end) */
+static int scan_frame(struct flac_par *par, uint8_t *p, uint8_t *end, int eof)
+{
+    uint64_t num, next, n;
+    int bs, nbs;
+    uint8_t *q;
+
+	if(!frame_header(par->fc, p, end, &num, &bs)) return 0;
+	if(par->emit != par->submit && num != par->next_num) return 0;
+	next = (p[1] & 1) ? num + bs : num + 1;	/* variable or fixed block size stream */
+	for(q = p + 2; q < end - 1; q++) {
+	    q = memchr(q, 0xff, end - 1 - q);
+	    if(!q) break;
+	    if(q[1] != p[1]) continue;
+	    if(frame_header(par->fc, q, end, &n, &nbs) && n == next) {
+		par->next_num = next;
+		return q - p;
+	    }
+	}
+	if(!eof) return 0;
+	par->next_num = next;
+    return end - p;
+}
+
+static void *worker(void *a)
+{
+    struct flac_worker *w = (struct flac_worker *) a;
+    struct flac_par *par = w->par;
+    struct flac_job *job;
+    struct schedset ss = *alsa_get_schedset(par->ctx);
+    int c;
+
+	ss.decoder_cpu = -1;	/* spread over all cores */
+	sched_apply(&ss, 0);
+	pthread_mutex_lock(&par->mutex);
+	while(!par->quit) {
+	    if(par->take == par->submit) {
+		pthread_cond_wait(&par->work, &par->mutex);
+		continue;
+	    }
+	    job = &par->jobs[par->take++ % par->njobs];
+	    pthread_mutex_unlock(&par->mutex);
+	    for(c = 0; c < w->fc.channels; c++) w->fc.decoded[c] = job->planes[c];
+	    job->ret = flac_decode_frame(&w->fc, job->buf, job->len);
+	    job->blocksize = w->fc.blocksize;
+	    job->decorrelation = w->fc.decorrelation;
+	    pthread_mutex_lock(&par->mutex);
+	    job->done = 1;
+	    pthread_cond_broadcast(&par->done);
+	}
+	pthread_mutex_unlock(&par->mutex);
+    return 0;
+}
+
+/* Returns zero if parallel decoding is off or not worth it for this stream */
+struct flac_par *flac_par_start(playback_ctx *ctx, FLACContext *fc)
+{
+    struct flac_par *par;
+    int i, c, n = flac_threads, ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t plane = (fc->max_blocksize + 15) & ~15;
+
+	if(n < 0) {
+	    if(ncpu < 2 || (int64_t) fc->samplerate * fc->channels * fc->bps < PAR_AUTO_RATE) return 0;
+	    n = ncpu;
+	}
+	if(n == 0) return 0;
+	if(n > PAR_MAX_WORKERS) n = PAR_MAX_WORKERS;
+
+	par = (struct flac_par *) calloc(1, sizeof(struct flac_par));
+	if(!par) return 0;
+	par->ctx = ctx;
+	par->fc = fc;
+	par->njobs = n * PAR_JOBS_PER_WORKER;
+	par->mem = (int32_t *) malloc(par->njobs * fc->channels * plane * sizeof(int32_t));
+	if(!par->mem) {
+	    log_err("no memory");
+	    free(par);
+	    return 0;
+	}
+	for(i = 0; i < par->njobs; i++)
+	    for(c = 0; c < fc->channels; c++) par->jobs[i].planes[c] = par->mem + (i * fc->channels + c) * plane;
+	pthread_mutex_init(&par->mutex, 0);
+	pthread_cond_init(&par->work, 0);
+	pthread_cond_init(&par->done, 0);
+	for(i = 0; i < n; i++) {
+	    struct flac_worker *w = &par->workers[i];
+	    w->par = par;
+	    w->fc = *fc;
+	    w->fc.seekpoints = 0;
+	    w->fc.nseekpoints = 0;
+	    memset(w->fc.decoded, 0, sizeof(w->fc.decoded));
+	    if(pthread_create(&w->thread, 0, worker, w) != 0) break;
+	}
+	par->nworkers = i;
+	if(i == 0) {
+	    log_err("cannot start decoder threads");
+	    flac_par_free(par);
+	    return 0;
+	}
+	log_info("%d decoder threads", par->nworkers);
+    return par;
+}
+
+void flac_par_free(struct flac_par *par)
+{
+    int i;
+	pthread_mutex_lock(&par->mutex);
+	par->quit = 1;
+	pthread_cond_broadcast(&par->work);
+	pthread_mutex_unlock(&par->mutex);
+	for(i = 0; i < par->nworkers; i++) pthread_join(par->workers[i].thread, 0);
+	pthread_mutex_destroy(&par->mutex);
+	pthread_cond_destroy(&par->work);
+	pthread_cond_destroy(&par->done);
+	free(par->mem);
+	free(par);
+}
+
+/* To be called with mutex locked */
+static void wait_done(struct flac_par *par, struct flac_job *job)
+{
+	while(!job->done) pthread_cond_wait(&par->done, &par->mutex);
+}
+
+/* Returns the frame at mptr: 1 with its planar samples in *planes, block size and
+   decorrelation in the playback context and the frame length in *len; 0 if it could
+   not be queued, so that the caller should decode it by itself; negative on decoder
+   error. The planes are valid until the next call. */
+int flac_par_next(struct flac_par *par, void *mptr, void *mend, int eof, int32_t ***planes, int *len)
+{
+    struct flac_job *job;
+    uint8_t *end = (uint8_t *) mend;
+    int n;
+
+	pthread_mutex_lock(&par->mutex);
+	if(par->held) {
+	    par->emit++;
+	    par->held = 0;
+	}
+	if(par->emit != par->submit && par->jobs[par->emit % par->njobs].buf != mptr) {
+	    log_info("cursor moved, dropping queued frames");
+	    for(; par->emit != par->submit; par->emit++) wait_done(par, &par->jobs[par->emit % par->njobs]);
+	}
+	if(par->emit == par->submit) par->scan = mptr;
+	pthread_mutex_unlock(&par->mutex);
+
+	while(par->submit - par->emit < par->njobs) {
+	    if(!eof && end - par->scan < MAX_FRAMESIZE) break;	/* leave it for remapping */
+	    n = scan_frame(par, par->scan, end, eof);
+	    if(n <= 0) break;
+	    job = &par->jobs[par->submit % par->njobs];
+	    job->buf = par->scan;
+	    job->len = n;
+	    job->done = 0;
+	    par->scan += n;
+	    pthread_mutex_lock(&par->mutex);
+	    par->submit++;
+	    pthread_cond_signal(&par->work);
+	    pthread_mutex_unlock(&par->mutex);
+	}
+
+	pthread_mutex_lock(&par->mutex);
+	if(par->emit == par->submit) {
+	    pthread_mutex_unlock(&par->mutex);
+	    return 0;
+	}
+	job = &par->jobs[par->emit % par->njobs];
+	wait_done(par, job);
+	par->held = 1;
+	pthread_mutex_unlock(&par->mutex);
+	if(job->ret < 0) return job->ret;
+	*planes = job->planes;
+	*len = job->len;
+	par->fc->blocksize = job->blocksize;
+	par->fc->decorrelation = job->decorrelation;
+    return 1;
+}
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifdef ANDROID
+#include <android/log.h>
+#endif
+#include <jni_sub.h>
+#define __force
+#define __bitwise
+#define __user
+#include <sound/asound.h>
+
+#include "flac/decoder.h"
+#include "main.h"
+
+/*  Verification of decoded audio: the crc-16 in the footer of every frame, checked by
+    the decoder, and the md5 of the whole stream given in STREAMINFO. The md5 is taken
+    over the samples as stored in the original file: decorrelated, interleaved, signed
+    little-endian in (bps+7)/8 bytes. During playback frames are copied to a helper
+    thread which does the packing and hashing, so that the decoder is not held up. */
+
+int flac_verify = 0;
+
+#define VERIFY_SLOTS	8
+
+/* crc-16, polynomial 0x8005, msb first, 8 bytes per step: crc_tab[k][b] is the crc of
+   byte b followed by k zero bytes */
+
+static uint16_t crc_tab[8][256];
+
+static void crc_tab_init(void)
+{
+    int b, k, crc;
+	for(b = 0; b < 256; b++) {
+	    crc = b << 8;
+	    for(k = 0; k < 8; k++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+	    crc_tab[0][b] = crc;
+	}
+	for(k = 1; k < 8; k++)
+	    for(b = 0; b < 256; b++)
+		crc_tab[k][b] = (crc_tab[k-1][b] << 8) ^ crc_tab[0][crc_tab[k-1][b] >> 8];
+}
+
+void flac_crc16_init(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, crc_tab_init);
+}
+
+int flac_crc16(const uint8_t *p, int len)
+{
+    unsigned int crc = 0;
+	for(; len >= 8; len -= 8, p += 8) {
+	    crc = crc_tab[7][p[0] ^ (crc >> 8)] ^ crc_tab[6][p[1] ^ (crc & 0xff)]
+		^ crc_tab[5][p[2]] ^ crc_tab[4][p[3]] ^ crc_tab[3][p[4]]
+		^ crc_tab[2][p[5]] ^ crc_tab[1][p[6]] ^ crc_tab[0][p[7]];
+	}
+	while(len--) crc = ((crc << 8) & 0xffff) ^ crc_tab[0][*p++ ^ (crc >> 8)];
+    return crc;
+}
+
+/* md5, RFC 1321 */
+
+struct md5 {
+    uint32_t h[4];
+    uint64_t len;
+    uint8_t buf[64];
+};
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_block(struct md5 *m, const uint8_t *p)
+{
+    uint32_t w[16], a = m->h[0], b = m->h[1], c = m->h[2], d = m->h[3], f, t;
+    int i, g;
+	for(i = 0; i < 16; i++) w[i] = p[4*i] | (p[4*i+1] << 8) | (p[4*i+2] << 16) | ((uint32_t) p[4*i+3] << 24);
+	for(i = 0; i < 64; i++) {
+	    if(i < 16) {
+		f = (b & c) | (~b & d);
+		g = i;
+	    } else if(i < 32) {
+		f = (d & b) | (~d & c);
+		g = (5 * i + 1) & 15;
+	    } else if(i < 48) {
+		f = b ^ c ^ d;
+		g = (3 * i + 5) & 15;
+	    } else {
+		f = c ^ (b | ~d);
+		g = (7 * i) & 15;
+	    }
+	    t = d;
+	    d = c;
+	    c = b;
+	    f += a + md5_k[i] + w[g];
+	    b += (f << md5_r[i]) | (f >> (32 - md5_r[i]));
+	    a = t;
+	}
+	m->h[0] += a;
+	m->h[1] += b;
+	m->h[2] += c;
+	m->h[3] += d;
+}
+
+static void md5_init(struct md5 *m)
+{
+	m->h[0] = 0x67452301;
+	m->h[1] = 0xefcdab89;
+	m->h[2] = 0x98badcfe;
+	m->h[3] = 0x10325476;
+	m->len = 0;
+}
+
+static void md5_update(struct md5 *m, const uint8_t *p, size_t n)
+{
+    int k = m->len & 63;
+	m->len += n;
+	if(k) {
+	    int r = 64 - k;
+	    if(n < r) {
+		memcpy(m->buf + k, p, n);
+		return;
+	    }
+	    memcpy(m->buf + k, p, r);
+	    md5_block(m, m->buf);
+	    p += r;
+	    n -= r;
+	}
+	for(; n >= 64; n -= 64, p += 64) md5_block(m, p);
+	memcpy(m->buf, p, n);
+}
+
+static void md5_final(struct md5 *m, uint8_t *out)
+{
+    uint8_t pad[72] = { 0x80 };
+    uint64_t bits = m->len * 8;
+    int i, k = m->len & 63, n = (k < 56) ? 56 - k : 120 - k;
+	for(i = 0; i < 8; i++) pad[n + i] = bits >> (8 * i);
+	md5_update(m, pad, n + 8);
+	for(i = 0; i < 16; i++) out[i] = m->h[i / 4] >> (8 * (i & 3));
+}
+
+struct verify_slot {
+    int32_t *planes[MAX_CHANNELS];
+    int blocksize, decorr;
+};
+
+struct flac_verify {
+    int channels, bytes;	/* per sample */
+    uint64_t samples, total;
+    uint8_t expect[16];
+    struct md5 md5;
+    uint8_t *pack;		/* one frame, packed */
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t work, room;
+    struct verify_slot slots[VERIFY_SLOTS];
+    unsigned int put, get;
+    int quit;
+    int32_t *mem;
+};
+
+/* Packs a frame as stored in the file and adds it to the md5 */
+static void hash_frame(struct flac_verify *v, int32_t **planes, int blocksize, int decorr)
+{
+    uint8_t *d = v->pack;
+    int32_t x, a, b;
+    int i, c, k;
+	for(i = 0; i < blocksize; i++) {
+	    for(c = 0; c < v->channels; c++) {
+		x = planes[c][i];
+		if(v->channels == 2 && decorr != DECORR_NONE) {
+		    a = planes[0][i];
+		    b = planes[1][i];
+		    switch(decorr) {
+			case DECORR_LEFT_SIDE:
+			    x = c ? a - b : a;
+			    break;
+			case DECORR_RIGHT_SIDE:
+			    x = c ? b : a + b;
+			    break;
+			case DECORR_MID_SIDE:
+			    a -= b >> 1;
+			    x = c ? a : a + b;
+			    break;
+		    }
+		}
+		for(k = 0; k < v->bytes; k++) *d++ = (uint8_t) (x >> (8 * k));
+	    }
+	}
+	md5_update(&v->md5, v->pack, d - v->pack);
+	v->samples += blocksize;
+}
+
+static void *verify_thread(void *a)
+{
+    struct flac_verify *v = (struct flac_verify *) a;
+    struct verify_slot *s;
+	pthread_mutex_lock(&v->mutex);
+	while(1) {
+	    if(v->get == v->put) {
+		if(v->quit) break;
+		pthread_cond_wait(&v->work, &v->mutex);
+		continue;
+	    }
+	    s = &v->slots[v->get % VERIFY_SLOTS];
+	    pthread_mutex_unlock(&v->mutex);
+	    hash_frame(v, s->planes, s->blocksize, s->decorr);
+	    pthread_mutex_lock(&v->mutex);
+	    v->get++;
+	    pthread_cond_signal(&v->room);
+	}
+	pthread_mutex_unlock(&v->mutex);
+    return 0;
+}
+
+/* Returns zero if the stream has no md5 or cannot be checked. With threaded set,
+   frames are hashed on a helper thread. */
+struct flac_verify *flac_verify_start(const FLACContext *fc, int threaded)
+{
+    static const uint8_t zero[16];
+    struct flac_verify *v;
+    size_t plane = fc->max_blocksize;
+    int i, c;
+
+	if(memcmp(fc->md5, zero, 16) == 0) {
+	    log_info("no md5 in streaminfo, frame crc checked only");
+	    return 0;
+	}
+	v = (struct flac_verify *) calloc(1, sizeof(struct flac_verify));
+	if(!v) return 0;
+	v->channels = fc->channels;
+	v->bytes = (fc->bps + 7) / 8;
+	v->total = fc->totalsamples;
+	memcpy(v->expect, fc->md5, 16);
+	md5_init(&v->md5);
+	v->pack = (uint8_t *) malloc(plane * fc->channels * v->bytes);
+	if(!v->pack) goto err;
+	if(!threaded) return v;
+	v->mem = (int32_t *) malloc(VERIFY_SLOTS * fc->channels * plane * sizeof(int32_t));
+	if(!v->mem) goto err;
+	for(i = 0; i < VERIFY_SLOTS; i++)
+	    for(c = 0; c < fc->channels; c++) v->slots[i].planes[c] = v->mem + (i * fc->channels + c) * plane;
+	pthread_mutex_init(&v->mutex, 0);
+	pthread_cond_init(&v->work, 0);
+	pthread_cond_init(&v->room, 0);
+	if(pthread_create(&v->thread, 0, verify_thread, v) != 0) {
+	    pthread_mutex_destroy(&v->mutex);
+	    pthread_cond_destroy(&v->work);
+	    pthread_cond_destroy(&v->room);
+	    goto err;
+	}
+	v->threaded = 1;
+    return v;
+    err:
+	log_err("cannot start md5 verification");
+	free(v->mem);
+	free(v->pack);
+	free(v);
+    return 0;
+}
+
+/* Adds a decoded frame, its planes still decorrelated as given by decorr */
+void flac_verify_frame(struct flac_verify *v, int32_t **planes, int blocksize, int decorr)
+{
+    struct verify_slot *s;
+    int c;
+	if(!v->threaded) {
+	    hash_frame(v, planes, blocksize, decorr);
+	    return;
+	}
+	pthread_mutex_lock(&v->mutex);
+	while(v->put - v->get == VERIFY_SLOTS) pthread_cond_wait(&v->room, &v->mutex);
+	pthread_mutex_unlock(&v->mutex);
+	s = &v->slots[v->put % VERIFY_SLOTS];
+	for(c = 0; c < v->channels; c++) memcpy(s->planes[c], planes[c], blocksize * sizeof(int32_t));
+	s->blocksize = blocksize;
+	s->decorr = decorr;
+	pthread_mutex_lock(&v->mutex);
+	v->put++;
+	pthread_cond_signal(&v->work);
+	pthread_mutex_unlock(&v->mutex);
+}
+
+/* Returns 0 if the md5 matched, 1 if not, 2 if the stream length is not as given in
+   STREAMINFO, -1 if it was not played to the end. Frees v. */
+int flac_verify_finish(struct flac_verify *v, int complete)
+{
+    uint8_t md5[16];
+    int ret = -1;
+	if(v->threaded) {
+	    pthread_mutex_lock(&v->mutex);
+	    v->quit = 1;
+	    pthread_cond_signal(&v->work);
+	    pthread_mutex_unlock(&v->mutex);
+	    pthread_join(v->thread, 0);
+	    pthread_mutex_destroy(&v->mutex);
+	    pthread_cond_destroy(&v->work);
+	    pthread_cond_destroy(&v->room);
+	}
+	if(complete && v->total && v->samples != v->total) ret = 2;
+	else if(complete) {
+	    md5_final(&v->md5, md5);
+	    ret = memcmp(md5, v->expect, 16) != 0;
+	}
+	free(v->mem);
+	free(v->pack);
+	free(v);
+    return ret;
+}
@@ -14,6 +14,7 @@
 #include <signal.h>
 #include <limits.h>
 #include <ctype.h>
+#include <dirent.h>
 #include "flac/decoder.h"
 #include "main.h"
 
@@ -30,6 +31,10 @@ extern int security_setenforce(int value);
 
 int quiet_run = 0;
 static int need_show_time = 0;
+static int need_show_stats = 0;
+static int gapless = 0;
+
+#define GAPLESS_LINGER_MS	2000
 static jlong ctx = 0;
 
 struct call_args {
@@ -40,12 +45,12 @@ struct call_args {
 
 void bye(int sig) 
 {
-    ((playback_ctx *)ctx)->state = STATE_INTR;
+    if(ctx) set_state((playback_ctx *)ctx, STATE_INTR);
 }
 
 static int usage(char *prog) 
 {
-   printf("Usage: %s [-x file] [-c card] [-d device] [-s min:sec | -t track_no] [-p num:sz] [-q] (<-i> | <file>)\n", prog);
+   printf("Usage: %s [-x file] [-c card] [-d device] [-s min:sec | -t track_no] [-p num:sz] [-b min:max[:kb]] [-j threads] [-D] [-M ch:coefs] [-B] [-K] [-q] [-w] [-S] [-g] (<-i> | <-V file|dir ...> | <file ...>)\n", prog);
    return printf(
 #ifdef ANDLINUX
 		 "-x\tspecify custom xml config (default is /sdcard/.alsaplayer/cards.xml)\n"
@@ -56,11 +61,21 @@ static int usage(char *prog)
 		 "-s\tspecify start point of playback in a file\n"
 		 "-t\tspecify cue file track (audio file defined in cue must be in the same dir)\n"
 		 "-p\tforce number and size of periods (in frames) or fragments (in bytes)\n"
+		 "-b\tbounds for adaptive buffer depth: min/max latency in ms, memory limit in KB\n"
 		 "-m\tforce memory-mapped playback\n"
 		 "-r\tforce using ring buffer instead of block buffer\n"
+		 "-g\tgapless playback: keep the stream open between files of the same format\n"
+		 "-j\tnumber of flac/ape decoder threads, 0 to decode on a single thread (default is auto)\n"
+		 "-D\tdownmix multichannel flac to stereo even if the device takes all channels\n"
+		 "-M\tdownmix matrix for the given number of channels: left then right coefficients,\n"
+		 "\te.g. 6:0.4,0,0.2,0.1,0.3,0,0,0.4,0.2,0.1,0,0.3 (channels in flac order)\n"
+		 "-B\tbenchmark flac lpc kernels and exit\n"
+		 "-V\tverify frame crc and stream md5 of the flac files given or found in the directories given, and exit\n"
+		 "-K\tcheck frame crc and stream md5 of flac files while playing\n"
 		 "-q\tquiet mode, suppress extra info\n"
 		 "-i\ttest the selected device and show its information\n"
 		 "-w\tshow stream time\n"
+		 "-S\tshow buffer and latency statistics every second and at the end of each file\n"
 	);
 }
 
@@ -75,13 +90,30 @@ void *thd(void *a)
     return 0;	
 }
 
+static void show_stats(void)
+{
+    int i, v[STAT_COUNT];
+	if(audio_get_stats((playback_ctx *) ctx, v, STAT_COUNT) != STAT_COUNT) return;
+	printf("xruns=%d (recovery last/max %d/%d us) blocked puts=%d/%d gets=%d/%d depth=%d fill=%d%% "
+		"decode=%d us/blk write p50/p90/p99/max=%d/%d/%d/%d us fill hist:",
+		v[STAT_UNDERRUNS], v[STAT_XRUN_US_LAST], v[STAT_XRUN_US_MAX],
+		v[STAT_BLOCKED_PUTS], v[STAT_TOTAL_PUTS], v[STAT_BLOCKED_GETS], v[STAT_TOTAL_GETS],
+		v[STAT_DEPTH], v[STAT_FILL_PCT], v[STAT_DECODE_US], 
+		v[STAT_WRITE_P50], v[STAT_WRITE_P90], v[STAT_WRITE_P99], v[STAT_WRITE_MAX]);
+	for(i = 0; i < STATS_FILL_BUCKETS; i++) printf(" %d", v[STAT_FILL_HIST + i]);
+	printf("\n");
+}
+
 void *time_thd(void *a)
 {
     int sec;
-    while(need_show_time) {
+    while(need_show_time || need_show_stats) {
 	if(!ctx) break;
-	sec = audio_get_cur_position(0, 0, ctx);
-	printf("sec = %d\n", sec);
+	if(need_show_time) {
+	    sec = audio_get_cur_position(0, 0, ctx);
+	    printf("sec = %d\n", sec);
+	}
+	if(need_show_stats) show_stats();
 	sleep(1);
     }
     return 0; 
@@ -94,6 +126,100 @@ void pause_resume(int sig) {
 
 static int parse_cue(struct call_args *args);
 
+/* for preparing the next file, cue sheets are not */
+static int next_format(const char *file)
+{
+    const char *c = strrchr(file, '.');
+	if(!c) return -1;
+	if(strcmp(c, ".flac") == 0) return FORMAT_FLAC;
+	if(strcmp(c, ".ape") == 0) return FORMAT_APE;
+	if(strcmp(c, ".m4a") == 0) return FORMAT_ALAC;
+	if(strcmp(c, ".wav") == 0) return FORMAT_WAV;
+	if(strcmp(c, ".mp3") == 0) return FORMAT_MP3;
+    return -1;
+}
+
+/* -V: flac files to verify, checked by a thread per core */
+struct verify_list {
+    char **files;
+    int n, max, next, bad;
+    pthread_mutex_t mutex;
+};
+
+static void verify_add(struct verify_list *vl, const char *path)
+{
+    struct stat st;
+    DIR *d;
+    struct dirent *e;
+    char sub[PATH_MAX];
+    const char *c;
+	if(stat(path, &st) != 0) {
+	    printf("%s: not found\n", path);
+	    vl->bad++;
+	    return;
+	}
+	if(S_ISDIR(st.st_mode)) {
+	    d = opendir(path);
+	    if(!d) return;
+	    while((e = readdir(d)) != 0) {
+		if(e->d_name[0] == '.') continue;
+		snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+		if(stat(sub, &st) != 0) continue;
+		c = strrchr(e->d_name, '.');
+		if(S_ISDIR(st.st_mode) || (c && strcasecmp(c, ".flac") == 0)) verify_add(vl, sub);
+	    }
+	    closedir(d);
+	    return;
+	}
+	if(vl->n == vl->max) {
+	    vl->max = vl->max ? vl->max * 2 : 64;
+	    vl->files = (char **) realloc(vl->files, vl->max * sizeof(char *));
+	    if(!vl->files) exit(printf("no memory\n"));
+	}
+	vl->files[vl->n++] = strdup(path);
+}
+
+static void *verify_thd(void *a)
+{
+    struct verify_list *vl = (struct verify_list *) a;
+    char msg[256];
+    int i, k;
+	while(1) {
+	    pthread_mutex_lock(&vl->mutex);
+	    i = vl->next++;
+	    pthread_mutex_unlock(&vl->mutex);
+	    if(i >= vl->n) break;
+	    k = flac_verify_file(vl->files[i], msg, sizeof(msg));
+	    pthread_mutex_lock(&vl->mutex);
+	    if(k != 0) vl->bad++;
+	    printf("%s: %s (%s)\n", vl->files[i], k == 0 ? "OK" : "CORRUPT", msg);
+	    pthread_mutex_unlock(&vl->mutex);
+	}
+    return 0;
+}
+
+static int verify_files(int argc, char **argv)
+{
+    struct verify_list vl;
+    pthread_t thds[64];
+    int i, n = sysconf(_SC_NPROCESSORS_ONLN);
+	memset(&vl, 0, sizeof(vl));
+	pthread_mutex_init(&vl.mutex, 0);
+	for(i = 0; i < argc; i++) verify_add(&vl, argv[i]);
+	if(n < 1) n = 1;
+	if(n > 64) n = 64;
+	if(n > vl.n) n = vl.n;
+	for(i = 0; i < n; i++) if(pthread_create(&thds[i], 0, verify_thd, &vl) != 0) break;
+	n = i;
+	if(n == 0) verify_thd(&vl);
+	for(i = 0; i < n; i++) pthread_join(thds[i], 0);
+	printf("%d files checked, %d failed\n", vl.n, vl.bad);
+	for(i = 0; i < vl.n; i++) free(vl.files[i]);
+	free(vl.files);
+	pthread_mutex_destroy(&vl.mutex);
+    return vl.bad ? 1 : 0;
+}
+
 static int test_device(int card, int device)
 {
     ctx = audio_init(0, 0, 0, card, device);
@@ -106,7 +232,7 @@ static int test_device(int card, int device)
 
 int main(int argc, char **argv)
 {
-    int card = 0, device = 0, info = 0, opt;
+    int card = 0, device = 0, info = 0, verify = 0, opt;
     char *c;
     pthread_t thread, time_thread;
     sigset_t set;
@@ -122,7 +248,7 @@ int main(int argc, char **argv)
 	signal(SIGUSR2, pause_resume);	
 
 
-	while ((opt = getopt(argc, argv, "c:d:s:t:qix:p:wmr")) != -1) {
+	while ((opt = getopt(argc, argv, "c:d:s:t:qix:p:b:j:wmrSgBVKDM:")) != -1) {
 	    switch (opt) {
 		case 'c':
 		    card = atoi(optarg);
@@ -145,6 +271,15 @@ int main(int argc, char **argv)
 			return printf("invalid number/size of periods/fragments %d/%d\n", 
 				forced_chunks, forced_chunk_size);	
 		    break;
+		case 'b':
+		    if(sscanf(optarg, "%d:%d:%d", &forced_bufset.min_ms, &forced_bufset.max_ms, &forced_bufset.max_kb) < 2
+			|| forced_bufset.min_ms <= 0 || forced_bufset.max_ms < forced_bufset.min_ms || forced_bufset.max_kb < 0)
+			return printf("bad argument to -b option\n");
+		    break;
+		case 'j':
+		    flac_threads = ape_threads = atoi(optarg);
+		    if(flac_threads < 0) return printf("bad argument to -j option\n");
+		    break;
 		case 't':
 		    args->track = atoi(optarg);
 		    break; 
@@ -154,6 +289,27 @@ int main(int argc, char **argv)
 		case 'w':
 		    need_show_time = 1;
 		    break;	
+		case 'S':
+		    need_show_stats = 1;
+		    break;	
+		case 'g':
+		    gapless = GAPLESS_LINGER_MS;
+		    break;	
+		case 'B':
+		    flac_lpc_init();
+		    return flac_lpc_bench() ? 1 : 0;
+		case 'D':
+		    force_downmix = 1;
+		    break;
+		case 'M':
+		    if(downmix_set(optarg) != 0) return printf("bad argument to -M option\n");
+		    break;
+		case 'V':
+		    verify = 1;
+		    break;
+		case 'K':
+		    flac_verify = 1;
+		    break;
 		case 'q':
 		    quiet_run = 1;
 		    break;
@@ -185,6 +341,10 @@ int main(int argc, char **argv)
 	   printf("No file specified\n");
 	   return usage(argv[0]);
 	}
+	if(verify) {
+	    quiet_run = 1;
+	    return verify_files(argc - optind, argv + optind);
+	}
 again:
 	args->file = strdup(argv[optind]);
 	args->ftype = -1;
@@ -215,23 +375,40 @@ again:
 	}
 
 	if(args->ftype == -1) return printf("file extension must be .flac, .ape or .mp3\n");
-	ctx = audio_init(0, 0, 0, card, device);
-	if(!ctx) return -1;	
+	if(!ctx) {	/* reused across files in gapless mode */
+	    ctx = audio_init(0, 0, 0, card, device);
+	    if(!ctx) return -1;	
+	    if(gapless) audio_set_gapless((playback_ctx *) ctx, gapless);
+	}
 
 	pthread_create(&thread, 0, thd, args);
-	if(need_show_time) pthread_create(&time_thread, 0, time_thd, 0);
+	if(gapless && optind + 1 < argc && next_format(argv[optind+1]) != -1)
+	    audio_prepare_next((playback_ctx *) ctx, argv[optind+1], next_format(argv[optind+1]));
+	if(need_show_time || need_show_stats) pthread_create(&time_thread, 0, time_thd, 0);
 
 	pthread_join(thread, 0);
-	if(need_show_time) {
-	    need_show_time = 0;
+	if(need_show_time || need_show_stats) {
+	    int t = need_show_time, st = need_show_stats;
+	    need_show_time = need_show_stats = 0;
 	    pthread_join(time_thread, 0);	
+	    if(st) show_stats();
+	    need_show_time = t;
+	    need_show_stats = st;
+	}
+	if(!gapless) {
+	    audio_exit(0, 0, ctx);
+	    ctx = 0;
 	}
-	audio_exit(0, 0, ctx);
 	if(args->file) free(args->file);
 
 	optind++;
         if(optind < argc) goto again;
 
+	if(ctx) {
+	    audio_set_gapless((playback_ctx *) ctx, 0);	/* play out the last file */
+	    audio_exit(0, 0, ctx);
+	}
+
     return 0;
 }
 
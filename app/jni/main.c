@@ -37,38 +37,51 @@ static void *audio_write_thread(void *a);
    Blocks in STATE_PAUSE/STATE_PAUSING states and never returns them.
    If the state on entry was STATE_PAUSING, attempts to pause stream
    and wakes up audio_pause() waiting for the result. 
+   Steady states are returned without locking: transitions to PAUSING/INTR are
+   picked up by the next call, which is early enough for both.
 */
 
 enum playback_state sync_state(playback_ctx *ctx, const char *func) {
     bool ret;
-    volatile enum playback_state state;
+    enum playback_state state;
+	state = get_state(ctx);
+	if(state != STATE_PAUSING && state != STATE_PAUSED && state != STATE_INTR) return state;
+
 	pthread_mutex_lock(&ctx->mutex);	
-	if(ctx->state == STATE_PAUSED) {
+	if(get_state(ctx) == STATE_PAUSED) {
 	    log_info("%s: in paused state: blocking", func);
 	    pthread_cond_wait(&ctx->cond_resumed, &ctx->mutex); /* block until PAUSED */	
 	    log_info("%s: resuming after pause", func);	
-	} else if(ctx->state == STATE_PAUSING) {
+	} else if(get_state(ctx) == STATE_PAUSING) {
 	    ret = alsa_is_offload(ctx) ? alsa_pause_offload(ctx) : alsa_pause(ctx);	
 	    if(ret) {
-		ctx->state = STATE_PAUSED;
+		set_state(ctx, STATE_PAUSED);
 		log_info("%s: switched to paused state: blocking", func);
 	    } else log_err("failed to pause in %s", func);
 	    pthread_cond_signal(&ctx->cond_paused);
 	    pthread_cond_wait(&ctx->cond_resumed, &ctx->mutex);	
 	    log_info("%s: resuming after pause", func);	
 	}
-	state = ctx->state;	
+	state = get_state(ctx);	
 	pthread_mutex_unlock(&ctx->mutex);	
     return state;
 }
 
 void playback_complete(playback_ctx *ctx, const char *func)
 {
-   int i = ctx->state;
+   int i = get_state(ctx);
 
     pthread_mutex_lock(&ctx->mutex);
-    if(/* ctx->state != STATE_STOPPED && */ ctx->state != STATE_INTR) ctx->state = STATE_STOPPING;	
-    log_info("playback complete in %s, %d->%d", func, i, ctx->state);
+    if(ctx->gapless && i == STATE_PLAYING && ctx->pcm_buff && ctx->audio_thread && !ctx->alsa_error) {
+	/* decoder is done: let the writer drain the ring and wait for the next track */
+	ctx->linger = 1;
+	log_info("playback complete in %s, lingering", func);
+	pthread_mutex_unlock(&ctx->mutex);
+	sched_restore_caller(ctx);
+	return;
+    }
+    if(/* get_state(ctx) != STATE_STOPPED && */ get_state(ctx) != STATE_INTR) set_state(ctx, STATE_STOPPING);	
+    log_info("playback complete in %s, %d->%d", func, i, get_state(ctx));
     pthread_mutex_unlock(&ctx->mutex);
     audio_stop(ctx);	
 }
@@ -86,9 +99,10 @@ int audio_stop(playback_ctx *ctx)
 	log_err("no context to stop");
 	return -1;
     }	
+    sched_restore_caller(ctx);
     pthread_mutex_lock(&ctx->mutex);
 
-    in_state = ctx->state; 	
+    in_state = get_state(ctx); 	
     log_info("context %p in state %d", ctx, in_state);
 
     if(in_state == STATE_STOPPED) {
@@ -111,11 +125,9 @@ int audio_stop(playback_ctx *ctx)
 	    pcm_buffer_destroy(ctx->pcm_buff);
 	    ctx->pcm_buff = 0;
 	}	
-	if(ctx->blk_buff) {
-	    blk_buffer_destroy(ctx->blk_buff);
-	    ctx->blk_buff = 0;
-	}	
-	ctx->state = STATE_STOPPED;
+	/* blk_buff is kept for the next track, see audio_start() */
+	ctx->linger = 0;
+	set_state(ctx, STATE_STOPPED);
 	pthread_mutex_unlock(&ctx->mutex);
     	ctx->track_time = 0;	
 /*	pthread_cond_broadcast(&ctx->cond_stopped); */
@@ -123,8 +135,9 @@ int audio_stop(playback_ctx *ctx)
 	return 0;
     }
     log_info("forced stop");	
+    ctx->linger = 0;
 
-    ctx->state = alsa_is_mmapped(ctx) ? STATE_STOPPED : STATE_STOPPING;
+    set_state(ctx, alsa_is_mmapped(ctx) ? STATE_STOPPED : STATE_STOPPING);
 
     if(in_state == STATE_PAUSED || in_state == STATE_PAUSING) {
 	log_info("context was paused brefore");
@@ -141,21 +154,55 @@ int audio_stop(playback_ctx *ctx)
 }
 	
 
+/* Gapless switch: the next track may feed the open stream if its parameters 
+   match and its blocks fit the ring. Called with mutex locked. */
+static int gapless_continue(playback_ctx *ctx)
+{
+    long long frames;
+    const playback_format_t *format = alsa_get_format(ctx);
+
+	if(!ctx->gapless || get_state(ctx) != STATE_PLAYING || ctx->alsa_error 
+		|| !ctx->pcm_buff || !ctx->audio_thread || !format) return 0;
+	if(ctx->samplerate != ctx->open_rate || ctx->channels != ctx->open_channels 
+		|| ctx->bps != ctx->open_bps || ctx->block_max > ctx->open_block) return 0;
+	/* rate_dec, downmix and block_write stay as set up for the open stream */
+	ctx->samplerate = ctx->open_rate >> ctx->rate_dec;
+	ctx->channels = ctx->dev_channels;
+	/* Position of the new track starts when the rest of the previous one has been played */
+	frames = ctx->produced / (ctx->channels * (format->phys_bits/8));
+	__atomic_fetch_sub(&ctx->written, (int) frames, __ATOMIC_RELAXED);
+	ctx->produced = 0;
+    return 1;
+}
+
 /* Stream parameters must be set by decoder before this call */
 int audio_start(playback_ctx *ctx, int buffered_write)
 {
-    int k, ret;
+    int k, ret, fb, bps;
     int period_size;
     const playback_format_t *format;
+    const struct bufset *bs;
+    const struct schedset *ss;
 	
 	if(!ctx) {
 	    log_err("no context to start");
 	    return -1;
 	}
-	log_info("starting context %p, state %d", ctx, ctx->state);
+	log_info("starting context %p, state %d", ctx, get_state(ctx));
 
 	pthread_mutex_lock(&ctx->mutex);
-	if(ctx->state != STATE_STOPPED) {
+	if(ctx->linger) {
+	    ctx->linger = 0;
+	    if(buffered_write && gapless_continue(ctx)) {
+		pthread_mutex_unlock(&ctx->mutex);
+		sched_apply_caller(ctx, alsa_get_schedset(ctx), 0);
+		log_info("continuing with open stream");
+		return 0;
+	    }
+	    log_info("stream parameters changed, reopening");
+	    set_state(ctx, STATE_STOPPING);	/* drain and close below */
+	}
+	if(get_state(ctx) != STATE_STOPPED) {
 	    log_info("context live, stopping");
 	    pthread_mutex_unlock(&ctx->mutex);	
 	    ret = audio_stop(ctx); 
@@ -164,13 +211,22 @@ int audio_start(playback_ctx *ctx, int buffered_write)
 	    log_info("live context stopped");	
 	}
 
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->open_rate = ctx->samplerate;
+	ctx->open_channels = ctx->channels;
+	ctx->open_bps = ctx->bps;
+	ctx->open_block = ctx->block_max;
 	ret = alsa_start(ctx);
 	if(ret != 0) goto err_init;
+	ctx->dev_channels = ctx->channels;
 
 	ctx->pcm_buff = 0;
-	ctx->blk_buff = 0;
 	ctx->audio_thread = 0;
 
+	/* we're on decoder thread, which is also the writer if there's no buffering */
+	ss = alsa_get_schedset(ctx);
+	sched_apply_caller(ctx, ss, !buffered_write || alsa_is_mmapped(ctx));
+
 	if(!buffered_write || alsa_is_mmapped(ctx)) goto done;
 
 	/* format/period_size must be known after alsa_start() */
@@ -181,22 +237,49 @@ int audio_start(playback_ctx *ctx, int buffered_write)
 	}	
 	period_size = alsa_get_period_size(ctx);
 
+	bs = alsa_get_bufset(ctx);
+	fb = ctx->channels * (format->phys_bits/8);
+	bps = ctx->samplerate * fb;
+
 	if(ctx->block_write) {
-	    k = (ctx->block_max >> ctx->rate_dec) * ctx->channels * (format->phys_bits/8);
-	    ctx->blk_buff = blk_buffer_create(k, 64);
+	    int usec, min, max;
+	    k = (ctx->block_max >> ctx->rate_dec) * fb;
+	    usec = (int) ((ctx->block_max >> ctx->rate_dec) * 1000000LL / ctx->samplerate);
+	    min = bs->min_ms * 1000LL / usec;
+	    max = bs->max_ms * 1000LL / usec;
+	    if(max > bs->max_kb * 1024LL / k) max = bs->max_kb * 1024LL / k;
+	    if(min < 4) min = 4;
+	    if(max < min) max = min;
+	    if(ctx->blk_buff && blk_buffer_reset(ctx->blk_buff, k, max) != 0) {
+		blk_buffer_destroy(ctx->blk_buff);
+		ctx->blk_buff = 0;
+	    }
+	    if(!ctx->blk_buff) ctx->blk_buff = blk_buffer_create(k, max);
 	    if(!ctx->blk_buff) {
 		log_err("cannot create block buffer");
 		goto err_init;	
 	    }
+	    blk_buffer_set_depth(ctx->blk_buff, min, max, usec, &ctx->stats.dec_us);
+	    if(ss->mlock) blk_buffer_mlock(ctx->blk_buff);
+	    log_info("block buffer: %d bytes x %d..%d blocks", k, min, max);
 	} else {
+	    int min, max;
 	    k = (period_size > (ctx->block_max >> ctx->rate_dec)) ? 
 		period_size : (ctx->block_max >> ctx->rate_dec);
-
-	    ctx->pcm_buff = pcm_buffer_create(k * ctx->channels * (format->phys_bits/8) * 64);
+	    k *= fb;
+	    min = bs->min_ms * (long long) bps / 1000;
+	    max = bs->max_ms * (long long) bps / 1000;
+	    if(max > bs->max_kb * 1024) max = bs->max_kb * 1024;
+	    if(min < 4 * k) min = 4 * k;	/* room for a block and a period at least */
+	    if(max < min) max = min;
+	    ctx->pcm_buff = pcm_buffer_create(max);
 	    if(!ctx->pcm_buff) {
 		log_err("cannot create pcm buffer");
 		goto err_init;	
 	    }
+	    pcm_buffer_set_depth(ctx->pcm_buff, min, bps, &ctx->stats.dec_us);
+	    if(ss->mlock) pcm_buffer_mlock(ctx->pcm_buff);
+	    log_info("pcm buffer: %d..%d bytes", min, max);
 	}
 
 	if(pthread_create(&ctx->audio_thread, 0, audio_write_thread, ctx) != 0) {
@@ -205,8 +288,9 @@ int audio_start(playback_ctx *ctx, int buffered_write)
 	}
 
     done:
-	ctx->state = STATE_PLAYING;
+	set_state(ctx, STATE_PLAYING);
 	ctx->written = 0;
+	ctx->produced = 0;
 	ctx->alsa_error = 0;
 	pthread_mutex_unlock(&ctx->mutex);
 	log_info("playback started");
@@ -217,39 +301,80 @@ int audio_start(playback_ctx *ctx, int buffered_write)
 	    pcm_buffer_destroy(ctx->pcm_buff);
 	    ctx->pcm_buff = 0;	
 	}
-	if(ctx->blk_buff) {
-	    blk_buffer_destroy(ctx->blk_buff);	
-	    ctx->blk_buff = 0;
-	}	
 	pthread_mutex_unlock(&ctx->mutex);
 	return LIBLOSSLESS_ERR_INIT;	
 }
 
 /* size in frames if mmapped, in bytes otherwise */
 
-int audio_write(playback_ctx *ctx, void *buff, int size) 
+static int write_allowed(playback_ctx *ctx, const char *func)
 {
     enum playback_state state;
-    int i;
-	state = sync_state(ctx, __func__);
-	if(state == STATE_STOPPED) return -1;
+	state = sync_state(ctx, func);
+	if(state == STATE_STOPPED) return 0;
 	if(state == STATE_INTR) {
-	    playback_complete(ctx, __func__);
+	    playback_complete(ctx, func);
 	    /*  At this point, state will be either STOPPED (for mmap) or STOPPING.
 		In the first case, no further audio_writes will be possible, and alsa-related stuff
 		may be freely discarded in alsa_exit. The second case is required to make sure that
 		the thread will be joined upon the next audio_stop call from audio_exit. */
-	    return -1;	
+	    return 0;	
 	}
 	if(ctx->block_write) {
-	    log_err("internal error in %s", __func__);
-	    return -1;
+	    log_err("internal error in %s", func);
+	    return 0;
 	}
+    return 1;
+}
+
+int audio_write(playback_ctx *ctx, void *buff, int size) 
+{
+    int i;
+	if(!write_allowed(ctx, __func__)) return -1;
         i = alsa_is_mmapped(ctx) ? 
 		alsa_write_mmapped(ctx, buff, size) : pcm_buffer_put(ctx->pcm_buff, buff, size);
+	if(i == size && !alsa_is_mmapped(ctx)) ctx->produced += size;
     return (i == size) ? 0 : -1;
 }
 
+/* Zero-copy alternative to audio_write() for ring buffer playback (size in bytes): 
+   decoder fills the returned window in place and then calls audio_commit(). */
+
+void *audio_reserve(playback_ctx *ctx, int size)
+{
+	if(!write_allowed(ctx, __func__)) return 0;
+	if(!ctx->pcm_buff) {
+	    log_err("internal error in %s", __func__);
+	    return 0;
+	}
+    return pcm_buffer_reserve_write(ctx->pcm_buff, size);
+}
+
+int audio_commit(playback_ctx *ctx, int size)
+{
+	if(pcm_buffer_commit_write(ctx->pcm_buff, size) != size) return -1;
+	ctx->produced += size;
+    return 0;
+}
+
+/* Linger time of 0 turns gapless mode off; if a stream is lingering at that moment, 
+   it is drained and closed. */
+void audio_set_gapless(playback_ctx *ctx, int linger_ms)
+{
+	if(!ctx) return;
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->gapless = linger_ms > 0 ? linger_ms : 0;
+	log_info("gapless linger time %d ms", ctx->gapless);
+	if(!ctx->gapless && ctx->linger) {
+	    ctx->linger = 0;
+	    set_state(ctx, STATE_STOPPING);
+	    pthread_mutex_unlock(&ctx->mutex);
+	    audio_stop(ctx);
+	    return;
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+}
+
 #ifdef ANDROID
 static 
 #endif
@@ -263,19 +388,19 @@ jboolean audio_pause(JNIEnv *env, jobject obj, jlong jctx)
 	return false;
     }	
     pthread_mutex_lock(&ctx->mutex);
-    if(ctx->state != STATE_PLAYING) {
+    if(get_state(ctx) != STATE_PLAYING) {
     	pthread_mutex_unlock(&ctx->mutex);
 	log_info("not in playing state");
 	return false;
     }	
     log_info("about to pause");	
-    saved_state = ctx->state;	
-    ctx->state = STATE_PAUSING;	
+    saved_state = get_state(ctx);	
+    set_state(ctx, STATE_PAUSING);	
     pthread_cond_wait(&ctx->cond_paused, &ctx->mutex);	
-    ret = (ctx->state == STATE_PAUSED);
+    ret = (get_state(ctx) == STATE_PAUSED);
     if(!ret) {
 	log_err("alsa pause failed");
-	ctx->state = saved_state;	
+	set_state(ctx, saved_state);	
     } else log_info("paused");	
     pthread_mutex_unlock(&ctx->mutex);
     return ret;		
@@ -293,7 +418,7 @@ jboolean audio_resume(JNIEnv *env, jobject obj, jlong jctx)
 	return false;
     }	
     pthread_mutex_lock(&ctx->mutex);
-    if(ctx->state != STATE_PAUSED) {
+    if(get_state(ctx) != STATE_PAUSED) {
     	pthread_mutex_unlock(&ctx->mutex);
 	log_info("not in paused state");
 	return false;
@@ -301,7 +426,7 @@ jboolean audio_resume(JNIEnv *env, jobject obj, jlong jctx)
     log_info("resuming playback");	
     ret = alsa_is_offload(ctx) ? alsa_resume_offload(ctx) : alsa_resume(ctx);	
     if(!ret) log_err("resume failed, proceeding anyway");
-    ctx->state = STATE_PLAYING;	
+    set_state(ctx, STATE_PLAYING);	
     pthread_cond_broadcast(&ctx->cond_resumed);	/* wake up writing threads or cycles */
     log_info("resumed");	
     pthread_mutex_unlock(&ctx->mutex);
@@ -309,6 +434,76 @@ jboolean audio_resume(JNIEnv *env, jobject obj, jlong jctx)
 }
 
 
+/* Called after each write to alsa, from whichever thread feeds it */
+void stats_write_done(playback_ctx *ctx, const struct timeval *tstart)
+{
+    struct playback_stats *st = &ctx->stats;
+    struct timeval now, diff;
+    unsigned int us;
+    int n = 0;
+	gettimeofday(&now, 0);
+	timersub(&now, tstart, &diff);
+	us = diff.tv_sec * 1000000 + diff.tv_usec;
+	if(us > st->lat_max) st->lat_max = us;
+	while((us >>= 1) && n < STATS_LAT_BUCKETS - 1) n++;
+	st->lat_hist[n]++;
+	if(st->xrun_start.tv_sec) {
+	    timersub(&now, &st->xrun_start, &diff);
+	    st->xrun_us_last = diff.tv_sec * 1000000 + diff.tv_usec;
+	    if(st->xrun_us_last > st->xrun_us_max) st->xrun_us_max = st->xrun_us_last;
+	    st->xrun_start.tv_sec = 0;
+	}
+}
+
+void stats_underrun(playback_ctx *ctx)
+{
+	ctx->stats.underruns++;
+	if(!ctx->stats.xrun_start.tv_sec) gettimeofday(&ctx->stats.xrun_start, 0);
+}
+
+/* Upper bound of the latency bucket, in usec */
+static int stats_percentile(struct playback_stats *st, int pct)
+{
+    unsigned int i, total = 0, sum = 0;
+	for(i = 0; i < STATS_LAT_BUCKETS; i++) total += st->lat_hist[i];
+	if(!total) return 0;
+	for(i = 0; i < STATS_LAT_BUCKETS; i++) {
+	    sum += st->lat_hist[i];
+	    if(sum * 100ULL >= (unsigned long long) total * pct) break;
+	}
+	if(i >= STATS_LAT_BUCKETS - 1) return st->lat_max;
+    return (2 << i) < st->lat_max ? (2 << i) : st->lat_max;
+}
+
+/* Fill out[] with STAT_* values, return the number of values set */
+int audio_get_stats(playback_ctx *ctx, int *out, int n)
+{
+    int i, v[STAT_COUNT];
+    unsigned int k;
+    struct playback_stats *st;
+	if(!ctx || !out || n <= 0) return 0;
+	st = &ctx->stats;
+	v[STAT_UNDERRUNS] = st->underruns;
+	v[STAT_XRUN_US_LAST] = st->xrun_us_last;
+	v[STAT_XRUN_US_MAX] = st->xrun_us_max;
+	v[STAT_BLOCKED_PUTS] = st->buf.blocked_puts;
+	v[STAT_TOTAL_PUTS] = st->buf.total_puts;
+	v[STAT_BLOCKED_GETS] = st->buf.blocked_gets;
+	v[STAT_TOTAL_GETS] = st->buf.total_gets;
+	v[STAT_DEPTH] = st->buf.depth;
+	v[STAT_FILL_PCT] = st->buf.fill_pct;
+	k = __atomic_load_n(&st->dec_blocks, __ATOMIC_RELAXED);
+	v[STAT_DECODE_US] = k ? (int) (__atomic_load_n(&st->dec_us, __ATOMIC_RELAXED) / k) : 0;
+	v[STAT_WRITE_P50] = stats_percentile(st, 50);
+	v[STAT_WRITE_P90] = stats_percentile(st, 90);
+	v[STAT_WRITE_P99] = stats_percentile(st, 99);
+	v[STAT_WRITE_MAX] = st->lat_max;
+	for(i = 0; i < STATS_FILL_BUCKETS; i++) v[STAT_FILL_HIST + i] = st->fill_hist[i];
+	if(n > STAT_COUNT) n = STAT_COUNT;
+	memcpy(out, v, n * sizeof(int));
+    return n;
+}
+
 #if 0
 /* to be removed */
 static void thread_exit(int j) {
@@ -316,26 +511,45 @@ static void thread_exit(int j) {
 }
 #endif
 
-#define TEST_TIMING	1
+/* Gapless mode: the writer has been padding with silence since *since, 
+   give up the stream if no next track shows up in time. */
+static int linger_expired(playback_ctx *ctx, struct timeval *since)
+{
+    struct timeval now, diff;
+	gettimeofday(&now, 0);
+	if(!since->tv_sec) {
+	    *since = now;
+	    return 0;
+	}
+	timersub(&now, since, &diff);
+	if(diff.tv_sec * 1000 + diff.tv_usec / 1000 < ctx->gapless) return 0;
+	pthread_mutex_lock(&ctx->mutex);
+	if(!ctx->linger) {	/* next track is just starting */
+	    pthread_mutex_unlock(&ctx->mutex);
+	    return 0;
+	}
+	ctx->linger = 0;
+	set_state(ctx, STATE_STOPPING);
+	pthread_mutex_unlock(&ctx->mutex);
+	log_info("no next track, closing stream");
+    return 1;
+}
 
 static void *audio_write_thread(void *a) 
 {
     playback_ctx *ctx = (playback_ctx *) a;
-    int i, k, f2b;
+    int i, k, f2b, pad;
     const playback_format_t *format = alsa_get_format(ctx);
     void *pcm_buf;
     int period_size = alsa_get_period_size(ctx);
+    int period_ms = period_size * 1000LL / ctx->samplerate + 1;
+    struct buffer_stats *bst = &ctx->stats.buf;
+    struct timeval tlinger = { 0, 0 };
 #if 0
     sigset_t set;
     struct sigaction sact = { .sa_handler = thread_exit,  };
 #endif
 
-#ifdef TEST_TIMING
-    struct timeval tstart, tstop, tdiff;
-    int  writes = 0, gets = 0;
-    unsigned long long us_write = 0, us_get = 0;	
-#endif
-
 	if(!format) {
 	    log_err("cannot determine sample format, exiting");	
 	    return 0;
@@ -343,6 +557,7 @@ static void *audio_write_thread(void *a)
 	f2b = ctx->channels * (format->phys_bits/8);
 
 	log_info("entering");
+	sched_apply(alsa_get_schedset(ctx), 1);
 #if 0
 	sigaction(SIGUSR1, &sact, 0);
 	sigemptyset(&set);
@@ -352,66 +567,68 @@ static void *audio_write_thread(void *a)
 
 	while(1) {
 
+	    pad = 0;
 	    k = sync_state(ctx, __func__);
 	    if(k != STATE_PLAYING && k != STATE_STOPPING && k != STATE_INTR) {
 		log_err("got state %d, exiting", k);
 		break;
 	    }	
 
-#ifdef TEST_TIMING
-	    gettimeofday(&tstart,0);
-#endif
 	    if(ctx->block_write) {
 		pcm_buf = blk_buffer_request_playback(ctx->blk_buff);
 		if(!pcm_buf) {
 		    log_err("cannot obtain alsa buffer, exiting");	
 		    break;
 		}
-	    } else {			
-		pcm_buf = alsa_get_buffer(ctx);	/* may be changed after pause in sync_state! */	
+		blk_buffer_get_stats(ctx->blk_buff, bst);
+	    } else if(ctx->gapless) {
+		/* don't block for good: the decoder may be gone with a partial period left */
+		k = period_size * f2b;
+		pcm_buf = pcm_buffer_peek_read_timed(ctx->pcm_buff, &k, period_ms);
 		if(!pcm_buf) {
-		    log_err("cannot obtain alsa buffer, exiting");	
+		    log_info("buffer stopped, exiting");
 		    break;
 		}
-		k = pcm_buffer_get(ctx->pcm_buff, pcm_buf, period_size * f2b);
-		if(k <= 0) {
+		if(k < period_size * f2b && get_state(ctx) == STATE_PLAYING) {
+		    if(!ctx->linger) continue;	/* decoder is just late */
+		    if(linger_expired(ctx, &tlinger)) break;
+		    pad = 1;	/* play what's left and fill up with silence */
+		} else tlinger.tv_sec = 0;
+		pcm_buffer_get_stats(ctx->pcm_buff, bst);
+	    } else {			
+		/* write straight from the ring, no copy to alsa buffer */
+		k = period_size * f2b;
+		pcm_buf = pcm_buffer_peek_read(ctx->pcm_buff, &k);
+		if(!pcm_buf || k <= 0) {
 		    log_info("buffer stopped or empty, exiting");
 		    break;
 		}
+		pcm_buffer_get_stats(ctx->pcm_buff, bst);
 	    }
+	    ctx->stats.fill_hist[bst->fill_pct < 100 ? bst->fill_pct / 10 : STATS_FILL_BUCKETS - 1]++;
 
-#ifdef TEST_TIMING
-	    gettimeofday(&tstop,0);
-	    timersub(&tstop, &tstart, &tdiff);
-	    us_get += tdiff.tv_usec;
-	    gets++;	
-	    gettimeofday(&tstart,0);
-#endif
 	    if(ctx->block_write) i = alsa_write(ctx, pcm_buf, period_size);
-	    else i = alsa_write(ctx, 0, k/f2b);
+	    else {
+		i = alsa_write(ctx, pcm_buf, k/f2b);
+		pcm_buffer_release_read(ctx->pcm_buff, k);
+	    }
 
-#ifdef TEST_TIMING
-	    gettimeofday(&tstop,0);
-	    timersub(&tstop, &tstart, &tdiff);
-	    us_write += tdiff.tv_usec;
-	    writes++;	
-#endif
 	    if(ctx->block_write) {
 		blk_buffer_commit_playback(ctx->blk_buff);
-		if(i != period_size || ctx->state == STATE_INTR) {
+		if(i != period_size || get_state(ctx) == STATE_INTR) {
 		    log_info("eof or interrupt, exiting");
 		    break;
 		}
 		continue;
 	    }	
-	    if(i <= 0 || k != period_size * f2b) {
+	    if(i <= 0 || (k != period_size * f2b && !pad)) {
 	   	log_info("eof detected, exiting");
 		break;
 	    }
 	}
-#ifdef TEST_TIMING
-	if(gets && writes) log_info("avg get=%lld write=%lld", us_get/gets, us_write/writes);
-#endif
+	k = __atomic_load_n(&ctx->stats.dec_blocks, __ATOMIC_RELAXED);
+	if(k) log_info("avg decode=%lld us, write p50=%d us", 
+		__atomic_load_n(&ctx->stats.dec_us, __ATOMIC_RELAXED) / k, stats_percentile(&ctx->stats, 50));
 	ctx->audio_thread = 0;
 	playback_complete(ctx, __func__);
     return 0;	
@@ -421,8 +638,8 @@ static void *audio_write_thread(void *a)
 static jint audio_get_duration(JNIEnv *env, jobject obj, jlong jctx) 
 {
    playback_ctx *ctx = (playback_ctx *) jctx;	
-   if(!ctx || (ctx->state != STATE_PLAYING && ctx->state != STATE_PAUSED 
-	&& ctx->state != STATE_PAUSING)) return 0;	
+   enum playback_state state = ctx ? get_state(ctx) : STATE_STOPPED;
+   if(state != STATE_PLAYING && state != STATE_PAUSED && state != STATE_PAUSING) return 0;	
    return ctx->track_time;
 }
 
@@ -440,7 +657,8 @@ jint audio_get_cur_position(JNIEnv *env, jobject obj, jlong jctx)
    playback_ctx *ctx = (playback_ctx *) jctx;
    if(!ctx) return 0;
 //   if(!ctx || (ctx->state != STATE_PLAYING && ctx->state != STATE_PAUSED)) return 0;
-   return alsa_is_offload(ctx) ? alsa_time_pos_offload(ctx) : ctx->written/ctx->samplerate;
+   if(alsa_is_offload(ctx)) return alsa_time_pos_offload(ctx);
+   return ctx->written > 0 ? ctx->written/ctx->samplerate : 0;
 }
 
 
@@ -491,7 +709,7 @@ jlong audio_init(JNIEnv *env, jobject obj, jlong jctx, jint card, jint device)
 	pthread_cond_init(&ctx->cond_paused,0);
 	pthread_cond_init(&ctx->cond_resumed,0);
     }
-    ctx->state = STATE_STOPPED;
+    set_state(ctx, STATE_STOPPED);
     ctx->track_time = 0;
     log_info("audio_init: return ctx=%p",ctx);
     return (jlong) ctx;	
@@ -509,6 +727,8 @@ jboolean audio_exit(JNIEnv *env, jobject obj, jlong jctx)
     }	
     log_info("ctx=%p",ctx);
     audio_stop(ctx);
+    prefetch_discard(ctx);
+    flac_arena_free(ctx);
     alsa_exit(ctx);
     alsa_free_mixer_controls(ctx);
     if(ctx->pcm_buff) pcm_buffer_destroy(ctx->pcm_buff);	
@@ -685,6 +905,38 @@ static jint audio_play_exp(JNIEnv *env, jobject obj, jlong jctx, jstring jfile,
     return audio_play(env, obj, ctx, jfile, format, start);	
 }
 
+static jintArray audio_get_stats_exp(JNIEnv *env, jobject obj, jlong jctx) 
+{
+    playback_ctx *ctx = (playback_ctx *) jctx;	
+    jintArray ja;
+    int v[STAT_COUNT];
+	if(audio_get_stats(ctx, v, STAT_COUNT) != STAT_COUNT) return 0;
+	ja = (*env)->NewIntArray(env, STAT_COUNT);
+	if(ja) (*env)->SetIntArrayRegion(env, ja, 0, STAT_COUNT, (jint *) v);
+    return ja;
+}
+
+static jboolean audio_set_gapless_exp(JNIEnv *env, jobject obj, jlong jctx, jint linger_ms) 
+{
+    playback_ctx *ctx = (playback_ctx *) jctx;	
+    if(!ctx) return false;
+    audio_set_gapless(ctx, linger_ms);
+    return true;
+}
+
+static jboolean audio_prepare_next_exp(JNIEnv *env, jobject obj, jlong jctx, jstring jfile, jint format) 
+{
+    playback_ctx *ctx = (playback_ctx *) jctx;	
+    const char *file;
+    int ret;
+    if(!ctx || !jfile) return false;
+    file = (*env)->GetStringUTFChars(env,jfile,NULL);
+    if(!file) return false;
+    ret = audio_prepare_next(ctx, file, format);
+    (*env)->ReleaseStringUTFChars(env,jfile,file);
+    return (ret == 0);
+}
+
 static JNINativeMethod methods[] = {
  { "audioInit", "(JII)J", (void *) audio_init },
  { "audioExit", "(J)Z", (void *) audio_exit },
@@ -696,6 +948,9 @@ static JNINativeMethod methods[] = {
  { "audioDecreaseVolume", "(J)Z", (void *) audio_decrease_volume },
  { "audioIncreaseVolume", "(J)Z", (void *) audio_increase_volume },
  { "audioPlay", "(JLjava/lang/String;II)I", (void *) audio_play_exp },
+ { "audioGetStats", "(J)[I", (void *) audio_get_stats_exp },
+ { "audioSetGapless", "(JI)Z", (void *) audio_set_gapless_exp },
+ { "audioPrepareNext", "(JLjava/lang/String;I)Z", (void *) audio_prepare_next_exp },
  { "extractFlacCUE", "(Ljava/lang/String;)[I", (void *) extract_flac_cue },
  { "getAlsaDevices", "()[Ljava/lang/String;", (void *) get_devices },
  { "getCurrentDeviceInfo", "(J)Ljava/lang/String;", (void *) current_device_info },
@@ -1,6 +1,9 @@
 #ifndef _MAIN_H_INCLUDED
 #define _MAIN_H_INCLUDED
 
+#include <stdint.h>
+#include <sys/time.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -39,6 +42,8 @@ typedef int snd_pcm_format_t;
 
 typedef struct pcm_buffer_t pcm_buffer;		/* private struct pcm_buffer_t is defined in buffer.c */
 typedef struct blk_buffer_t blk_buffer;
+typedef struct pipeline_t pipeline;		/* pipeline.c */
+typedef struct decimator_t decimator;		/* decimate.c */
 
 typedef struct _playback_format_t {
     snd_pcm_format_t fmt;
@@ -50,6 +55,8 @@ typedef struct _playback_format_t {
 
 struct pcm_buffer_t;
 
+#define PIPE_MAX_CHANNELS	8	/* most channels handed to the output stage, see pipeline.c and convert.c */
+
 #define FORMAT_WAV	0
 #define FORMAT_FLAC	1
 #define FORMAT_APE	2
@@ -65,17 +72,55 @@ enum playback_state {
     STATE_INTR		/* linux only */	 	
 };
  
+/*  Playback statistics, always collected and readable at any time with audio_get_stats().
+    Every counter has a single writer thread; readers may see a slightly stale snapshot. */
+
+#define STATS_FILL_BUCKETS	10		/* buffer fill level in 10% steps */
+#define STATS_LAT_BUCKETS	24		/* write latency: bucket n holds [2^n, 2^(n+1)) usec */
+
+struct buffer_stats {
+    int fill_pct, depth;			/* depth in blocks or bytes */
+    int blocked_puts, total_puts;
+    int blocked_gets, total_gets;
+};
+
+struct playback_stats {
+    unsigned int fill_hist[STATS_FILL_BUCKETS];	/* sampled by audio thread once per period */
+    unsigned int lat_hist[STATS_LAT_BUCKETS];
+    unsigned int lat_max;			/* usec */
+    unsigned int underruns;			/* EPIPE from alsa */	
+    unsigned int xrun_us_last, xrun_us_max;	/* time from underrun to the next successful write */
+    struct timeval xrun_start;			/* set while recovering */
+    struct buffer_stats buf;			/* copied from pcm/blk buffer by audio thread */
+    struct timeval dec_start;			/* decoder thread only, see decode_begin() */
+    unsigned long long dec_us;			/* total time in decoder proper */
+    unsigned int dec_blocks;			/* blocks decoded, for STAT_DECODE_US */
+};
+
+/* Layout of the array returned by audio_get_stats() */
+enum {
+    STAT_UNDERRUNS = 0, STAT_XRUN_US_LAST, STAT_XRUN_US_MAX,
+    STAT_BLOCKED_PUTS, STAT_TOTAL_PUTS, STAT_BLOCKED_GETS, STAT_TOTAL_GETS,
+    STAT_DEPTH, STAT_FILL_PCT, STAT_DECODE_US,
+    STAT_WRITE_P50, STAT_WRITE_P90, STAT_WRITE_P99, STAT_WRITE_MAX,
+    STAT_FILL_HIST,
+    STAT_COUNT = STAT_FILL_HIST + STATS_FILL_BUCKETS
+};
+
 typedef struct {
-   volatile enum playback_state state;
+   enum playback_state state;		/* use get_state()/set_state() */
    int  track_time;			/* set by decoder */
    int  file_format;			/* FORMAT_* above, set on entry to audio_play */
    int  channels, bps;			/* set by decoder */
    int  samplerate;			/* playback samplerate. set by decoder initially, but may be scaled down by 2^n by */
    int  rate_dec;			/* alsa if it's not supported by hw, i.e.: samplerate = (file_samplerate >> rate_dec) */
+   int  downmix;			/* set by decoder if it can fold channels to stereo, alsa then sets channels = 2 if hw does not take them all */
+   int  dev_channels;			/* channels of the open stream after downmix */
+   float dmx[2][PIPE_MAX_CHANNELS];	/* downmix matrix of the open stream, copied by alsa from the defaults in convert.c */
    int  block_min, block_max;		/* set by decoder */
    int  frame_min, frame_max;		/* set by decoder */
    int  bitrate;			/* set by decoder */	
-   int  written;			/* set by audio thread */	
+   int  written;			/* set by audio thread, may go negative for a while after gapless switch */	
    void *xml_mixp;			/* descriptor for xml file with device controls ("/system/etc/mixer_paths.xml" or similar) */
    void *ctls;				/* cached mixer controls for current card */
    pthread_mutex_t mutex;
@@ -89,6 +134,15 @@ typedef struct {
    void *alsa_priv;
    int  alsa_error;			/* set on error exit from alsa thread  */
    int block_write;			/* alsa has agreed to select decoder block size for period size: use blk_buffer */
+   struct playback_stats stats;		/* reset in audio_start */
+   int gapless;				/* ms to keep the stream open after a track ends, 0 = off */
+   int linger;				/* track ended, the writer keeps the stream open for the next one */
+   long long produced;			/* bytes queued by decoder for the current track */
+   int open_rate, open_channels, open_bps;	/* parameters of the open stream as given by decoder */
+   int open_block;			/* largest block (frames) the ring was sized for */
+   void *next;				/* next tracks being prepared, see prefetch.c */
+   void *flac_arena;			/* flac decoder buffers kept between tracks */
+   void *caller_sched;			/* policy of the thread in audio_start() before we changed it, see sched.c */
    unsigned short ape_ver, ape_compr;	/* ape-specific stuff */
    unsigned int ape_fmt, ape_bpf;
    unsigned int ape_fin, ape_tot;
@@ -100,11 +154,40 @@ typedef struct {
 #endif				/* headphones' acdb_id */
 } playback_ctx;
 
+/*  State is read without locking on hot paths (see sync_state), and changed under
+    ctx->mutex, except for STATE_INTR set from the SIGINT handler on linux. */
+static inline enum playback_state get_state(playback_ctx *ctx) {
+    return __atomic_load_n(&ctx->state, __ATOMIC_RELAXED);
+}
+static inline void set_state(playback_ctx *ctx, enum playback_state state) {
+    __atomic_store_n(&ctx->state, state, __ATOMIC_RELEASE);
+}
+
+/*  Decoders bracket the decoding of each block with these. Buffer depth adapts to
+    the time in between rather than to the time taken to fill a buffer, and it is
+    what STAT_DECODE_US reports whatever the output path. */
+static inline void decode_begin(playback_ctx *ctx) {
+    gettimeofday(&ctx->stats.dec_start, 0);
+}
+static inline void decode_end(playback_ctx *ctx) {
+    struct timeval now, diff;
+    gettimeofday(&now, 0);
+    timersub(&now, &ctx->stats.dec_start, &diff);
+    __atomic_store_n(&ctx->stats.dec_us, ctx->stats.dec_us + diff.tv_sec * 1000000ULL + diff.tv_usec, __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->stats.dec_blocks, ctx->stats.dec_blocks + 1, __ATOMIC_RELAXED);
+}
+
 /* main.c */
 extern int audio_start(playback_ctx *ctx, int buffered_write);
 extern int audio_stop(playback_ctx *ctx);
 extern int audio_write(playback_ctx *ctx, void *buff, int size);
+extern void *audio_reserve(playback_ctx *ctx, int size);
+extern int audio_commit(playback_ctx *ctx, int size);
 extern int check_state(playback_ctx *ctx, const char *func);
+extern int audio_get_stats(playback_ctx *ctx, int *out, int n);
+extern void audio_set_gapless(playback_ctx *ctx, int linger_ms);
+extern void stats_write_done(playback_ctx *ctx, const struct timeval *tstart);
+extern void stats_underrun(playback_ctx *ctx);
 extern void update_track_time(JNIEnv *env, jobject obj, int time);
 extern enum playback_state  sync_state(playback_ctx *ctx, const char *func);
 extern jint audio_play(JNIEnv *env, jobject obj, playback_ctx* ctx, jstring jfile, jint format, jint start);
@@ -142,11 +225,15 @@ extern int alsa_is_usb_card(JNIEnv *env, jobject obj, int card);
 extern int alsa_is_offload_device(JNIEnv *env, jobject obj, int card, int device);
 #endif
 extern char *alsa_current_device_info(playback_ctx *ctx);
+extern const struct bufset *alsa_get_bufset(playback_ctx *ctx);
+extern const struct schedset *alsa_get_schedset(playback_ctx *ctx);
 #ifndef ANDROID
+extern struct bufset forced_bufset;
 extern char *ext_cards_file;
 extern int forced_chunks, forced_chunk_size;
 extern int force_mmap;
 extern int force_ring_buffer;
+extern int force_downmix;
 #endif
 
 /* alsa_offload.c */
@@ -156,31 +243,119 @@ extern bool alsa_resume_offload(playback_ctx *ctx);
 extern int alsa_time_pos_offload(playback_ctx *ctx);
 extern int mp3_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int start);
 
+/* sched.c */
+extern void sched_apply(const struct schedset *ss, int writer);
+extern void sched_apply_caller(playback_ctx *ctx, const struct schedset *ss, int writer);
+extern void sched_restore_caller(playback_ctx *ctx);
+
+/* prefetch.c */
+#define PREFETCH_BYTES	(4*1024*1024)	/* read ahead of the next track */
+extern int audio_prepare_next(playback_ctx *ctx, const char *file, int format);
+extern void *prefetch_take(playback_ctx *ctx, const char *file, int format);
+extern void prefetch_discard(playback_ctx *ctx);
+
+/* convert.c */
+enum {	/* stereo decorrelation, same order as in flac */
+    DECORR_NONE,
+    DECORR_LEFT_SIDE,
+    DECORR_RIGHT_SIDE,
+    DECORR_MID_SIDE,
+};
+extern int pcm_convert(const playback_format_t *format, int32_t **planes, int channels, int out_channels, int frames, int stride, int decorr, const float (*dmx)[PIPE_MAX_CHANNELS], void *out);
+extern int downmix_matrix(int channels, float (*m)[PIPE_MAX_CHANNELS]);
+extern int downmix_set(const char *spec);
+
+/* pipeline.c */
+extern pipeline *pipeline_start(playback_ctx *ctx, int channels, int max_frames, int pad_frames);
+extern int32_t **pipeline_request(pipeline *pl);
+extern void pipeline_commit(pipeline *pl, int frames, int stride, int decorr);
+extern int pipeline_finish(pipeline *pl, int now);
+
+/* decimate.c */
+extern decimator *decimator_init(int channels, int rate_dec, int rate, int bps, int period);
+extern int decimate(decimator *d, int32_t **planes, int from, int frames);
+extern int decimator_flush(decimator *d, int32_t **planes, int from);
+extern void decimator_free(decimator *d);
+
 /* buffer.c */
 extern pcm_buffer *pcm_buffer_create(int size);
+extern void pcm_buffer_set_depth(pcm_buffer *buff, int min_bytes, int bytes_per_sec, const unsigned long long *dec_us);	/* adapt fill limit between min_bytes and size */
 extern int pcm_buffer_put(pcm_buffer *buff, void *src, int bytes);
 extern int pcm_buffer_get(pcm_buffer *buff, void *dst, int bytes);
+extern void *pcm_buffer_reserve_write(pcm_buffer *buff, int bytes);	/* zero-copy put: reserve, fill, commit */
+extern int pcm_buffer_commit_write(pcm_buffer *buff, int bytes);
+extern void *pcm_buffer_peek_read(pcm_buffer *buff, int *bytes);	/* zero-copy get: peek, consume, release */
+extern void *pcm_buffer_peek_read_timed(pcm_buffer *buff, int *bytes, int timeout_ms);
+extern void pcm_buffer_release_read(pcm_buffer *buff, int bytes);
 extern void pcm_buffer_stop(pcm_buffer *buff, int now);	/* Stop accepting new frames. If now == 1, stop providing new frames as well. */
 extern void pcm_buffer_destroy(pcm_buffer *buff);
+extern void pcm_buffer_get_stats(pcm_buffer *buff, struct buffer_stats *st);
+extern int pcm_buffer_mlock(pcm_buffer *buff);
 
 extern blk_buffer *blk_buffer_create(int bufsz, int count); 
+extern int blk_buffer_reset(blk_buffer *buff, int bufsz, int count);	/* reuse for next track, grow if needed */
+extern void blk_buffer_set_depth(blk_buffer *buff, int min, int max, int usec_per_blk, const unsigned long long *dec_us);	/* adapt number of blocks in use */
 extern void *blk_buffer_request_decoding(blk_buffer *buff);
 extern void blk_buffer_commit_decoding(blk_buffer *buff);
 extern void *blk_buffer_request_playback(blk_buffer *buff);
 extern void blk_buffer_commit_playback(blk_buffer *buff);
 extern void blk_buffer_stop(blk_buffer *buff, int now);
+extern void blk_buffer_get_stats(blk_buffer *buff, struct buffer_stats *st);
+extern int blk_buffer_mlock(blk_buffer *buff);
 extern void blk_buffer_destroy(blk_buffer *buff);
 
 
 /* flac/main.c */
 extern int flac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int start);
 extern JNIEXPORT jintArray JNICALL extract_flac_cue(JNIEnv *env, jobject obj, jstring jfile);
+extern void *flac_prefetch(playback_ctx *ctx, const char *file);
+extern void flac_prefetch_free(void *data);
+extern void flac_arena_free(playback_ctx *ctx);
+extern int flac_verify_file(const char *file, char *msg, int size);
+
+/* flac/parallel.c */
+struct FLACContext;
+struct flac_par;
+extern int flac_threads;	/* decoder threads, -1 = auto, 0 = off */
+extern struct flac_par *flac_par_start(playback_ctx *ctx, struct FLACContext *fc);
+extern int flac_par_next(struct flac_par *par, void *mptr, void *mend, int eof, int32_t ***planes, int *len);
+extern void flac_par_free(struct flac_par *par);
+
+/* ape/parallel.c */
+struct ape_ctx_t;
+struct ape_par;
+extern int ape_threads;		/* decoder threads, -1 = auto, 0 = off */
+extern struct ape_par *ape_par_start(playback_ctx *ctx, const struct ape_ctx_t *ape, int fd, off_t flen);
+extern int ape_par_next(struct ape_par *par, int frame, int32_t ***planes);
+extern void ape_par_free(struct ape_par *par);
+
+/* flac/lpc.c */
+extern int flac_lpc_bench(void);
+
+/* flac/verify.c */
+extern int flac_verify;		/* check frame crc and stream md5 while playing */
+
+/* flac/index.c */
+struct flac_index;
+struct flac_index_point {
+    uint64_t sample;
+    uint64_t offset:63, cont:1;	/* cont: played through up to the next point */
+};
+extern struct flac_index *flac_index_open(const char *file);
+extern void flac_index_close(struct flac_index *idx);
+extern void flac_index_add(struct flac_index *idx, uint64_t sample, uint64_t offset);
+extern void flac_index_end(struct flac_index *idx, uint64_t sample, uint64_t offset);
+extern int flac_index_find(const struct flac_index *idx, uint64_t target, struct flac_index_point *lo, struct flac_index_point *hi);
 
 /* ape/main.c */
 extern int ape_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int start);
+extern void *ape_prefetch(playback_ctx *ctx, const char *file);
+extern void ape_prefetch_free(void *data);
 
 /* wav_main.c */
 extern int wav_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int start);
+extern void *wav_prefetch(playback_ctx *ctx, const char *file);
+extern void wav_prefetch_free(void *data);
 
 /* alac_main.c */
 extern int alac_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int start);
@@ -227,6 +402,28 @@ static inline void free_perset(struct perset *nv) {
     }	
 }
 
+/*  Bounds for adaptive buffer depth: lowest and highest latency in ms, and memory 
+    limit in KB which takes precedence over max_ms. */
+
+struct bufset {
+    int min_ms, max_ms, max_kb;
+};
+
+#define BUFSET_MIN_MS	250
+#define BUFSET_MAX_MS	4000
+#define BUFSET_MAX_KB	8192
+
+/*  Thread policy: realtime scheduling (SCHED_FIFO/SCHED_RR; SCHED_OTHER to disable) for the writer 
+    and optionally for the decoder, cpu to pin each of them to (-1 for any), and whether to mlock 
+    the buffers between them. */
+
+struct schedset {
+    int policy, prio;
+    int decoder_prio;
+    int writer_cpu, decoder_cpu;
+    int mlock;
+};
+
 /* for mixer_paths.xml */
 extern void *xml_mixp_open(const char *xml_path);
 extern void xml_mixp_close(void *xml);
@@ -242,6 +439,8 @@ extern int xml_dev_is_mmapped(void *xml);
 extern int xml_dev_exists(void *xml, int device);  /* used with device=-1 in xml_dev_open */	
 extern struct nvset *xml_dev_find_ctls(void *xml, const char *name, const char *value);
 extern struct perset *xml_dev_find_persets(void *xml);
+extern int xml_dev_find_bufset(void *xml, struct bufset *bs);
+extern int xml_dev_find_schedset(void *xml, struct schedset *ss);
 extern int xml_get_mixer_path(void *xml, char* path, size_t length);
 
 /* for audio_platform_info.xml */
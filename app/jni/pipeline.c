@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifdef ANDROID
+#include <android/log.h>
+#endif
+#include <jni_sub.h>
+#define __force
+#define __bitwise
+#define __user
+#include <sound/asound.h>
+#include "main.h"
+
+/*  Decoder pipeline for block_write mode. The decoder thread only parses and decodes
+    into planar blocks; a second thread converts them to the output format and fills
+    ctx->blk_buff, from which the audio writer thread feeds alsa. The stages are linked
+    by blk_buffers, so no locks are taken on the way. */
+
+#define PIPE_BLOCKS	4
+#define PIPE_HDR	64	/* keeps planes cache line aligned */
+
+struct pipe_hdr {
+    int frames;		/* frames to output */
+    int stride;		/* take every stride-th decoded sample */
+    int decorr;		/* stereo decorrelation still to be done */
+};
+
+struct pipeline_t {
+    playback_ctx *ctx;
+    blk_buffer *q;	/* decoded blocks */
+    pthread_t thread;
+    int channels, max_frames, pad_frames;
+    int frame_bytes;
+    const playback_format_t *format;
+    int32_t *planes[PIPE_MAX_CHANNELS];
+    int stopped;	/* output buffer was stopped */
+};
+
+static inline void blk_planes(pipeline *pl, void *blk, int32_t **planes)
+{
+    int c;
+	for(c = 0; c < pl->channels; c++)
+	    planes[c] = (int32_t *) (blk + PIPE_HDR) + c * pl->max_frames;
+}
+
+static void *convert_thread(void *a)
+{
+    pipeline *pl = (pipeline *) a;
+    playback_ctx *ctx = pl->ctx;
+    struct schedset ss = *alsa_get_schedset(ctx);
+    struct pipe_hdr *hdr;
+    int32_t *planes[PIPE_MAX_CHANNELS];
+    void *pcmbuf;
+
+	ss.decoder_cpu = -1;	/* should not share a cpu with decoder */
+	sched_apply(&ss, 0);
+	while(1) {
+	    /* Output block is requested first, so that the time spent waiting
+	       for decoder is accounted for in blk_buff's depth control. */
+	    pcmbuf = blk_buffer_request_decoding(ctx->blk_buff);
+	    if(!pcmbuf) {
+		log_info("output stopped");
+		pl->stopped = 1;
+		blk_buffer_stop(pl->q, 1);
+		break;
+	    }
+	    hdr = (struct pipe_hdr *) blk_buffer_request_playback(pl->q);
+	    if(!hdr) break;
+	    blk_planes(pl, hdr, planes);
+	    pcm_convert(pl->format, planes, pl->channels, ctx->channels, hdr->frames, hdr->stride, hdr->decorr, ctx->dmx, pcmbuf);
+	    if(hdr->frames < pl->pad_frames) {
+		log_info("short buffer, should be eof");
+		memset(pcmbuf + hdr->frames * pl->frame_bytes, 0, (pl->pad_frames - hdr->frames) * pl->frame_bytes);
+	    }
+	    blk_buffer_commit_playback(pl->q);
+	    blk_buffer_commit_decoding(ctx->blk_buff);
+	}
+    return 0;
+}
+
+/* Returns zero if the pipeline should not or cannot be used, decoder then converts by itself */
+pipeline *pipeline_start(playback_ctx *ctx, int channels, int max_frames, int pad_frames)
+{
+    pipeline *pl;
+
+	if(!ctx->block_write || !ctx->blk_buff || channels > PIPE_MAX_CHANNELS) return 0;
+	if(sysconf(_SC_NPROCESSORS_ONLN) < 2) return 0;
+	pl = (pipeline *) calloc(1, sizeof(pipeline));
+	if(!pl) return 0;
+	pl->ctx = ctx;
+	pl->channels = channels;
+	pl->max_frames = (max_frames + 15) & ~15;
+	pl->pad_frames = pad_frames;
+	pl->format = alsa_get_format(ctx);
+	pl->frame_bytes = ctx->channels * (pl->format->phys_bits/8);	/* fewer if downmixed */
+	pl->q = blk_buffer_create(PIPE_HDR + channels * pl->max_frames * sizeof(int32_t), PIPE_BLOCKS);
+	if(!pl->q) {
+	    free(pl);
+	    return 0;
+	}
+	if(pthread_create(&pl->thread, 0, convert_thread, pl) != 0) {
+	    log_err("cannot start conversion thread");
+	    blk_buffer_destroy(pl->q);
+	    free(pl);
+	    return 0;
+	}
+	log_info("decoding pipeline started");
+    return pl;
+}
+
+/* Returns planar buffers of max_frames samples to be filled by decoder,
+   or zero if playback has been stopped */
+int32_t **pipeline_request(pipeline *pl)
+{
+    void *blk = blk_buffer_request_decoding(pl->q);
+	if(!blk) return 0;
+	blk_planes(pl, blk, pl->planes);
+    return pl->planes;
+}
+
+void pipeline_commit(pipeline *pl, int frames, int stride, int decorr)
+{
+    struct pipe_hdr *hdr = (struct pipe_hdr *) (pl->planes[0] - PIPE_HDR/sizeof(int32_t));
+	hdr->frames = frames;
+	hdr->stride = stride;
+	hdr->decorr = decorr;
+	blk_buffer_commit_decoding(pl->q);
+}
+
+/* Waits for the queued blocks to be converted unless now != 0.
+   Returns nonzero if output had been stopped. */
+int pipeline_finish(pipeline *pl, int now)
+{
+    int ret;
+	blk_buffer_stop(pl->q, now);
+	pthread_join(pl->thread, 0);
+	ret = pl->stopped;
+	blk_buffer_destroy(pl->q);
+	free(pl);
+    return ret;
+}
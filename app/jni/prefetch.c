@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifdef ANDROID
+#include <android/log.h>
+#endif
+#include <jni_sub.h>
+#include "main.h"
+
+/*  Preparation of the next track while the current one is playing: the file is opened,
+    read ahead and parsed, with the start of it decoded for flac and ape. The decoder
+    picks it up with prefetch_take() if audio_play() is then called for the same file.
+    The last PREFETCH_MAX files prepared are kept, so the track about to be played
+    survives preparing the one after it. */
+
+#define PREFETCH_MAX	2
+
+struct prefetch {
+    struct prefetch *link;	/* older entry */
+    pthread_t thread;
+    playback_ctx *ctx;
+    char *file;
+    int format;
+    void *data;		/* decoder specific, see flac_prefetch() etc */
+};
+
+static void warm_cache(const char *file)
+{
+    int fd = open(file, O_RDONLY);
+	if(fd < 0) {
+	    log_err("cannot open %s", file);
+	    return;
+	}
+	posix_fadvise(fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+static void *prefetch_thread(void *a)
+{
+    struct prefetch *pf = (struct prefetch *) a;
+    struct timeval tstart, tstop, tdiff;
+
+	gettimeofday(&tstart, 0);
+	switch(pf->format) {
+	    case FORMAT_FLAC:
+		pf->data = flac_prefetch(pf->ctx, pf->file);
+		break;
+	    case FORMAT_APE:
+		pf->data = ape_prefetch(pf->ctx, pf->file);
+		break;
+	    case FORMAT_WAV:
+		pf->data = wav_prefetch(pf->ctx, pf->file);
+		break;
+	    default:
+		warm_cache(pf->file);
+		break;
+	}
+	gettimeofday(&tstop, 0);
+	timersub(&tstop, &tstart, &tdiff);
+	log_info("%s prepared in %ld ms", pf->file, tdiff.tv_sec * 1000 + tdiff.tv_usec / 1000);
+    return 0;
+}
+
+/* Thread must be joined */
+static void prefetch_release(struct prefetch *pf)
+{
+	if(pf->data) {
+	    switch(pf->format) {
+		case FORMAT_FLAC:
+		    flac_prefetch_free(pf->data);
+		    break;
+		case FORMAT_APE:
+		    ape_prefetch_free(pf->data);
+		    break;
+		case FORMAT_WAV:
+		    wav_prefetch_free(pf->data);
+		    break;
+	    }
+	}
+	free(pf->file);
+	free(pf);
+}
+
+static void prefetch_free(struct prefetch *pf)
+{
+	pthread_join(pf->thread, 0);
+	prefetch_release(pf);
+}
+
+int audio_prepare_next(playback_ctx *ctx, const char *file, int format)
+{
+    struct prefetch *pf, **pp, *old = 0;
+    int n = 1;
+
+	if(!ctx || !file) return LIBLOSSLESS_ERR_INV_PARM;
+	pthread_mutex_lock(&ctx->mutex);
+	for(pf = (struct prefetch *) ctx->next; pf; pf = pf->link)
+	    if(pf->format == format && strcmp(pf->file, file) == 0) break;
+	pthread_mutex_unlock(&ctx->mutex);
+	if(pf) return 0;	/* already there */
+
+	pf = (struct prefetch *) calloc(1, sizeof(struct prefetch));
+	if(!pf) return LIBLOSSLESS_ERR_NOMEM;
+	pf->ctx = ctx;
+	pf->file = strdup(file);
+	pf->format = format;
+	if(!pf->file || pthread_create(&pf->thread, 0, prefetch_thread, pf) != 0) {
+	    log_err("cannot start prefetch thread");
+	    if(pf->file) free(pf->file);
+	    free(pf);
+	    return LIBLOSSLESS_ERR_INIT;
+	}
+	pthread_mutex_lock(&ctx->mutex);
+	pf->link = (struct prefetch *) ctx->next;
+	ctx->next = pf;
+	for(pp = &pf->link; *pp; pp = &(*pp)->link)
+	    if(++n > PREFETCH_MAX) {	/* drop the oldest ones */
+		old = *pp;
+		*pp = 0;
+		break;
+	    }
+	pthread_mutex_unlock(&ctx->mutex);
+	while(old) {
+	    pf = old->link;
+	    prefetch_free(old);
+	    old = pf;
+	}
+    return 0;
+}
+
+/* Returns decoder specific data if it was prepared for this file, to be freed by the decoder.
+   Entries for other files are left alone. */
+void *prefetch_take(playback_ctx *ctx, const char *file, int format)
+{
+    struct prefetch *pf, **pp;
+    void *data;
+
+	pthread_mutex_lock(&ctx->mutex);
+	for(pp = (struct prefetch **) &ctx->next; (pf = *pp) != 0; pp = &pf->link)
+	    if(pf->format == format && strcmp(pf->file, file) == 0) {
+		*pp = pf->link;
+		break;
+	    }
+	pthread_mutex_unlock(&ctx->mutex);
+	if(!pf) return 0;
+	pthread_join(pf->thread, 0);	/* next track requested early: just wait */
+	data = pf->data;
+	pf->data = 0;
+	prefetch_release(pf);
+    return data;
+}
+
+void prefetch_discard(playback_ctx *ctx)
+{
+    struct prefetch *pf, *next;
+	pthread_mutex_lock(&ctx->mutex);
+	pf = (struct prefetch *) ctx->next;
+	ctx->next = 0;
+	pthread_mutex_unlock(&ctx->mutex);
+	for(; pf; pf = next) {
+	    next = pf->link;
+	    prefetch_free(pf);
+	}
+}
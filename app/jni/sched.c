@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#ifdef ANDROID
+#include <android/log.h>
+#endif
+#include <jni_sub.h>
+#include "main.h"
+
+/*  Thread policy for the audio writer and the decoder thread (the one calling audio_play(),
+    which is a dedicated playback thread both in java and in linux_main).
+    The decoder thread is not ours, so what it had is saved before the first change and 
+    put back when playback completes or is stopped.
+    Nothing here is fatal: playback goes on with whatever we were allowed to set. */
+
+struct sched_saved {
+    pid_t tid;
+    int policy;
+    struct sched_param sp;
+    int nice, have_nice;
+    cpu_set_t cpus;
+    int have_cpus;
+};
+
+static int set_rt_policy(int policy, int prio)
+{
+    struct sched_param sp;
+    struct rlimit rl;
+    int k;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = prio;
+	k = pthread_setschedparam(pthread_self(), policy, &sp);
+	if(k != EPERM) return k;
+
+	/* Unprivileged: we may still be allowed up to RLIMIT_RTPRIO */
+	if(getrlimit(RLIMIT_RTPRIO, &rl) != 0) return EPERM;
+	if(rl.rlim_cur < rl.rlim_max) {
+	    rl.rlim_cur = rl.rlim_max;
+	    setrlimit(RLIMIT_RTPRIO, &rl);
+	    getrlimit(RLIMIT_RTPRIO, &rl);
+	}
+	if(rl.rlim_cur == 0) return EPERM;
+	if(rl.rlim_cur != RLIM_INFINITY && prio > (int) rl.rlim_cur) {
+	    log_info("priority %d limited to %d by RLIMIT_RTPRIO", prio, (int) rl.rlim_cur);
+	    sp.sched_priority = rl.rlim_cur;
+	}
+    return pthread_setschedparam(pthread_self(), policy, &sp);
+}
+
+static void set_cpu(int cpu)
+{
+    cpu_set_t mask;
+
+	if(cpu < 0) return;
+	if(cpu >= sysconf(_SC_NPROCESSORS_CONF) || cpu >= CPU_SETSIZE) {
+	    log_err("no cpu %d", cpu);
+	    return;
+	}
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if(sched_setaffinity(0, sizeof(mask), &mask) != 0)
+	    log_err("cannot bind to cpu %d: %s", cpu, strerror(errno));
+	else log_info("bound to cpu %d", cpu);
+}
+
+/* To be called by the thread itself */
+void sched_apply(const struct schedset *ss, int writer)
+{
+    int prio, k;
+
+	if(!ss) return;
+	set_cpu(writer ? ss->writer_cpu : ss->decoder_cpu);
+
+	prio = writer ? ss->prio : ss->decoder_prio;
+	if(ss->policy == SCHED_OTHER || prio <= 0) return;
+	if(prio < sched_get_priority_min(ss->policy)) prio = sched_get_priority_min(ss->policy);
+	if(prio > sched_get_priority_max(ss->policy)) prio = sched_get_priority_max(ss->policy);
+
+	k = set_rt_policy(ss->policy, prio);
+	if(k == 0) {
+	    log_info("%s thread: %s priority %d", writer ? "writer" : "decoder",
+		ss->policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", prio);
+	    return;
+	}
+	log_info("%s thread: realtime policy not permitted (%s), raising nice level",
+		writer ? "writer" : "decoder", strerror(k));
+	if(setpriority(PRIO_PROCESS, syscall(__NR_gettid), writer ? -16 : -8) != 0)
+	    log_info("cannot raise nice level either");
+}
+
+/* For the thread calling audio_start(): as above, saving its own policy first */
+void sched_apply_caller(playback_ctx *ctx, const struct schedset *ss, int writer)
+{
+    struct sched_saved *sv;
+
+	if(!ss) return;
+	if(!ctx->caller_sched) {
+	    sv = (struct sched_saved *) calloc(1, sizeof(struct sched_saved));
+	    if(!sv) return;	/* better not touch what can't be undone */
+	    sv->tid = syscall(__NR_gettid);
+	    sv->policy = sched_getscheduler(0);
+	    sched_getparam(0, &sv->sp);
+	    errno = 0;
+	    sv->nice = getpriority(PRIO_PROCESS, sv->tid);
+	    sv->have_nice = (errno == 0);
+	    sv->have_cpus = (sched_getaffinity(0, sizeof(sv->cpus), &sv->cpus) == 0);
+	    __atomic_store_n(&ctx->caller_sched, sv, __ATOMIC_RELEASE);
+	}
+	sched_apply(ss, writer);
+}
+
+/* May be called from any thread: the saved one is addressed by its tid */
+void sched_restore_caller(playback_ctx *ctx)
+{
+    struct sched_saved *sv = (struct sched_saved *) __atomic_exchange_n(&ctx->caller_sched, 0, __ATOMIC_ACQ_REL);
+
+	if(!sv) return;
+	if(sv->policy >= 0 && sched_setscheduler(sv->tid, sv->policy, &sv->sp) != 0)
+	    log_info("cannot restore policy of thread %d: %s", sv->tid, strerror(errno));
+	if(sv->have_nice) setpriority(PRIO_PROCESS, sv->tid, sv->nice);
+	if(sv->have_cpus) sched_setaffinity(sv->tid, sizeof(sv->cpus), &sv->cpus);
+	log_info("policy of thread %d restored", sv->tid);
+	free(sv);
+}
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <regex.h>
+#include <sched.h>
 #include "tinyxml2.h"
 
 extern "C" {
@@ -33,6 +34,15 @@ extern "C" {
 	int periods, period_size;
 	struct perset *next;
     };
+    struct bufset {
+	int min_ms, max_ms, max_kb;
+    };
+    struct schedset {
+	int policy, prio;
+	int decoder_prio;
+	int writer_cpu, decoder_cpu;
+	int mlock;
+    };
 }
 
 class MixXML : public XMLDocument {
@@ -380,6 +390,88 @@ extern "C" struct perset *xml_dev_find_persets(void *xml)
     return ret;	
 }
 
+/* Calls fn for each <path name="name"> setting of this device: those found in named 
+   card paths first, then the device's own one, so that it overrides the others. */
+
+static int for_each_setting(DeviceXML *m, const char *name, 
+		int (*fn)(XMLElement *, void *), void *arg)
+{
+    XMLElement *e, *e1, *e2, *dev = 0;
+    int ret = 0;
+
+    for(e = m->get_dev_root()->FirstChildElement(); e; e = e->NextSiblingElement()) {
+	if(strcmp(e->Name(), "path") == 0 && e->Attribute("name", name)) {
+	    dev = e;
+	    continue;	
+	}
+	const char *c = e->Attribute("name");
+	if(!c) continue;
+	for(e1 = m->get_card_root()->FirstChildElement(); e1; e1 = e1->NextSiblingElement()) {
+	    if(strcmp(e1->Name(), "path") == 0 && e1->Attribute("name", c)) {
+		for(e2 = e1->FirstChildElement(); e2; e2 = e2->NextSiblingElement()) {
+		    if(strcmp(e2->Name(), "path") == 0 && e2->Attribute("name", name)) 
+			ret |= fn(e2, arg);
+		}
+	    }
+	}
+    }
+    if(dev) ret |= fn(dev, arg);
+    return ret;	
+}
+
+/*
+ <path name="bufset" min_ms="250" max_ms="4000" max_kb="8192"/>, any attribute may be omitted
+*/
+
+static int get_bufset(XMLElement *e, void *arg)
+{
+    struct bufset *bs = (struct bufset *) arg;
+    int k, ret = 0;
+	if(e->QueryIntAttribute("min_ms", &k) == XML_SUCCESS && k > 0) { bs->min_ms = k; ret = 1; }
+	if(e->QueryIntAttribute("max_ms", &k) == XML_SUCCESS && k > 0) { bs->max_ms = k; ret = 1; }
+	if(e->QueryIntAttribute("max_kb", &k) == XML_SUCCESS && k > 0) { bs->max_kb = k; ret = 1; }
+    return ret;
+}
+
+extern "C" int xml_dev_find_bufset(void *xml, struct bufset *bs)
+{
+    DeviceXML *m = (DeviceXML *) xml; 	
+    if(!m || !m->is_valid() || m->is_card_only()) return 0;	
+    return for_each_setting(m, "bufset", get_bufset, bs);
+}
+
+/*
+ <path name="sched" policy="fifo|rr|other" prio="10" decoder_prio="0" writer_cpu="2" decoder_cpu="3" mlock="1"/>
+*/
+
+static int get_schedset(XMLElement *e, void *arg)
+{
+    struct schedset *ss = (struct schedset *) arg;
+    int k, ret = 0;
+    const char *c;
+	c = e->Attribute("policy");
+	if(c) {
+	    if(strcmp(c, "fifo") == 0) ss->policy = SCHED_FIFO;
+	    else if(strcmp(c, "rr") == 0) ss->policy = SCHED_RR;
+	    else if(strcmp(c, "other") == 0) ss->policy = SCHED_OTHER;
+	    else return 0;
+	    ret = 1;	
+	}
+	if(e->QueryIntAttribute("prio", &k) == XML_SUCCESS && k >= 0) { ss->prio = k; ret = 1; }
+	if(e->QueryIntAttribute("decoder_prio", &k) == XML_SUCCESS && k >= 0) { ss->decoder_prio = k; ret = 1; }
+	if(e->QueryIntAttribute("writer_cpu", &k) == XML_SUCCESS) { ss->writer_cpu = k; ret = 1; }
+	if(e->QueryIntAttribute("decoder_cpu", &k) == XML_SUCCESS) { ss->decoder_cpu = k; ret = 1; }
+	if(e->QueryIntAttribute("mlock", &k) == XML_SUCCESS) { ss->mlock = k; ret = 1; }
+    return ret;
+}
+
+extern "C" int xml_dev_find_schedset(void *xml, struct schedset *ss)
+{
+    DeviceXML *m = (DeviceXML *) xml; 	
+    if(!m || !m->is_valid() || m->is_card_only()) return 0;	
+    return for_each_setting(m, "sched", get_schedset, ss);
+}
+
 extern "C" int xml_get_mixer_path(void *xml, char* path, size_t length)
 {
 	DeviceXML *m = (DeviceXML *) xml;
@@ -184,6 +184,51 @@ void __attribute__((naked)) convert24_asm(int8_t *dst, int8_t *src, int num_24bi
 
 #define MMAP_SIZE       (128*1024*1024)
 
+/* Next track mapped and parsed by prefetch thread */
+struct wav_prefetch {
+    int fd;
+    void *mm;
+    size_t map_len;
+    off_t flen, off;
+    int samplerate, channels, bps;
+};
+
+void wav_prefetch_free(void *data)
+{
+    struct wav_prefetch *pf = (struct wav_prefetch *) data;
+	if(pf->mm != MAP_FAILED) munmap(pf->mm, pf->map_len);
+	if(pf->fd >= 0) close(pf->fd);
+	free(pf);
+}
+
+void *wav_prefetch(playback_ctx *ctx, const char *file)
+{
+    struct wav_prefetch *pf = (struct wav_prefetch *) calloc(1, sizeof(struct wav_prefetch));
+	if(!pf) return 0;
+	pf->mm = MAP_FAILED;
+	pf->fd = open(file, O_RDONLY);
+	if(pf->fd < 0) {
+	    log_err("cannot open %s", file);
+	    goto err_exit;
+	}
+	pf->flen = lseek(pf->fd, 0, SEEK_END);
+	if(pf->flen <= 0) goto err_exit;
+	pf->map_len = pf->flen > MMAP_SIZE ? MMAP_SIZE : pf->flen;
+	pf->mm = mmap(0, pf->map_len, PROT_READ, MAP_SHARED, pf->fd, 0);
+	if(pf->mm == MAP_FAILED) {
+	    log_err("mmap failed for %s: %s", file, strerror(errno));
+	    goto err_exit;
+	}
+	pf->off = wav_init(&pf->samplerate, &pf->channels, &pf->bps, pf->mm, pf->map_len);
+	if(!pf->off || !pf->samplerate || !pf->channels || !pf->bps) goto err_exit;
+	posix_fadvise(pf->fd, pf->off, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+    return pf;
+
+    err_exit:
+	wav_prefetch_free(pf);
+    return 0;
+}
+
 int wav_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int start) 
 {
     int i, k, read_bytes, ret = 0, fd = -1;
@@ -198,6 +243,7 @@ int wav_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int sta
     const off_t pg_mask = sysconf(_SC_PAGESIZE) - 1;    
     const playback_format_t *format;	
     struct timeval tstart, tstop, tdiff;
+    struct wav_prefetch *pf = 0;
 #if defined(__ARM_ARCH_7A__)
     int optimise = 0;	
 #endif
@@ -213,6 +259,24 @@ int wav_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int sta
 #else
 	file = jfile;
 #endif
+	if(!start) pf = (struct wav_prefetch *) prefetch_take(ctx, file, FORMAT_WAV);
+	if(pf) {	/* mapped and parsed while the previous track played */
+	    log_info("using prepared track");
+	    fd = pf->fd;
+	    flen = pf->flen;
+	    mm = pf->mm;
+	    cur_map_off = 0;
+	    cur_map_len = pf->map_len;
+	    off = pf->off;
+	    samplerate = pf->samplerate;
+	    channels = pf->channels;
+	    bps = pf->bps;
+	    free(pf);
+#ifdef ANDROID
+	    (*env)->ReleaseStringUTFChars(env,jfile,file);
+#endif
+	    goto parsed;
+	}
 	fd = open(file, O_RDONLY);
 	if(fd < 0) {
 	    log_err("cannot open %s", file);
@@ -241,6 +305,7 @@ int wav_play(JNIEnv *env, jobject obj, playback_ctx *ctx, jstring jfile, int sta
 #endif
 	off = wav_init(&samplerate, &channels, &bps, mm, cur_map_len);
 
+    parsed:
 	if(!off || !samplerate || !channels || !bps) {
 	    ret = LIBLOSSLESS_ERR_FORMAT;
 	    goto done;	
@@ -960,6 +960,7 @@ public class AlsaPlayer extends ActionBarActivity implements Comparator<File> {
             if(prefs.shpr.getBoolean("hs_insert_mode", false)) prefs.headset_mode |= AlsaPlayerSrv.HANDLE_HEADSET_INSERT;
             if(srv != null) try {
             	srv.set_headset_mode(prefs.headset_mode);
+            	srv.set_gapless(prefs.shpr.getBoolean("gapless_mode", false));
             } catch (RemoteException r) {
             	log_err("remote exception while trying to set headset_mode");
             }
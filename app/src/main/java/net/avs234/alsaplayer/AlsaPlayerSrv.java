@@ -64,6 +64,12 @@ public class AlsaPlayerSrv extends Service {
 	public static native boolean	inOffloadMode(long ctx);	 
 
 	public static native int []	extractFlacCUE(String file);
+	// Playback statistics, see STAT_* in native main.h for the layout
+	public static native int []	audioGetStats(long ctx);
+	// Keep the stream open for lingerMs after a track ends, so that the next audioPlay 
+	// with the same format continues it without a gap. 0 turns this off.
+	public static native boolean	audioSetGapless(long ctx, int lingerMs);
+	public static native boolean	audioPrepareNext(long ctx, String file, int format);
 
 	public static native String []  getAlsaDevices();
 	public static native String	getCurrentDeviceInfo(long ctx);
@@ -127,6 +133,10 @@ public class AlsaPlayerSrv extends Service {
 	public static final String ACTION_VIEW = "alsaPlayer_view";
 	
 	private static int headset_mode = 0;
+
+	// gapless: the stream is kept open this long after a track for the next one
+	private static final int GAPLESS_LINGER_MS = 2000;
+	private static boolean gapless = false;
 	
 	public static int curTrackLen = 0;
 	public static int curTrackStart = 0;
@@ -415,6 +425,32 @@ public class AlsaPlayerSrv extends Service {
 			return audioGetDuration(ctx);
 		}
 						
+		// Gapless mode is per context, so it's set again for each track
+		private void alsa_ctx() {
+			if(ctx == 0) ctx = audioInit(0, cur_card, cur_device);
+			if(ctx != 0) audioSetGapless(ctx, gapless ? GAPLESS_LINGER_MS : 0);
+			prepare_next();
+		}
+
+		// Formats of the files played through ALSA regardless of the device, -1 for the rest
+		private int alsa_format(String f) {
+			String s = f.toLowerCase();
+			if(s.endsWith(".flac")) return FORMAT_FLAC;
+			if(s.endsWith(".ape")) return FORMAT_APE;
+			if(s.endsWith(".wav")) return FORMAT_WAV;
+			if(s.endsWith(".m4a")) return FORMAT_ALAC;
+			return -1;
+		}
+
+		// Native side keeps the current track's prepared file too, see prefetch.c
+		private void prepare_next() {
+			if(ctx == 0 || names[cur_pos] != null || cur_pos + 1 >= files.length) return;
+			String next = files[cur_pos+1];
+			int format = alsa_format(next);
+			if(format < 0 || next.equals(files[cur_pos])) return;
+			if(!audioPrepareNext(ctx, next, format)) log_err("cannot prepare " + next);
+		}
+
 		private class PlayThread extends Thread {
 			private int tid = -1;
 			public void run() {
@@ -455,29 +491,30 @@ public class AlsaPlayerSrv extends Service {
 						}
 						if(files[cur_pos].endsWith(".flac") || files[cur_pos].endsWith(".FLAC")) {
 							cur_mode = MODE_ALSA;
-							if(ctx == 0) ctx = audioInit(0, cur_card, cur_device);
+							alsa_ctx();
 							if(ctx == 0) k = 1;
 							else k = audioPlay(ctx, files[cur_pos], FORMAT_FLAC, times[cur_pos]+cur_start);
 						} else if(files[cur_pos].endsWith(".ape") || files[cur_pos].endsWith(".APE")) {
 							cur_mode = MODE_ALSA;
-							if(ctx == 0) ctx = audioInit(0, cur_card, cur_device);
+							alsa_ctx();
 							if(ctx == 0) k = 1;
 							else k = audioPlay(ctx, files[cur_pos], FORMAT_APE, times[cur_pos]+cur_start);
 						} else if(files[cur_pos].endsWith(".wav") || files[cur_pos].endsWith(".WAV")) {
 							cur_mode = MODE_ALSA;
-							if(ctx == 0) ctx = audioInit(0, cur_card, cur_device);
+							alsa_ctx();
 							if(ctx == 0) k = 1;
 							else k = audioPlay(ctx, files[cur_pos], FORMAT_WAV, times[cur_pos]+cur_start);
 						} else if(files[cur_pos].endsWith(".m4a") || files[cur_pos].endsWith(".M4A")) {
 							cur_mode = MODE_ALSA;
-							if(ctx == 0) ctx = audioInit(0, cur_card, cur_device);
+							alsa_ctx();
 							if(ctx == 0) k = 1;
 							else k = audioPlay(ctx, files[cur_pos], FORMAT_ALAC, times[cur_pos]+cur_start);
 						} else if(files[cur_pos].endsWith(".mp3") || files[cur_pos].endsWith(".MP3")) {
-							if(ctx == 0) ctx = audioInit(0, cur_card, cur_device);
+							alsa_ctx();
 							boolean offload = (ctx != 0) ? inOffloadMode(ctx) : false;
 							if(!offload) {
 								cur_mode = MODE_NONE;	
+								if(ctx != 0 && gapless) audioSetGapless(ctx, 0);
 								k = extPlay(files[cur_pos],times[cur_pos]+cur_start);
 							} else {
 								cur_mode = MODE_ALSA;
@@ -485,6 +522,7 @@ public class AlsaPlayerSrv extends Service {
 							}
 			              		} else {
 							cur_mode = MODE_NONE;	
+							if(ctx != 0 && gapless) audioSetGapless(ctx, 0);
 							k = extPlay(files[cur_pos],times[cur_pos]+cur_start);
 						}
 			              		nm.cancel(NOTIFY_ID);
@@ -509,6 +547,7 @@ public class AlsaPlayerSrv extends Service {
 					}
 					if(names[0]!= null) break; // just in case
 				}
+				if(ctx != 0 && gapless) audioSetGapless(ctx, 0);	// play out the last track
 				if(wakeLock.isHeld()) wakeLock.release();
 				log_msg(Process.myTid() + ": thread about to exit");
 				if(k == 0) informTrack(getString(R.string.strStopped),true);
@@ -709,6 +748,7 @@ public class AlsaPlayerSrv extends Service {
 		public String  	get_cur_track_source()	{ try { return plist.files[plist.cur_pos]; } catch(Exception e) {return null;} }
 		public String  	get_cur_track_name()	{ try { return plist.names[plist.cur_pos]; } catch(Exception e) {return null;} }
 		public void	set_headset_mode(int m)	{ headset_mode = m; }
+		public void	set_gapless(boolean on)	{ gapless = on; }
 		public void 	registerCallback(IAlsaPlayerSrvCallback cb)   { if(cb != null) cBacks.register(cb); };
 		public void 	unregisterCallback(IAlsaPlayerSrvCallback cb) { if(cb != null) cBacks.unregister(cb); };
 		public int []	get_cue_from_flac(String file) 	{ return  extractFlacCUE(file); };
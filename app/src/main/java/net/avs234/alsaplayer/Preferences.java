@@ -80,6 +80,11 @@ public class Preferences extends PreferenceActivity {
         hs_insert_mode.setKey("hs_insert_mode");
         launchPrefCat.addPreference(hs_insert_mode);
 
+        CheckBoxPreference gapless_mode = new CheckBoxPreference(this);
+        gapless_mode.setTitle(R.string.strGapless);
+        gapless_mode.setKey("gapless_mode");
+        launchPrefCat.addPreference(gapless_mode);
+
 
 	/* ************************* */
 